@@ -56,12 +56,20 @@
 #ifndef INCLUDE_CRC_H
 #define INCLUDE_CRC_H
 
+#ifdef HOST_TEST
+#include "HostTest.h"				/* make hosttest */
+#else
 #include <machine/limits.h>			/* UINT_MAX */
 
 // needs both to declare UInt32
 
 #include <libkern/OSByteOrder.h>
 #include <IOKit/IOLib.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {	// the same linkage for CRC.cpp and all users, whether they include us in extern "C" or not
+#endif
 
 // AJ: begin CRC code (ported from Linux driver usbdnet.c written by
 // Stuart Lynne <sl@lineo.com> and Tom Rushworth <tbr@lineo.com>
@@ -69,27 +77,99 @@
 // David Brownell <dbrownell@users.sourceforge.net>
 // -->
 
-extern UInt32 crc32_table[256];
+// NOTE: this is the reflected IEEE polynomial 0xedb88320 and not CRC32C, so the SSE4.2 crc32
+// instruction can't be used. A carry-less multiply (PCLMULQDQ/PMULL) folding kernel would need
+// the vector registers which a kext (built with -mkernel) must not touch since the kernel does
+// not save their state for us. Therefore the table driven slicing-by-8 code below is the only
+// engine. All users go through the fcs_* functions, so it can be replaced in this file alone.
+
+extern const UInt32 crc32_table[8][256];
 
 #define CRC32_INITFCS     0xffffffff  // Initial FCS value 
 #define CRC32_GOODFCS     0xdebb20e3  // Good final FCS value 
 
-#define CRC32_FCS(fcs, c) (((fcs) >> 8) ^ crc32_table[((fcs) ^ (c)) & 0xff])
+#define CRC32_FCS(fcs, c) (((fcs) >> 8) ^ crc32_table[0][((fcs) ^ (c)) & 0xff])
+
+/* crc32_slice8 - advance fcs over 8 bytes
+ * The 8 bytes are passed as two 32 bit words in little endian (i.e. wire) order.
+ * This is the slicing-by-8 algorithm: one table lookup per byte but no dependency
+ * of the lookups on each other, so they can be issued in parallel.
+ */
+static inline UInt32 crc32_slice8(UInt32 fcs, UInt32 lo, UInt32 hi)
+{
+    lo ^= fcs;
+    return crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff] ^
+           crc32_table[5][(lo >> 16) & 0xff] ^ crc32_table[4][lo >> 24] ^
+           crc32_table[3][hi & 0xff] ^ crc32_table[2][(hi >> 8) & 0xff] ^
+           crc32_table[1][(hi >> 16) & 0xff] ^ crc32_table[0][hi >> 24];
+}
 
 /* fcs_memcpy32 - memcpy and calculate fcs
  * Perform a memcpy and calculate fcs using ppp 32bit CRC algorithm.
+ * Copy and CRC are done in a single pass. The unaligned head is handled byte by byte
+ * until the destination is on a 32 bit boundary, so that the body is stored in aligned
+ * words (16 bytes per iteration) while the source may still be unaligned (mbuf data).
  */ 
 static inline UInt32 fcs_memcpy32(unsigned char *dp, unsigned char *sp, int len, UInt32 fcs)
 {   
+    for (; len > 0 && ((unsigned long) dp & 3); len--)
+        fcs = CRC32_FCS(fcs, *dp++ = *sp++);
+    for (; len >= 16; len -= 16, dp += 16, sp += 16)
+        {
+        UInt32 w0 = OSReadLittleInt32(sp, 0);
+        UInt32 w1 = OSReadLittleInt32(sp, 4);
+        UInt32 w2 = OSReadLittleInt32(sp, 8);
+        UInt32 w3 = OSReadLittleInt32(sp, 12);
+        OSWriteLittleInt32(dp, 0, w0);
+        OSWriteLittleInt32(dp, 4, w1);
+        OSWriteLittleInt32(dp, 8, w2);
+        OSWriteLittleInt32(dp, 12, w3);
+        fcs = crc32_slice8(fcs, w0, w1);
+        fcs = crc32_slice8(fcs, w2, w3);
+        }
+    if (len >= 8)
+        {
+        UInt32 lo = OSReadLittleInt32(sp, 0);
+        UInt32 hi = OSReadLittleInt32(sp, 4);
+        OSWriteLittleInt32(dp, 0, lo);
+        OSWriteLittleInt32(dp, 4, hi);
+        fcs = crc32_slice8(fcs, lo, hi);
+        len -= 8, dp += 8, sp += 8;
+        }
     for (;len-- > 0; fcs = CRC32_FCS(fcs, *dp++ = *sp++));
     return fcs;
 }
 
+/* crc32_zeros - advance fcs over len zero bytes in O(log len)
+ * crc32_combine - CRC of A followed by B from the CRCs of A and B (len2 = length of B)
+ * The latter works on final CRCs (complemented fcs) as well as on raw fcs values
+ * if the fcs of B was started with 0 instead of CRC32_INITFCS. So large buffers can
+ * be checksummed in independent pieces and stitched together.
+ */
+extern UInt32 crc32_zeros(UInt32 fcs, UInt32 len);
+extern UInt32 crc32_combine(UInt32 crc1, UInt32 crc2, UInt32 len2);
+
+#define CRC32_ZEROS_MIN	128	// below this a table lookup loop is faster than crc32_zeros()
+
 /* fcs_pad32 - pad and calculate fcs
  * Pad and calculate fcs using ppp 32bit CRC algorithm.
+ * Since the data is all zero, only the fcs bytes need a lookup (4 per 8 pad bytes)
+ * and long pads (high speed endpoints) are handled by crc32_zeros().
  */
 static inline UInt32 fcs_pad32(unsigned char *dp, int len, UInt32 fcs)
 {
+    if (len >= CRC32_ZEROS_MIN)
+        {
+        bzero(dp, len);
+        return crc32_zeros(fcs, len);
+        }
+    for (; len >= 8; len -= 8, dp += 8)
+        {
+        OSWriteLittleInt32(dp, 0, 0);
+        OSWriteLittleInt32(dp, 4, 0);
+        fcs = crc32_table[7][fcs & 0xff] ^ crc32_table[6][(fcs >> 8) & 0xff] ^
+              crc32_table[5][(fcs >> 16) & 0xff] ^ crc32_table[4][fcs >> 24];
+        }
     for (;len-- > 0; fcs = CRC32_FCS(fcs, *dp++ = '\0'));
     return fcs;
 }
@@ -99,10 +179,70 @@ static inline UInt32 fcs_pad32(unsigned char *dp, int len, UInt32 fcs)
  */
 static inline UInt32 fcs_compute32(unsigned char *sp, int len, UInt32 fcs)
 {
+    for (; len >= 8; len -= 8, sp += 8)
+        fcs = crc32_slice8(fcs, OSReadLittleInt32(sp, 0), OSReadLittleInt32(sp, 4));
     for (;len-- > 0; fcs = CRC32_FCS(fcs, *sp++));
     return fcs;
 }
+
+/* fcs_compute32_multi - calculate fcs of up to CRC32_MAX_STREAMS independent buffers
+ * Same result as calling fcs_compute32() for each buffer, but the streams are interleaved
+ * so that the table lookups of one buffer overlap the dependency chain of the others.
+ * Used to verify a batch of received frames.
+ */
+#define CRC32_MAX_STREAMS	4
+
+extern void fcs_compute32_multi(unsigned char **sp, const UInt32 *len, UInt32 *fcs, int n);
 // <--
 
+/* inet_memcpy_sum - memcpy and accumulate the internet (ones complement) checksum
+ * The data is summed as big endian 32 bit words into a 64 bit accumulator, which gives
+ * the same 16 bit ones complement sum after inet_fold(). len may be odd, but then
+ * the next call must start on an odd position: fold and byte swap its result instead.
+ * inet_sum - the same without copying (for headers)
+ */
+static inline UInt64 inet_memcpy_sum(unsigned char *dp, const unsigned char *sp, int len, UInt64 sum)
+{
+    for (; len >= 4; len -= 4, dp += 4, sp += 4)
+        {
+        UInt32 w = OSReadBigInt32(sp, 0);
+        OSWriteBigInt32(dp, 0, w);
+        sum += w;
+        }
+    if (len >= 2)
+        {
+        UInt16 w = OSReadBigInt16(sp, 0);
+        OSWriteBigInt16(dp, 0, w);
+        sum += w;
+        len -= 2, dp += 2, sp += 2;
+        }
+    if (len > 0)
+        sum += (UInt32) (*dp = *sp) << 8;
+    return sum;
+}
+
+static inline UInt64 inet_sum(const unsigned char *sp, int len, UInt64 sum)
+{
+    for (; len >= 4; len -= 4, sp += 4)
+        sum += OSReadBigInt32(sp, 0);
+    if (len >= 2)
+        sum += OSReadBigInt16(sp, 0), len -= 2, sp += 2;
+    if (len > 0)
+        sum += (UInt32) *sp << 8;
+    return sum;
+}
+
+/* inet_fold - fold an accumulated sum to 16 bits (not complemented) */
+static inline UInt16 inet_fold(UInt64 sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (UInt16) sum;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif INCLUDE_CRC_H
 /* EOF */
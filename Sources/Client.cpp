@@ -87,7 +87,7 @@ UInt16	stats[13] = {	kXMIT_OK_REQ,
  .       open()
  .         enable()
  .             ((
- .             outputPacket()
+ .             outputPackets()
  .             message()
  .             timeoutOccurred()
  .             [[wakeUp()]]
@@ -156,16 +156,62 @@ bool net_lucid_cake_driver_AJZaurusUSB::init(OSDictionary *properties)
     fPacketFilter = kPACKET_TYPE_DIRECTED | kPACKET_TYPE_BROADCAST | kPACKET_TYPE_MULTICAST;
     fPadded = true;		// default to use padding (TODO: find out whether this is really necessary)
     fChecksum = true;
-    
-    for (i=0; i<kOutBufPool; i++)
+    fFCSVerifyInterval = 1;	// verify every received frame
+    fFCSVerifyCountdown = 1;
+    fFCSChecked = 0;
+    fFCSFailed = 0;
+    fNCM = false;
+    fNCM32 = false;
+    fNtbTxMaxSize = 0;		// as large as the device allows
+    fNtbTxTimeout = kNCMTxTimeoutUS;
+    fNtbSequence = 0;
+    fNtbPoolIndx = kOutBufNone;
+    fNtbTimer = NULL;
+    fNtbSerial = 0;
+    fNtbTimerSerial = 0;
+    fTxDoneSource = NULL;
+    fRxSource = NULL;
+    fRNDIS = false;
+    fRndisRequestId = 0;
+    fRndisAlignment = 4;
+    fEEM = false;
+    selectFraming();
+    fTxQueueCapacity = TRANSMIT_QUEUE_SIZE;
+    fTxBatchSize = kTxBatchMax;
+    fInReads = kInReadsDefault;
+    fInZeroCopy = false;
+    fInPacketCount = 0;
+    fTxPending = 0;
+    fTsoBacklog = NULL;
+    tx_depth_init(&fTxDepth, kTxDelayTargetUS, kOutBufHighWater);
+    fTxLastArrival = 0;
+    fTxGapAvg = kTxGapMaxUS;
+    bzero(fTxBatchHist, sizeof(fTxBatchHist));
+    fInQueued = 0;
+    fRxBytes = 0;
+    fRxBytesCopied = 0;
+    bzero(fRxBatchHist, sizeof(fRxBatchHist));
+    
+    for (i=0; i<kOutBufSlots; i++)
         { // initialize output buffer reference block
 			fPipeOutBuff[i].pipeOutMDP = NULL;
 			fPipeOutBuff[i].pipeOutBuffer = NULL;
 			fPipeOutBuff[i].inuse = false;
+			fPipeOutBuff[i].packet = NULL;
+			fPipeOutBuff[i].chainMDP = NULL;
         }
-    
-    fLock = IOSimpleLockAlloc();
-    return true;
+    bzero(fOutSlab, sizeof(fOutSlab));
+    fOutSlabCount = 0;
+    fOutSlabBytes = 0;
+    fOutSlotSize = 0;
+    fOutSlabPeak = 0;
+    fOutSlabLargeUsed = false;
+    fOutSlabIdle = 0;
+    initOutputBuffers();
+    
+    fNtbLock = IOLockAlloc();
+    fOutSlabLock = IOLockAlloc();
+    return (fNtbLock != NULL && fOutSlabLock != NULL);
     
 }/* end init*/
 
@@ -225,6 +271,9 @@ IOService *net_lucid_cake_driver_AJZaurusUSB::probe(IOService *provider, SInt32
 bool net_lucid_cake_driver_AJZaurusUSB::start(IOService *provider)
 {
     UInt8	configs;	// number of device configurations
+    OSNumber	*verify;
+    OSNumber	*queue;
+    OSNumber	*ncm;
     
     IOLog("AJZaurusUSB::start - this=%p provider=%p\n", this, provider);
 	IOSleep(20);
@@ -234,6 +283,46 @@ bool net_lucid_cake_driver_AJZaurusUSB::start(IOService *provider)
         return false;
         }
     
+    // Get the receive FCS verification policy (from the personality)
+    
+    verify = OSDynamicCast(OSNumber, getProperty(kFCSVerifyIntervalKey));
+    if(verify)
+        {
+        fFCSVerifyInterval = verify->unsigned32BitValue();
+        fFCSVerifyCountdown = fFCSVerifyInterval;
+        IOLog("AJZaurusUSB::start - verify FCS of 1 in %lu received frames\n", fFCSVerifyInterval);
+        }
+    
+    // Get the output queue parameters (from the personality)
+    
+    queue = OSDynamicCast(OSNumber, getProperty(kTxQueueCapacityKey));
+    if(queue)
+        fTxQueueCapacity = queue->unsigned32BitValue();
+    queue = OSDynamicCast(OSNumber, getProperty(kTxBatchSizeKey));
+    if(queue)
+        fTxBatchSize = queue->unsigned32BitValue();
+    queue = OSDynamicCast(OSNumber, getProperty(kTxDelayTargetKey));
+    if(queue)
+        fTxDepth.target = queue->unsigned32BitValue();
+    
+    // Get the number of bulk in reads in flight (from the personality)
+    
+    queue = OSDynamicCast(OSNumber, getProperty(kInReadsKey));
+    if(queue)
+        fInReads = MAX(1, MIN(kInReadsMax, queue->unsigned32BitValue()));
+    
+    // Get the NCM aggregation parameters (from the personality)
+    
+    ncm = OSDynamicCast(OSNumber, getProperty(kNCMTxMaxSizeKey));
+    if(ncm)
+        fNtbTxMaxSize = ncm->unsigned32BitValue();
+    ncm = OSDynamicCast(OSNumber, getProperty(kNCMTxTimeoutKey));
+    if(ncm)
+        fNtbTxTimeout = ncm->unsigned32BitValue();
+    ncm = OSDynamicCast(OSNumber, getProperty(kNCMFormatKey));
+    if(ncm)
+        fNCM32 = (ncm->unsigned32BitValue() == 32);	// only a wish - ncmConfigure checks the device
+    
     // Get my USB device provider - the device
     
     fpDevice = OSDynamicCast(IOUSBDevice, provider);
@@ -361,8 +450,9 @@ IOReturn net_lucid_cake_driver_AJZaurusUSB::enable(IONetworkInterface *netif)
     
     // Start our IOOutputQueue object.
     
-    fTransmitQueue->setCapacity(TRANSMIT_QUEUE_SIZE);
-    IOLog("AJZaurusUSB::enable - capacity set to %d\n", TRANSMIT_QUEUE_SIZE);
+    fTransmitQueue->setCapacity(fTxQueueCapacity);
+    fTransmitQueue->setBatchSize(fTxBatchSize);
+    IOLog("AJZaurusUSB::enable - capacity set to %lu, batches of %lu\n", fTxQueueCapacity, fTxBatchSize);
     fTransmitQueue->start();
     IOLog("AJZaurusUSB::enable - transmit queue started\n");
     
@@ -491,12 +581,9 @@ IOReturn net_lucid_cake_driver_AJZaurusUSB::message(UInt32 type, IOService *prov
 			// and again...
 			if (fDataDead)
 				{
-				ior = fInPipe->Read(fPipeInMDP,
-									5000,	// 5 seconds until timeout
-									5000,
-									fPipeInMDP->getLength(),
-									&fReadCompletionInfo,
-									NULL);
+				fWorkLoop->closeGate();	// the ring belongs to the workloop
+				ior = fillReadRing();
+				fWorkLoop->openGate();
 				if (ior != kIOReturnSuccess)
 					{
 					IOLog("AJZaurusUSB::message - Failed to queue Data pipe read: %d\n", ior);
@@ -530,6 +617,51 @@ IOReturn net_lucid_cake_driver_AJZaurusUSB::message(UInt32 type, IOService *prov
     return kIOReturnUnsupported;
 }/* end message */
 
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::setProperties
+//
+//		Inputs:		properties - dictionary from user space (e.g. ioreg/IORegistryEntrySetCFProperties)
+//
+//		Outputs:	Return code - kIOReturnSuccess, kIOReturnBadArgument or kIOReturnUnsupported
+//
+//		Desc:		Changes the receive FCS verification interval at run time. frameInput reads
+//					it on the workloop, so it is updated with the gate closed.
+//
+/****************************************************************************************************/
+
+IOReturn net_lucid_cake_driver_AJZaurusUSB::setProperties(OSObject *properties)
+{
+    OSDictionary	*dict;
+    OSObject		*value;
+    OSNumber		*verify;
+    UInt32			interval;
+    
+    dict = OSDynamicCast(OSDictionary, properties);
+    if (!dict)
+        return kIOReturnBadArgument;
+    value = dict->getObject(kFCSVerifyIntervalKey);
+    if (!value)
+        return kIOReturnUnsupported;	// nothing else may be changed
+    verify = OSDynamicCast(OSNumber, value);
+    if (!verify)
+        return kIOReturnBadArgument;
+    interval = verify->unsigned32BitValue();
+    
+    if (fWorkLoop)
+        fWorkLoop->closeGate();
+    fFCSVerifyInterval = interval;
+    fFCSVerifyCountdown = 1;	// verify the next frame, then 1 in interval
+    if (fWorkLoop)
+        fWorkLoop->openGate();
+    setProperty(kFCSVerifyIntervalKey, interval, 32);
+    
+    IOLog("AJZaurusUSB::setProperties - verify FCS of 1 in %lu received frames\n", interval);
+    
+    return kIOReturnSuccess;
+    
+}/* end setProperties */
+
 /****************************************************************************************************/
 //
 //		Method:		net_lucid_cake_driver_AJZaurusUSB::outputPacket
@@ -540,13 +672,12 @@ IOReturn net_lucid_cake_driver_AJZaurusUSB::message(UInt32 type, IOService *prov
 //		Outputs:	Return code - kIOReturnOutputSuccess or kIOReturnOutputStall
 //
 //		Desc:		Packet transmission. The BSD mbuf needs to be formatted correctly
-//					and transmitted
+//					and transmitted. Our output queue calls outputPackets instead.
 //
 /****************************************************************************************************/
 
 UInt32 net_lucid_cake_driver_AJZaurusUSB::outputPacket(mbuf_t pkt, void *param)
 {
-    UInt32	ret = kIOReturnOutputSuccess;
 #if 0
     IOLog("AJZaurusUSB::outputPacket(%p)\n", pkt);
 	IOSleep(20);
@@ -554,25 +685,215 @@ UInt32 net_lucid_cake_driver_AJZaurusUSB::outputPacket(mbuf_t pkt, void *param)
 	if(!pkt)
         {
         IOLog("AJZaurusUSB::outputPacket(NULL)\n");
-		return ret;
+		return kIOReturnOutputSuccess;
 		}
+    return outputPackets(&pkt, 1) ? kIOReturnOutputSuccess : kIOReturnOutputStall;
+}/* end outputPacket */
+
+/****************************************************************************************************/
+//
+//		Function:	tsoRequested
+//
+//		Inputs:		m - a packet from the stack
+//					v6, mss - where to store the TSO request
+//
+//		Outputs:	true if it is a TCP segment we must cut into frames (i.e. longer than a frame)
+//
+/****************************************************************************************************/
+
+static inline bool tsoRequested(mbuf_t m, bool *v6, UInt32 *mss)
+{
+#ifdef TSO_SUPPORTED
+    mbuf_tso_request_flags_t	request = 0;
+    u_int32_t	value = 0;
+    
+    if (mbuf_get_tso_requested(m, &request, &value) != 0 || !(request & (MBUF_TSO_IPV4 | MBUF_TSO_IPV6)) || value == 0)
+        return false;
+    *v6 = (request & MBUF_TSO_IPV6) != 0;
+    *mss = value;
+    return mbuf_pkthdr_len(m) > kTsoMinLength;
+#else
+    return false;
+#endif
+}
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::outputPackets
+//
+//		Inputs:		pkts - the packets (at most kTxBatchMax)
+//					count - how many
+//
+//		Outputs:	Return code - number of packets consumed (sent, in flight or dropped). The
+//					others are left to the output queue which retries them after a restart.
+//
+//		Desc:		Batch transmission from the output queue. TSO segments are cut into frames
+//					which are kept in fTsoBacklog until they are sent, so a stall in the middle of
+//					one loses nothing. Frames of the backlog go out before any new packet.
+//
+/****************************************************************************************************/
+
+UInt32 net_lucid_cake_driver_AJZaurusUSB::outputPackets(mbuf_t *pkts, UInt32 count)
+{
+    mbuf_t	frames[kTxBatchMax];
+    bool	v6;
+    UInt32	mss;
+    UInt32	done = 0, n, sent;
+    
 	if(!fLinkStatus)
         {
-        IOLog("AJZaurusUSB::outputPacket(%p) - link is down (%d)\n", pkt, fLinkStatus);
-        if(fOutputErrsOK)
-            fpNetStats->outputErrors++;
-        } 
-    else if(!USBTransmitPacket(pkt))
-        { // wasn't able to transmit
-			ret = kIOReturnOutputStall;
-			// ret = kIOReturnOutputDropped;
-			IOLog("AJZaurusUSB::outputPacket(%p) - packet dropped\n", pkt);
+        tsoFlush();
+        IOLog("AJZaurusUSB::outputPackets(%lu) - link is down (%d)\n", count, fLinkStatus);
+        for (done = 0; done < count; done++)
+            {
+            if(fOutputErrsOK)
+                fpNetStats->outputErrors++;
+            // If the driver drops a packet, it should also put the mbuf_t back into the network stack's
+            // common pool by invoking the superclasss freePacket function.   
+            freePacket(pkts[done]);
+            }
+        return count;
         }
-	// If the driver returns kIOReturnDropped, it should also put the mbuf_t back into the network stack's
-	// common pool by invoking the superclasss freePacket function.   
-	freePacket(pkt);
-    return ret;
-}/* end outputPacket */
+    
+    for (;;)
+        {
+        while (fTsoBacklog)
+            { // send the frames of the last TSO segment first
+            for (n = 0; n < kTxBatchMax && fTsoBacklog; n++)
+                {
+                frames[n] = fTsoBacklog;
+                fTsoBacklog = mbuf_nextpkt(frames[n]);
+                mbuf_setnextpkt(frames[n], NULL);
+                }
+            sent = transmitPackets(frames, n);
+            if (sent < n)
+                { // stalled - put the rest back and retry it first
+                while (n-- > sent)
+                    {
+                    mbuf_setnextpkt(frames[n], fTsoBacklog);
+                    fTsoBacklog = frames[n];
+                    }
+                return done;
+                }
+            }
+        if (done == count)
+            return done;
+        if (tsoRequested(pkts[done], &v6, &mss))
+            { // cut it into frames - the segment itself is consumed now
+            fTsoBacklog = tsoSegment(pkts[done], v6, mss);
+            freePacket(pkts[done]);
+            done++;
+            continue;
+            }
+        for (n = 1; done + n < count && !tsoRequested(pkts[done+n], &v6, &mss); n++)
+            ;	// a run of ordinary packets
+        sent = transmitPackets(pkts + done, n);
+        done += sent;
+        if (sent < n)
+            return done;	// the queue keeps the rest and retries it when the queue is restarted
+        }
+}/* end outputPackets */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::transmitPackets
+//
+//		Inputs:		pkts - the frames (at most kTxBatchMax)
+//					count - how many
+//
+//		Outputs:	Return code - number of frames consumed (sent, in flight or dropped)
+//
+//		Desc:		NCM, RNDIS and EEM append the whole batch with one fNtbLock acquisition.
+//					The other modes reserve an output buffer for each frame with one pop from
+//					the free list. The next mbuf is prefetched while the current one is copied.
+//
+/****************************************************************************************************/
+
+UInt32 net_lucid_cake_driver_AJZaurusUSB::transmitPackets(mbuf_t *pkts, UInt32 count)
+{
+    UInt32	poolIndx[kTxBatchMax];
+    UInt32	reserved, done, i;
+    UInt32	ret;
+    
+    if (fNtbAppend)
+        { // NCM, RNDIS, EEM: the appended packets are consumed (copied or dropped)
+        IOLockLock(fNtbLock);
+        for (done = 0; done < count; done++)
+            {
+            fTxPending = count - done - 1;	// don't flush a transfer which the rest of the batch can fill
+            if (fTxPending)
+                __builtin_prefetch(mbuf_data(pkts[done+1]));
+            if ((this->*fNtbAppend)(pkts[done]) == kIOReturnOutputStall)
+                break;
+            }
+        fTxPending = 0;
+        IOLockUnlock(fNtbLock);
+        return done;
+        }
+    
+    reserved = acquireOutputBuffers(poolIndx, MIN(count, kTxBatchMax), false);
+    for (done = 0; done < reserved; done++)
+        {
+        if (done+1 < reserved)
+            __builtin_prefetch(mbuf_data(pkts[done+1]));
+        if (fOutSlotSize < fOutBufSize && mbuf_pkthdr_len(pkts[done]) + fOutPacketSize + 5 > fOutSlotSize)
+            { // the frame with padding and CRC may not fit into a regular buffer - swap for a large one
+            releaseOutputBuffer(poolIndx[done]);
+            if (!acquireOutputBuffer(&poolIndx[done], true))
+                {
+                if (!fOutSlab[kOutSlabLarge])
+                    { // couldn't allocate the large buffers - no completion would ever restart the queue for it
+                    IOLog("AJZaurusUSB::transmitPackets - no large output buffer, packet dropped (len=%lu)\n", mbuf_pkthdr_len(pkts[done]));
+                    freePacket(pkts[done]);
+                    if (fOutputErrsOK)
+                        fpNetStats->outputErrors++;
+                    continue;
+                    }
+                for (i = done+1; i < reserved; i++)
+                    releaseOutputBuffer(poolIndx[i]);	// all large buffers in flight - their completions restart the queue
+                break;
+                }
+            }
+        // USBTransmitPacket consumes the packet (copied, in flight or dropped)
+        if((ret = USBTransmitPacket(pkts[done], poolIndx[done])) == kIOReturnOutputDropped)
+			IOLog("AJZaurusUSB::transmitPackets - packet dropped\n");
+        }
+    return done;
+}/* end transmitPackets */
+
+/****************************************************************************************************/
+//
+//		Function:	setHistogramProperty
+//
+//		Inputs:		entry - where to publish
+//					key - property name
+//					hist - kTxBatchBuckets counters
+//
+//		Outputs:	
+//
+/****************************************************************************************************/
+
+static void setHistogramProperty(IORegistryEntry *entry, const char *key, const UInt32 *hist)
+{
+    OSArray		*array = OSArray::withCapacity(kTxBatchBuckets);
+    OSNumber	*num;
+    int			i;
+    
+    if (array)
+        {
+        for (i = 0; i < kTxBatchBuckets; i++)
+            {
+            num = OSNumber::withNumber(hist[i], 32);
+            if (num)
+                {
+                array->setObject(num);
+                num->release();
+                }
+            }
+        entry->setProperty(key, array);
+        array->release();
+        }
+}
 
 /****************************************************************************************************/
 //
@@ -596,10 +917,33 @@ void net_lucid_cake_driver_AJZaurusUSB::timeoutOccurred(IOTimerEventSource *time
 	//    IOLog("AJZaurusUSB::timeoutOccurred\n");
     
     if (fReady)
-        fTransmitQueue->service(IOBasicOutputQueue::kServiceAsync); // AJ: revive a stalled queue (according to Apple's documentation, this call doesn't do any harm, even if the queue wasn't stalled).
+        fTransmitQueue->service(net_lucid_cake_driver_AJZaurusUSBOutputQueue::kServiceAsync); // AJ: revive a stalled queue (according to Apple's documentation, this call doesn't do any harm, even if the queue wasn't stalled).
     else
         IOLog("AJZaurusUSB::timeoutOccurred - Spurious\n");    
     
+    if (fChecksum)
+        { // publish receive FCS statistics so that the verification policy can be tuned
+        setProperty(kFCSFramesCheckedKey, fFCSChecked, 32);
+        setProperty(kFCSFramesFailedKey, fFCSFailed, 32);
+        }
+    
+    if (fReady)
+        shrinkOutputBuffers();
+    setProperty(kOutBufMemoryKey, fOutSlabBytes, 32);
+    
+    // publish the in-flight depth controller state and start a new base latency window now and then
+    
+    setProperty(kTxDepthKey, fTxDepth.limit, 32);
+    setProperty(kTxLatencyKey, fTxDepth.latAvg, 32);
+    setProperty(kTxBaseLatencyKey, tx_depth_base(&fTxDepth), 32);
+    setProperty(kRxBytesKey, fRxBytes, 64);
+    setProperty(kRxBytesCopiedKey, fRxBytesCopied, 64);
+    tx_depth_tick(&fTxDepth);
+    
+    if (fNtbFlush)	// publish the transmit batch sizes so that the aggregation limits can be tuned
+        setHistogramProperty(this, kTxBatchHistogramKey, fTxBatchHist);
+    setHistogramProperty(this, kRxBatchHistogramKey, fRxBatchHist);
+    
     if ((fEthernetStatistics[0]|fEthernetStatistics[1]|fEthernetStatistics[2]|fEthernetStatistics[3]) == 0)
         { // no bit is set
 			//       IOLog("AJZaurusUSB::timeoutOccurred - No Ethernet statistics defined\n");
@@ -761,24 +1105,24 @@ bool net_lucid_cake_driver_AJZaurusUSB::wakeUp()
     //    }
     if(rtn == kIOReturnSuccess)
         {
-        // Read the data-in bulk pipe:
+        // Read the data-in bulk pipe (fInReads reads at once):
         
-        fReadCompletionInfo.target = this;
-        fReadCompletionInfo.action = dataReadComplete;
-        fReadCompletionInfo.parameter = NULL;
-		
-		rtn = fInPipe->Read(fPipeInMDP,
-							5000,	// 5 seconds until timeout
-							5000,
-							fPipeInMDP->getLength(),
-							&fReadCompletionInfo,
-							NULL);
+        for (UInt32 i=0; i<fInSlots; i++)
+            {
+            fPipeInBuff[i].readCompletionInfo.target = this;
+            fPipeInBuff[i].readCompletionInfo.action = dataReadComplete;
+            fPipeInBuff[i].readCompletionInfo.parameter = (void *) (uintptr_t) i;
+            fPipeInBuff[i].done = false;
+            }
+        fInSubmit = fInDeliver = 0;
+        fInCompleted = 0;
+		rtn = fillReadRing();
 		
         if (rtn == kIOReturnSuccess)
             {
             // Set up the data-out bulk pipe:
             
-			for (int i=0; i<kOutBufPool; i++)
+			for (int i=0; i<kOutBufSlots; i++)
                 {
                 fPipeOutBuff[i].writeCompletionInfo.target = this;
                 fPipeOutBuff[i].writeCompletionInfo.action = dataWriteComplete;
@@ -847,6 +1191,15 @@ void net_lucid_cake_driver_AJZaurusUSB::putToSleep()
     
     if (fTimerSource)
         fTimerSource->cancelTimeout();
+    IOLockLock(fNtbLock);
+    ntbTimerCancel();
+    if (fNtbPoolIndx != kOutBufNone)
+        { // discard a partly filled NTB
+        releaseOutputBuffer(fNtbPoolIndx);
+        fNtbPoolIndx = kOutBufNone;
+        }
+    IOLockUnlock(fNtbLock);
+    tsoFlush();
 	
     setLinkStatus(0, 0);
     
@@ -959,6 +1312,28 @@ void net_lucid_cake_driver_AJZaurusUSB::stop(IOService *provider)
         fNetworkInterface->release();
         fNetworkInterface = NULL;
         }
+    
+    if (fNtbTimer)
+        { // nothing is sent any more
+        fNtbTimer->cancelTimeout();
+        fWorkLoop->removeEventSource(fNtbTimer);
+        fNtbTimer->release();
+        fNtbTimer = NULL;
+        }
+    
+    if (fTxDoneSource)
+        {
+        fWorkLoop->removeEventSource(fTxDoneSource);
+        fTxDoneSource->release();
+        fTxDoneSource = NULL;
+        }
+    
+    if (fRxSource)
+        { // the data pipe has been closed, no read completes any more
+        fWorkLoop->removeEventSource(fRxSource);
+        fRxSource->release();
+        fRxSource = NULL;
+        }
 	
     if (fCommInterface)	
         {
@@ -1034,8 +1409,17 @@ void net_lucid_cake_driver_AJZaurusUSB::free()
     
     IOLog("AJZaurusUSB::free\n");
 	
+    if (fNtbLock)
+        {
+        IOLockFree(fNtbLock);
+        fNtbLock = NULL;
+        }
+    if (fOutSlabLock)
+        {
+        IOLockFree(fOutSlabLock);
+        fOutSlabLock = NULL;
+        }
     super::free();
-    IOSimpleLockFree(fLock);
     return;
     
 }/* end free */
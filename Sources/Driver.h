@@ -54,6 +54,7 @@
  */
 
 #include <machine/limits.h>			/* UINT_MAX */
+#include <AvailabilityMacros.h>
 #include <libkern/OSByteOrder.h>
 
 #include <IOKit/network/IOEthernetController.h>
@@ -61,8 +62,10 @@
 #include <IOKit/network/IOGatedOutputQueue.h>
 
 #include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOInterruptEventSource.h>
 #include <IOKit/assert.h>
 #include <IOKit/IOLib.h>
+#include <kern/clock.h>
 #include <IOKit/IOService.h>
 #include <IOKit/IOBufferMemoryDescriptor.h>
 #include <IOKit/IOMessage.h>
@@ -79,15 +82,35 @@
 
 #include <UserNotification/KUNCUserNotifications.h>
 
+#include "IndexStack.h"
+
 extern "C"
 {
 #include <sys/param.h>
 #include <sys/mbuf.h>
 }
 
+#include "Framing.h"				/* uses MIN from sys/param.h */
+#include "TxControl.h"
+
 #define DEBUG		1
 
-#define TRANSMIT_QUEUE_SIZE     5				// How does this relate to MAX_BLOCK_SIZE?
+#define TRANSMIT_QUEUE_SIZE     64				// default capacity of the output queue (see kTxQueueCapacityKey)
+#define kTxBatchMax				16				// max. packets handed to outputPackets per service pass
+#define kTxQueueCapacityKey		"TxQueueCapacity"	// personality: packets the output queue holds
+#define kTsoMaxHeader			256				// Ethernet with VLAN tags, IPv4 with options or IPv6 with extension headers, TCP with options
+#define kTsoMinLength			(1514 + 4)		// TSO segments up to a (VLAN tagged) frame are sent as they are
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 1050
+#define TSO_SUPPORTED			1				// the 10.4 SDK has no TSO in the mbuf KPI and the IONetworkController features
+#endif
+#define kTxBatchSizeKey			"TxBatchSize"		// personality: packets per outputPackets call (1...kTxBatchMax)
+#define kInReadsMax				8				// max. bulk in reads in flight
+#define kInReadsDefault			4
+#define kInBufSlots				(2 * kInReadsMax)	// reads in flight plus as many waiting for processReads
+#define kInReadsKey				"RxReadsInFlight"	// personality: bulk in reads in flight (1...kInReadsMax)
+#define kInBufFrame				MCLBYTES		// MDLM read: one (VLAN tagged) frame plus padding and CRC, a multiple of the packet size
+#define kRxBytesKey				"RxBytes"			// statistics: bytes passed to the stack
+#define kRxBytesCopiedKey		"RxBytesCopied"		// statistics: how many of them were copied (i.e. not received zero-copy)
 #define WATCHDOG_TIMER_MS       1000
 
 #define MAX_BLOCK_SIZE		PAGE_SIZE
@@ -96,13 +119,62 @@ extern "C"
 #define kFiltersSupportedMask	0xefff
 #define kPipeStalled		1
 
-#define kOutBufPool		100
-#define kOutBuffThreshold	10
+#define kOutBufPool		100					// regular output buffers
+#define kOutBufLarge		4					// extra buffers for frames that don't fit a regular one
+#define kOutBufSlots		(kOutBufPool + kOutBufLarge)
+#define kOutBufSmall		2048				// regular buffer in the copy modes: 1514 + padding + CRC
+#define kOutSlabSlots		20					// regular buffers per slab chunk (allocated on demand)
+#define kOutSlabChunks		(kOutBufPool / kOutSlabSlots)
+#define kOutSlabLarge		kOutSlabChunks		// index of the chunk with the large buffers
+#define kOutSlabIdleTicks	10					// watchdog ticks with little traffic before a chunk is freed
+#define kOutBufHighWater	kOutBufPool			// max. writes in flight (fTxDepth.limit is the current limit)
+#define kOutBufNone		INDEX_STACK_NONE	// end of the output buffer free list
+
+#define CACHE_LINE_SIZE		64
+
+// receive FCS verification policy (Info.plist personality or registry property)
+// 1 = verify every frame (default), N = verify 1 in N frames, 0 = trim the FCS without verifying
+
+#define kFCSVerifyIntervalKey	"FCSVerifyInterval"
+#define kFCSFramesCheckedKey	"FCSFramesChecked"
+#define kFCSFramesFailedKey		"FCSFramesFailed"
+
+// NCM (and RNDIS) transmit aggregation and NTB format (Info.plist personality or registry property)
+
+#define kNCMTxMaxSizeKey		"NCMTxMaxSize"		// max. bytes per transmitted NTB (resp. RNDIS transfer)
+#define kNCMTxTimeoutKey		"NCMTxTimeoutUS"	// max. time a datagram waits for more to aggregate (adapted to the arrival rate)
+#define kTxBatchHistogramKey	"TxBatchHistogram"	// statistics: transfers with 1, 2, 3-4, 5-8, 9-16, 17+ frames
+#define kRxBatchHistogramKey	"RxBatchHistogram"	// statistics: input queue flushes with 1, 2, 3-4, 5-8, 9-16, 17+ frames
+#define kOutBufMemoryKey		"OutputBufferMemory"	// statistics: bytes currently allocated for output buffers
+#define kTxDelayTargetKey		"TxDelayTargetUS"	// personality: queueing delay the in-flight depth is tuned for
+#define kTxDepthKey				"TxDepth"			// statistics: writes currently allowed in flight
+#define kTxLatencyKey			"TxLatencyUS"		// statistics: average submit to completion time of a write
+#define kTxBaseLatencyKey		"TxBaseLatencyUS"	// statistics: minimum of that (i.e. without queueing)
+#define kNCMFormatKey			"NCMFormat"			// 16 or 32 (if the device supports NTB-32)
+
+#define kNCMMaxNtbInSize		16384				// receive buffer (announced with SET_NTB_INPUT_SIZE)
+#define kNCMMaxNtbOutSize		8192				// each of the kOutBufPool transmit buffers
+#define kNCMMaxDatagrams		32					// per transmitted NTB
+#define kNCMTxTimeoutUS			400
+
+#define kRNDISMaxTransferIn		16384				// receive buffer (announced with REMOTE_NDIS_INITIALIZE_MSG)
+#define kRNDISMaxTransferOut	8192				// each of the kOutBufPool transmit buffers
+#define kRNDISControlSize		1024				// encapsulated command resp. response
+
+#define kEEMMaxTransferIn		16384				// receive buffer
+#define kEEMMaxTransferOut		8192				// each of the kOutBufPool transmit buffers
+#define kEEMMaxFrameSize		1522				// incl. CRC resp. sentinel
 
 // USB CDC Definitions (Ethernet Control Model)
 
 #define kEthernetControlModel	6		
 #define kMDLM 0x0a
+#define kNCM 0x0d
+#define kRNDIS 0x02				// abstract control model subclass with the vendor specific protocol
+#define kRNDISProtocol 0xff
+#define kWirelessController 0xe0	// RNDIS over the wireless controller class (subclass 1, protocol 3)
+#define kEEM 0x0c
+#define kEEMProtocol 7
 
 //	Requests
 
@@ -122,6 +194,11 @@ enum
     kSet_URB_Size			= 8,
     kSet_SOFS_To_Wait			= 9,
     kSet_Even_Packets			= 10,
+    kGet_NTB_Parameters			= 0x80,		// NCM
+    kGet_NTB_Format			= 0x83,
+    kSet_NTB_Format			= 0x84,
+    kGet_NTB_Input_Size			= 0x85,
+    kSet_NTB_Input_Size			= 0x86,
     kScan				= 0xFF
 };
 
@@ -143,6 +220,7 @@ enum
     Union_FunctionalDescriptor		= 0x06,
     CS_FunctionalDescriptor		= 0x07,
     Enet_Functional_Descriptor		= 0x0f,
+    NCM_Functional_Descriptor		= 0x1a,
 	
     CM_ManagementData			= 0x01,
     CM_ManagementOnData			= 0x02
@@ -245,14 +323,151 @@ typedef struct
     UInt8	bSlaveInterface[];
 } UnionFunctionalDescriptor;
 
+typedef struct
+{
+    UInt8	wLength[2];
+    UInt8	bmNtbFormatsSupported[2];
+    UInt8	dwNtbInMaxSize[4];
+    UInt8	wNdpInDivisor[2];
+    UInt8	wNdpInPayloadRemainder[2];
+    UInt8	wNdpInAlignment[2];
+    UInt8	wReserved[2];
+    UInt8	dwNtbOutMaxSize[4];
+    UInt8	wNdpOutDivisor[2];
+    UInt8	wNdpOutPayloadRemainder[2];
+    UInt8	wNdpOutAlignment[2];
+    UInt8	wNtbOutMaxDatagrams[2];
+} NTBParameters;
+
+// RNDIS control messages (all fields little endian), REMOTE_NDIS_PACKET_MSG is in Framing.h
+
+enum
+{
+    kRNDIS_Initialize_Msg		= 0x00000002,
+    kRNDIS_Halt_Msg				= 0x00000003,
+    kRNDIS_Query_Msg			= 0x00000004,
+    kRNDIS_Set_Msg				= 0x00000005,
+    kRNDIS_Indicate_Status_Msg	= 0x00000007,
+    kRNDIS_Keepalive_Msg		= 0x00000008,
+    kRNDIS_Completion			= 0x80000000,	// or'ed into the message type of replies
+	
+    kRNDIS_Status_Success		= 0x00000000,
+	
+    kRNDIS_Initialize_Length	= 24,
+    kRNDIS_Request_Length		= 28,			// query and set, followed by the information buffer
+	
+    kOID_Gen_Maximum_Frame_Size	= 0x00010106,
+    kOID_Gen_Current_Packet_Filter	= 0x0001010e,
+    kOID_802_3_Permanent_Address	= 0x01010101,
+    kOID_802_3_Multicast_List	= 0x01010103,
+    kOID_802_3_Maximum_List_Size	= 0x01010104,
+	
+    kRNDIS_Packet_Type_Directed		= 0x0001,
+    kRNDIS_Packet_Type_Multicast	= 0x0002,
+    kRNDIS_Packet_Type_All_Multicast	= 0x0004,
+    kRNDIS_Packet_Type_Broadcast	= 0x0008,
+    kRNDIS_Packet_Type_Promiscuous	= 0x0020
+};
+
+enum
+{ // what tsoSegment needs to know about IP and TCP
+    kEtherTypeIPv4				= 0x0800,
+    kEtherTypeIPv6				= 0x86dd,
+    kEtherTypeVLAN				= 0x8100,
+    kEtherTypeQinQ				= 0x88a8,
+    kIPProtocolTCP				= 6,
+    kIPv6HopByHop				= 0,			// extension headers we can skip
+    kIPv6Routing				= 43,
+    kIPv6DestOptions			= 60,
+    kTCPFlagFIN					= 0x01,
+    kTCPFlagPSH					= 0x08,
+    kTCPFlagCWR					= 0x80
+};
+
 typedef struct 
 {
-    IOBufferMemoryDescriptor	*pipeOutMDP;
+    IOMemoryDescriptor			*pipeOutMDP;	// slice of a slab chunk
     UInt8						*pipeOutBuffer;
 	IOUSBCompletion				writeCompletionInfo;
     bool						inuse;
+    mbuf_t						packet;			// scatter-gather transmit: mbuf chain to free on completion
+    IOMemoryDescriptor			*chainMDP;		// scatter-gather transmit: descriptor wrapping it (and the trailer)
+    UInt64						submitTime;		// uptime of the Write (absolute time)
+    UInt64						latency;		// submit to completion (absolute time, 0 = failed)
 } pipeOutBuffers;
 
+typedef struct 
+{
+    IOBufferMemoryDescriptor	*pipeInMDP;
+    UInt8						*pipeInBuffer;
+    mbuf_t						packet;			// zero-copy receive: the mbuf the read goes into
+    IOMemoryDescriptor			*packetMDP;		// zero-copy receive: descriptor wrapping it
+    UInt8						*data;			// where the current read goes (pipeInBuffer or packet data)
+    IOUSBCompletion				readCompletionInfo;	// parameter = index
+    IOReturn					status;			// of the completed read
+    UInt32						length;			// bytes received
+    volatile bool				done;			// completed but not yet processed
+} pipeInBuffers;
+
+class net_lucid_cake_driver_AJZaurusUSB;
+
+// the output queue: like IOBasicOutputQueue, but hands the packets to the driver in batches
+// so that it can reserve output buffers and take the NTB lock once per batch
+
+class net_lucid_cake_driver_AJZaurusUSBOutputQueue : public IOOutputQueue
+{
+    OSDeclareDefaultStructors(net_lucid_cake_driver_AJZaurusUSBOutputQueue);
+	
+private:
+    net_lucid_cake_driver_AJZaurusUSB	*fTarget;
+    IOLock			*fLock;					// protects everything below
+    mbuf_t			fHead;
+    mbuf_t			fTail;
+    UInt32			fSize;
+    UInt32			fCapacity;
+    UInt32			fBatch;					// packets per outputPackets call
+    UInt32			fState;
+    bool			fRestart;				// service() was called while a batch was out
+    UInt32			fDropCount;
+    UInt32			fOutputCount;
+    UInt32			fRetryCount;
+    UInt32			fStallCount;
+	
+    enum
+    {
+        kQueueRunning	= 0x1,
+        kQueueStalled	= 0x2,
+        kQueueActive	= 0x4				// a thread is in drain()
+    };
+	
+    void			drain(void);
+	
+protected:
+    virtual void	free(void);
+    virtual void	serviceThread(void *param);
+	
+public:
+    enum { kServiceAsync = 0x1 };
+	
+    static net_lucid_cake_driver_AJZaurusUSBOutputQueue	*withTarget(net_lucid_cake_driver_AJZaurusUSB *target, UInt32 capacity);
+    virtual bool	initWithTarget(net_lucid_cake_driver_AJZaurusUSB *target, UInt32 capacity);
+    void			setBatchSize(UInt32 batch);
+    virtual UInt32	enqueue(mbuf_t m, void *param);
+    virtual bool	start(void);
+    virtual bool	stop(void);
+    virtual bool	service(IOOptionBits options = 0);
+    virtual UInt32	flush(void);
+    virtual bool	setCapacity(UInt32 capacity);
+    virtual UInt32	getCapacity(void) const;
+    virtual UInt32	getSize(void) const;
+    virtual UInt32	getDropCount(void);
+    virtual UInt32	getOutputCount(void);
+    virtual UInt32	getRetryCount(void);
+    virtual UInt32	getStallCount(void);
+    virtual UInt32	getState(void) const;
+	
+}; /* end class net_lucid_cake_driver_AJZaurusUSBOutputQueue */
+
 #define super IOEthernetController
 
 class net_lucid_cake_driver_AJZaurusUSB : public IOEthernetController
@@ -269,12 +484,17 @@ private:
 	char			serialString[50];
 	
     IOEthernetInterface		*fNetworkInterface;	// the interface of which we are the Client
-    IOBasicOutputQueue		*fTransmitQueue;
+    net_lucid_cake_driver_AJZaurusUSBOutputQueue	*fTransmitQueue;
+    UInt32					fTxQueueCapacity;
+    UInt32					fTxBatchSize;
 	
     IOWorkLoop				*fWorkLoop;
     IONetworkStats			*fpNetStats;
     IOEthernetStats			*fpEtherStats;
     IOTimerEventSource		*fTimerSource;
+    IOTimerEventSource		*fNtbTimer;			// NCM, RNDIS: flushes a partly filled NTB
+    IOInterruptEventSource	*fTxDoneSource;		// reclaims completed writes on the workloop
+    IOInterruptEventSource	*fRxSource;			// processes completed reads on the workloop
     
     OSDictionary			*fMediumDict;
 	
@@ -296,12 +516,26 @@ private:
     IOUSBPipe			*fCommPipe;
     
     IOBufferMemoryDescriptor	*fCommPipeMDP;
-    IOBufferMemoryDescriptor	*fPipeInMDP;
     //IOBufferMemoryDescriptor	*fPipeOutMDP;
 	
     UInt8			*fCommPipeBuffer;
-    UInt8			*fPipeInBuffer;
-    pipeOutBuffers	fPipeOutBuff[kOutBufPool];
+    // ring of bulk in buffers: fInReads reads in flight, the buffers are read and processed in
+    // the order of fInSubmit resp. fInDeliver (free running counters, index = counter % fInSlots).
+    // dataReadComplete only counts fInCompleted, everything else happens on the workloop.
+    pipeInBuffers	fPipeInBuff[kInBufSlots];
+    UInt32			fInReads;
+    UInt32			fInSlots;				// 2 * fInReads
+    UInt32			fInSubmit;
+    UInt32			fInDeliver;
+    volatile SInt32	fInCompleted;
+    bool			fInZeroCopy;			// one frame per transfer: read into mbufs
+    mbuf_t			fInPackets[kInBufSlots];	// zero-copy receive: mbufs of the transfers being processed (NULL = taken)
+    UInt32			fInPacketCount;
+    UInt32			fInQueued;				// frames queued on the interface since the last flushInput
+    UInt64			fRxBytes;
+    UInt64			fRxBytesCopied;
+    UInt32			fRxBatchHist[kTxBatchBuckets];	// frames per flushInput
+    pipeOutBuffers	fPipeOutBuff[kOutBufSlots];
     
     UInt8			fCommInterfaceNumber;
     UInt8			fDataInterfaceNumber;
@@ -310,11 +544,73 @@ private:
 	
 	bool			fPadded;
 	bool			fChecksum;
+	IOMemoryDescriptor	*(net_lucid_cake_driver_AJZaurusUSB::*fMapOutput)(mbuf_t packet, UInt32 poolIndx);	// scatter-gather transmit (NULL = copy only)
+	UInt32			(net_lucid_cake_driver_AJZaurusUSB::*fFrameOutput)(UInt8 *buf, mbuf_t packet);	// framing routines for fPadded/fChecksum
+	void			(net_lucid_cake_driver_AJZaurusUSB::*fFrameInput)(UInt8 **packets, UInt32 *sizes, UInt32 count);
+	UInt32			fFCSVerifyInterval;		// verify 1 in N received frames (0 = never)
+	UInt32			fFCSVerifyCountdown;
+	UInt32			fFCSChecked;			// statistics
+	UInt32			fFCSFailed;
 	UInt8			fInterfaceClass;		// interface class
 	UInt8			fInterfaceSubClass;
-	IOSimpleLock*	fLock;
-	SInt32			fDataCount;
-	bool			fOutputStalled;
+	
+	// NCM
+	bool			fNCM;
+	bool			fNCM32;					// NTB-32 instead of NTB-16
+	UInt32			fInBufSize;				// bulk in transfer size
+	UInt32			fOutBufSize;			// size of each output pool buffer
+	UInt32			fNtbInMaxSize;
+	UInt32			fNtbOutMaxSize;
+	UInt16			fNdpOutDivisor;
+	UInt16			fNdpOutRemainder;
+	UInt16			fNdpOutAlignment;
+	UInt16			fNtbOutMaxDatagrams;
+	UInt32			fNtbTxMaxSize;			// aggregation limit (<= fNtbOutMaxSize)
+	UInt32			fNtbTxTimeout;			// aggregation timeout (us)
+	UInt16			fNtbSequence;
+	IOLock			*fNtbLock;				// protects the NTB being filled (output queue vs. fNtbTimer)
+	UInt32			fNtbPoolIndx;			// output buffer of the NTB being filled (kOutBufNone = none)
+	UInt32			fNtbLength;				// bytes used so far
+	UInt32			fNtbCount;				// datagrams so far
+	UInt32			fNtbSerial;				// transfers sent (flushed) so far
+	UInt32			fNtbTimerSerial;		// fNtbSerial of the transfer fNtbTimer was armed for
+	UInt32			fNtbDgIndex[kNCMMaxDatagrams];
+	UInt32			fNtbDgLength[kNCMMaxDatagrams];
+	void			(net_lucid_cake_driver_AJZaurusUSB::*fNtbFlush)(void);	// ncmFlush, rndisFlush or eemFlush
+	UInt32			(net_lucid_cake_driver_AJZaurusUSB::*fNtbAppend)(mbuf_t packet);	// ncmTransmitPacket etc. (fNtbLock held)
+	UInt32			fTxPending;				// packets of the current batch still to come (for txCoalesce)
+	mbuf_t			fTsoBacklog;			// frames cut from a TSO segment and not yet sent (linked by nextpkt)
+	UInt64			fTxLastArrival;			// uptime of the last frame (absolute time)
+	UInt32			fTxGapAvg;				// moving average of the gap between frames (us)
+	UInt32			fTxBatchHist[kTxBatchBuckets];	// frames per transfer
+	
+	// RNDIS (shares the transfer sizes and the aggregation state with NCM)
+	bool			fRNDIS;
+	UInt32			fRndisRequestId;
+	UInt32			fRndisAlignment;		// of each REMOTE_NDIS_PACKET_MSG in a transfer
+	
+	// EEM (dto.)
+	bool			fEEM;
+	// lock free stacks of the free fPipeOutBuff[] indices (regular, large), see IndexStack.h
+	volatile UInt32	fOutFreeHead[2] __attribute__((aligned(CACHE_LINE_SIZE)));
+	volatile SInt32	fDataCount;				// output buffers in flight
+	UInt16			fOutFreeNext[kOutBufSlots] __attribute__((aligned(CACHE_LINE_SIZE)));
+	// lock free list of completed writes (linked through fOutFreeNext[] as well). dataWriteComplete
+	// pushes, reclaimOutputBuffers takes all at once (index_list_push, index_list_take).
+	volatile UInt32	fOutDoneHead __attribute__((aligned(CACHE_LINE_SIZE)));
+	volatile bool	fOutputStalled __attribute__((aligned(CACHE_LINE_SIZE)));	// waiting for tx_restart (TxControl.h)
+	// in-flight depth controller: AIMD on the write latency (reclaimOutputBuffers may run on two
+	// threads at once, so the updates are not exact - the result is clipped into range anyway)
+	struct tx_depth	fTxDepth;				// see TxControl.h
+	// the output buffers are carved from a few chunks which are allocated when needed
+	IOBufferMemoryDescriptor	*fOutSlab[kOutSlabChunks + 1];
+	IOLock			*fOutSlabLock;			// grow vs. shrink
+	UInt32			fOutSlabCount;			// regular chunks allocated
+	UInt32			fOutSlabBytes;
+	UInt32			fOutSlotSize;			// of a regular buffer (fOutBufSize is the large one)
+	SInt32			fOutSlabPeak;			// max. fDataCount since the last watchdog tick
+	bool			fOutSlabLargeUsed;		// since the last watchdog tick
+	UInt32			fOutSlabIdle;			// watchdog ticks the slab could have been smaller
     
     UInt8			fEaddr[6];				// ethernet address
     UInt16			fMax_Block_Size;
@@ -331,7 +627,6 @@ private:
     bool			fOutputErrsOK;
 	
     IOUSBCompletion		fCommCompletionInfo;
-    IOUSBCompletion		fReadCompletionInfo;
     //IOUSBCompletion		fWriteCompletionInfo;
     IOUSBCompletion		fMERCompletionInfo;
     IOUSBCompletion		fStatsCompletionInfo;
@@ -351,16 +646,67 @@ private:
     bool			createMediumTables(void);
     bool 			allocateResources(void);
     void			releaseResources(void);
+    IOReturn		queueRead(void);
+    IOReturn		fillReadRing(void);
+    void			processReads(void);
+    static void		rxOccurred(OSObject *owner, IOInterruptEventSource *sender, int count);
     bool 			configureDevice(UInt8 numConfigs);
     void			dumpDevice(UInt8 numConfigs);
     bool			getFunctionalDescriptors(void);
     bool			createNetworkInterface(void);
-    bool			USBTransmitPacket(mbuf_t packet);
+    void			initOutputBuffers(void);
+    UInt32			getOutputBuffers(UInt32 *poolIndx, UInt32 count, bool large);
+    void			putOutputBuffers(UInt32 first, UInt32 last);
+    bool			growOutputBuffers(bool large);
+    void			shrinkOutputBuffers(void);
+    void			freeOutputBuffers(void);
+    void			retireOutputBuffer(UInt32 poolIndx);
+    SInt32			releaseOutputBuffer(UInt32 poolIndx);
+    bool			completeOutputBuffer(UInt32 poolIndx);
+    UInt32			reclaimOutputBuffers(void);
+    static void		txDoneOccurred(OSObject *owner, IOInterruptEventSource *sender, int count);
+    UInt32			acquireOutputBuffers(UInt32 *poolIndx, UInt32 count, bool large);
+    void			txDepthUpdate(UInt32 latency);
+    bool			acquireOutputBuffer(UInt32 *poolIndx, bool large);
+    bool			writeOutputBuffer(UInt32 poolIndx, IOMemoryDescriptor *md, UInt32 length);
+    UInt32			USBTransmitPacket(mbuf_t packet, UInt32 poolIndx);
+    UInt32			transmitPackets(mbuf_t *pkts, UInt32 count);
+    mbuf_t			tsoSegment(mbuf_t packet, bool v6, UInt32 mss);
+    void			tsoFlush(void);
     bool			USBSetMulticastFilter(IOEthernetAddress *addrs, UInt32 count);
     bool			USBSetPacketFilter(void);
     IOReturn		clearPipeStall(IOUSBPipe *thePipe);
 	void			resetDevice(void);
+    void			receivePackets(UInt8 **packets, UInt32 *sizes, UInt32 count);
     void			receivePacket(UInt8 *packet, UInt32 size);
+    void			verifyReceivePacket(UInt8 *packet, UInt32 size);
+    mbuf_t			*zeroCopyPacket(UInt8 *packet);
+    void			flushInput(void);
+    template <bool Padded, bool Checksum>
+    UInt32			frameOutput(UInt8 *buf, mbuf_t packet);
+    template <bool Padded, bool Checksum>
+    IOMemoryDescriptor	*mapOutput(mbuf_t packet, UInt32 poolIndx);
+    template <bool Checksum>
+    void			frameInput(UInt8 **packets, UInt32 *sizes, UInt32 count);
+    void			selectFraming(void);
+    bool			ncmConfigure(void);
+    UInt32			ncmTransmitPacket(mbuf_t packet);
+    void			ncmFlush(void);
+    void			ncmFrameInput(UInt8 **packets, UInt32 *sizes, UInt32 count);
+    bool			rndisConfigure(void);
+    IOReturn		rndisCommand(UInt8 *buf, UInt32 *len);
+    IOReturn		rndisQuery(UInt32 oid, void *data, UInt32 *len);
+    IOReturn		rndisSet(UInt32 oid, const void *data, UInt32 len);
+    UInt32			rndisTransmitPacket(mbuf_t packet);
+    void			rndisFlush(void);
+    void			rndisFrameInput(UInt8 **packets, UInt32 *sizes, UInt32 count);
+    UInt32			eemTransmitPacket(mbuf_t packet);
+    void			eemCommand(UInt16 header, const UInt8 *data, UInt32 len);
+    void			eemFlush(void);
+    void			eemFrameInput(UInt8 **packets, UInt32 *sizes, UInt32 count);
+    void			flushTimeout(void);
+    void			ntbTimerCancel(void);
+    void			txCoalesce(bool full);
     static void 	timerFired(OSObject *owner, IOTimerEventSource *sender);
     void			timeoutOccurred(IOTimerEventSource *timer);
 	
@@ -374,6 +720,7 @@ public:
 	virtual	IOService		*probe(IOService *provider, SInt32 *score);
     virtual bool			start(IOService *provider);
     virtual IOReturn		message(UInt32 type, IOService *provider, void *argument = 0);
+    virtual IOReturn		setProperties(OSObject *properties);
     virtual void			free(void);
     virtual void			stop(IOService *provider);
 	
@@ -381,9 +728,11 @@ public:
 	
     virtual IOReturn		enable(IONetworkInterface *netif);
     UInt32					outputPacket(mbuf_t pkt, void *param);
+    UInt32					outputPackets(mbuf_t *pkts, UInt32 count);
     virtual IOReturn		disable(IONetworkInterface *netif);
     virtual IOReturn		setWakeOnMagicPacket(bool active);
     virtual IOReturn		getPacketFilters(const OSSymbol	*group, UInt32 *filters ) const;
+    virtual UInt32			getFeatures(void) const;
     virtual IOReturn		selectMedium(const IONetworkMedium *medium);
     virtual IOReturn		getHardwareAddress(IOEthernetAddress *addr);
     virtual IOReturn		setMulticastMode(IOEnetMulticastMode mode);
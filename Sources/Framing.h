@@ -0,0 +1,513 @@
+/*
+ File:		Framing.h
+
+ Description:	How frames are put into and taken out of the USB transfers: the decisions of the
+ transmit and receive paths which don't need an mbuf or the USB family. Kept apart from
+ Driver.h so that 'make hosttest' checks and measures the very code the driver runs.
+
+ Copyright:		Copyright 2004-2010 H. Nikolaus Schaller
+
+ Disclaimer:		This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2, or (at your option)
+ any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+ */
+
+#ifndef INCLUDE_FRAMING_H
+#define INCLUDE_FRAMING_H
+
+#include "CRC.h"
+
+#define kRxZeroCopyMin			256				// zero-copy receive: shorter frames are copied and the mbuf is read into again
+#define kTxZeroCopyMin			512				// scatter-gather transmit: shorter packets are copied (cheaper than a descriptor)
+#define kTxMaxSegments			8				// scatter-gather transmit: max. number of mbufs in a chain
+
+// NCM transfer block signatures (little endian) and fixed sizes
+
+enum
+{
+    kNTH16_Signature	= 0x484d434e,	// "NCMH"
+    kNTH32_Signature	= 0x686d636e,	// "ncmh"
+    kNDP16_Signature	= 0x304d434e,	// "NCM0" (no CRC)
+    kNDP32_Signature	= 0x306d636e,	// "ncm0" (no CRC)
+    kNTH16_Length		= 12,
+    kNTH32_Length		= 16,
+    kNDP16_Length		= 8,			// plus 4 bytes per datagram
+    kNDP32_Length		= 16,			// plus 8 bytes per datagram
+    kNCMMaxNdps			= 32			// more NDPs in one NTB are taken for a loop
+};
+
+// RNDIS data message (all fields little endian)
+
+enum
+{
+    kRNDIS_Packet_Msg			= 0x00000001,
+    kRNDIS_Packet_Length		= 44			// followed by the frame
+};
+
+// EEM packet header (little endian)
+
+enum
+{
+    kEEM_Command				= 0x8000,	// bmType
+    kEEM_CRC					= 0x4000,	// data packet: bmCRC (0 = sentinel instead of the CRC)
+    kEEM_Length_Mask			= 0x3fff,	// data packet: length incl. CRC
+    kEEM_Opcode_Shift			= 11,		// command packet: bmEEMCmd
+    kEEM_Opcode_Mask			= 0x7,
+    kEEM_Command_Length_Mask	= 0x07ff,	// command packet: echo length
+	
+    kEEM_Echo					= 0,
+    kEEM_Echo_Response			= 1,
+	
+    kEEM_Sentinel				= 0xdeadbeef	// big endian
+};
+
+// What eem_next found
+
+enum
+{
+    kEEMBad						= -1,		// the rest of the transfer is garbage
+    kEEMEnd						= 0,
+    kEEMFrame,								// frame (the sentinel is trimmed)
+    kEEMFrameCRC,							// frame with CRC, for frameInput<true>
+    kEEMEcho,								// echo command, to be answered
+    kEEMBadSentinel,						// data packet without CRC or sentinel, dropped
+    kEEMSkip								// zero length packet, echo response, other commands
+};
+
+/* rx_ring_room - how many more bulk in reads fillReadRing may queue
+ * submit, completed, deliver - free running counts of the reads queued, completed and processed
+ * reads - max. reads in flight, slots - buffers in the ring (a completed read keeps its slot
+ * until processReads is done with it)
+ */
+static inline UInt32 rx_ring_room(UInt32 submit, UInt32 completed, UInt32 deliver, UInt32 reads, UInt32 slots)
+{
+    UInt32 inFlight = submit - completed;
+    UInt32 inRing = submit - deliver;
+    
+    if (inFlight >= reads || inRing >= slots)
+        return 0;
+    return MIN(reads - inFlight, slots - inRing);
+}
+
+/* rx_zero_copy - pass a received frame up in the mbuf it was read into?
+ * inMbuf - it was read into an mbuf (see zeroCopyPacket), len - without the FCS
+ * Short frames are copied so that the cluster can be read into again.
+ */
+static inline bool rx_zero_copy(bool inMbuf, UInt32 len)
+{
+    return inMbuf && len >= kRxZeroCopyMin;
+}
+
+/* tx_zero_copy - transmit a packet of len bytes in segments mbufs scatter-gather (mapOutput)?
+ * Short packets are copied: the copy costs less than a descriptor. Longer chains are copied
+ * into one buffer, too.
+ */
+static inline bool tx_zero_copy(UInt32 len, UInt32 segments)
+{
+    return len >= kTxZeroCopyMin && segments <= kTxMaxSegments;
+}
+
+/* rx_fcs_sample - verify the FCS of this received frame?
+ * interval - verify 1 in N frames (0 = never), countdown - frames until the next one is verified
+ * USB has its own CRC16 per transaction, so the FCS check may be sampled (FCSVerifyInterval).
+ */
+static inline bool rx_fcs_sample(UInt32 interval, UInt32 *countdown)
+{
+    if (interval == 0 || --*countdown > 0)
+        return false;
+    *countdown = interval;
+    return true;
+}
+
+/* rx_fcs_body - how many bytes of a received transfer (with FCS) to run the FCS over first
+ * A transfer of size % packetSize == 1 has an extra byte: the padding byte which frame_trailer
+ * adds to avoid a zero length packet, or the last byte of the FCS.
+ */
+static inline UInt32 rx_fcs_body(UInt32 size, UInt32 packetSize)
+{
+    return ((size % packetSize) == 1) ? size - 1 : size;
+}
+
+/* rx_fcs_length - length of the frame with FCS, once the FCS across body bytes gave fcs
+ * If that isn't good the extra byte (if any) is taken as the last byte of the FCS.
+ * Returns 0 if the frame is bad either way.
+ */
+static inline UInt32 rx_fcs_length(UInt32 fcs, const unsigned char *packet, UInt32 body, UInt32 size)
+{
+    if (fcs == CRC32_GOODFCS)
+        return body;	// trim the extra byte (if any)
+    if (body < size && CRC32_FCS(fcs, packet[body]) == CRC32_GOODFCS)
+        return size;
+    return 0;
+}
+
+/* frame_length - length of a transmitted frame of len payload bytes, including CRC and padding
+ * (without the extra byte). Padded (MDLM) pads so that after appending the CRC we have a
+ * multiple of packetSize less one; with Checksum alone a frame is at least one full packet.
+ * Instantiated per mode like frameOutput, so that the per packet code has no mode tests.
+ */
+template <bool Padded, bool Checksum>
+static inline UInt32 frame_length(UInt32 len, UInt32 packetSize)
+{
+    UInt32 checksum_length = Checksum?4:0;
+    
+    if (Padded)
+        return packetSize * (((len + checksum_length) / packetSize) + 1) - 1;
+    if (Checksum)
+        return MAX(packetSize, len + checksum_length);
+    return len;
+}
+
+/* frame_trailer - append padding, CRC and the extra byte (if required) behind a payload
+ * tp - where to put the trailer, len - payload bytes in front of it, fcs - fcs across them
+ * Returns the length of the trailer; the buffer must leave room for the extra byte.
+ */
+template <bool Padded, bool Checksum>
+static inline UInt32 frame_trailer(UInt8 *tp, UInt32 len, UInt32 fcs, UInt32 packetSize)
+{
+    UInt32 checksum_length = Checksum?4:0;
+    UInt32 pad, rTotal = 0;
+    
+    if ((pad = frame_length<Padded, Checksum>(len, packetSize) - len - checksum_length) > 0)
+        { // pad to required length less four (CRC)
+        if (Checksum)
+            fcs = fcs_pad32(tp, pad, fcs);
+        else
+            bzero(tp, pad);
+        rTotal += pad;
+        }
+    if (Checksum)
+        {
+        fcs = ~fcs;
+        tp[rTotal++] = fcs&0xff;
+        tp[rTotal++] = (fcs>>8)&0xff;
+        tp[rTotal++] = (fcs>>16)&0xff;
+        tp[rTotal++] = (fcs>>24)&0xff;
+        }
+    if (Padded && !((len + rTotal) % packetSize))
+        tp[rTotal++] = 0;	// avoid a zero length packet, we over-allocated by one for this
+    return rTotal;
+}
+
+/* tx_short_packet - does a transfer of total bytes need a padding byte (or pad bytes)?
+ * A multiple of packetSize would have to be ended by a zero length packet, which some devices
+ * don't like; if maxSize leaves room a short packet ends it instead.
+ */
+static inline bool tx_short_packet(UInt32 total, UInt32 packetSize, UInt32 maxSize, UInt32 pad)
+{
+    return (total % packetSize) == 0 && total + pad <= maxSize;
+}
+
+/* ncm_align - the smallest offset >= off with offset % divisor == remainder
+ * divisor, remainder - from the NTB parameters
+ */
+static inline UInt32 ncm_align(UInt32 off, UInt32 divisor, UInt32 remainder)
+{
+    return off + ((divisor + remainder - (off % divisor)) % divisor);
+}
+
+/* ncm_ntb_length - length of an NTB whose datagrams end at length, once ncm_finish has
+ * appended the NDP for count datagrams (aligned to ndpAlign) and its terminator
+ */
+static inline UInt32 ncm_ntb_length(UInt32 length, bool ncm32, UInt32 ndpAlign, UInt32 count)
+{
+    if (ncm32)
+        return ncm_align(length, ndpAlign, 0) + kNDP32_Length + 8 * (count + 1);
+    return ncm_align(length, ndpAlign, 0) + kNDP16_Length + 4 * (count + 1);
+}
+
+/* ncm_finish - append the NDP to an NTB and fill in its NTH
+ * buf - the NTB, the datagrams end at length; index[], dgLength[] - where the count datagrams are
+ * Returns the length of the NTB (see ncm_ntb_length).
+ */
+static inline UInt32 ncm_finish(UInt8 *buf, UInt32 length, bool ncm32, UInt32 ndpAlign, UInt16 sequence,
+                                const UInt32 *index, const UInt32 *dgLength, UInt32 count)
+{
+    UInt32 ndp = ncm_align(length, ndpAlign, 0);
+    UInt32 total, i;
+    
+    bzero(buf + length, ndp - length);
+    if (ncm32)
+        {
+        OSWriteLittleInt32(buf, ndp, kNDP32_Signature);
+        OSWriteLittleInt16(buf, ndp + 4, kNDP32_Length + 8 * (count + 1));
+        OSWriteLittleInt16(buf, ndp + 6, 0);
+        OSWriteLittleInt32(buf, ndp + 8, 0);	// dwNextNdpIndex
+        OSWriteLittleInt32(buf, ndp + 12, 0);
+        total = ndp + kNDP32_Length;
+        for (i = 0; i < count; i++, total += 8)
+            {
+            OSWriteLittleInt32(buf, total, index[i]);
+            OSWriteLittleInt32(buf, total + 4, dgLength[i]);
+            }
+        OSWriteLittleInt32(buf, total, 0);	// terminator
+        OSWriteLittleInt32(buf, total + 4, 0);
+        total += 8;
+        OSWriteLittleInt32(buf, 0, kNTH32_Signature);
+        OSWriteLittleInt16(buf, 4, kNTH32_Length);
+        OSWriteLittleInt16(buf, 6, sequence);
+        OSWriteLittleInt32(buf, 8, total);
+        OSWriteLittleInt32(buf, 12, ndp);
+        }
+    else
+        {
+        OSWriteLittleInt32(buf, ndp, kNDP16_Signature);
+        OSWriteLittleInt16(buf, ndp + 4, kNDP16_Length + 4 * (count + 1));
+        OSWriteLittleInt16(buf, ndp + 6, 0);	// wNextNdpIndex
+        total = ndp + kNDP16_Length;
+        for (i = 0; i < count; i++, total += 4)
+            {
+            OSWriteLittleInt16(buf, total, index[i]);
+            OSWriteLittleInt16(buf, total + 2, dgLength[i]);
+            }
+        OSWriteLittleInt32(buf, total, 0);	// terminator
+        total += 4;
+        OSWriteLittleInt32(buf, 0, kNTH16_Signature);
+        OSWriteLittleInt16(buf, 4, kNTH16_Length);
+        OSWriteLittleInt16(buf, 6, sequence);
+        OSWriteLittleInt16(buf, 8, total);
+        OSWriteLittleInt16(buf, 10, ndp);
+        }
+    return total;
+}
+
+/* rndis_packet_length - length of the REMOTE_NDIS_PACKET_MSG for a frame of len bytes,
+ * including the padding up to the next message (align - the device's packet alignment)
+ */
+static inline UInt32 rndis_packet_length(UInt32 len, UInt32 align)
+{
+    return ncm_align(kRNDIS_Packet_Length + len, align, 0);
+}
+
+/* rndis_packet - write the header of a REMOTE_NDIS_PACKET_MSG of msgLen bytes and zero its padding
+ * The frame of len bytes goes to msg + kRNDIS_Packet_Length.
+ */
+static inline void rndis_packet(UInt8 *msg, UInt32 len, UInt32 msgLen)
+{
+    bzero(msg, kRNDIS_Packet_Length);
+    OSWriteLittleInt32(msg, 0, kRNDIS_Packet_Msg);
+    OSWriteLittleInt32(msg, 4, msgLen);
+    OSWriteLittleInt32(msg, 8, kRNDIS_Packet_Length - 8);	// data offset (from here)
+    OSWriteLittleInt32(msg, 12, len);
+    bzero(msg + kRNDIS_Packet_Length + len, msgLen - kRNDIS_Packet_Length - len);
+}
+
+/* rndis_next - the next REMOTE_NDIS_PACKET_MSG of a received transfer of size bytes
+ * off - where it starts, advanced past it
+ * Returns 1 and the frame's offset and length, 0 at the end (or the padding after the last
+ * message), -1 if the message is bad; then off is where it starts.
+ */
+static inline int rndis_next(const UInt8 *buf, UInt32 size, UInt32 *off, UInt32 *frame, UInt32 *len)
+{
+    UInt32 o = *off, msgLen, dOff, dLen;
+    
+    if (o + 8 > size || OSReadLittleInt32(buf, o) == 0)
+        return 0;
+    if (OSReadLittleInt32(buf, o) != kRNDIS_Packet_Msg)
+        return -1;
+    msgLen = OSReadLittleInt32(buf, o + 4);
+    if (msgLen < kRNDIS_Packet_Length || msgLen > size - o)
+        return -1;
+    dOff = OSReadLittleInt32(buf, o + 8);	// from the data offset field
+    dLen = OSReadLittleInt32(buf, o + 12);
+    if (dOff > msgLen - 8 || dLen > msgLen - 8 - dOff)
+        return -1;
+    *frame = o + 8 + dOff;
+    *len = dLen;
+    *off = o + msgLen;
+    return 1;
+}
+
+/* eem_packet - write the header and the sentinel of an EEM data packet for a frame of len bytes
+ * The frame goes to pkt + 2. Returns the length of the packet.
+ */
+static inline UInt32 eem_packet(UInt8 *pkt, UInt32 len)
+{
+    OSWriteLittleInt16(pkt, 0, len + 4);	// data packet, bmCRC = 0
+    OSWriteBigInt32(pkt, 2 + len, kEEM_Sentinel);
+    return 2 + len + 4;
+}
+
+/* eem_echo_response - header of the answer to an echo command with len bytes of data */
+
+static inline UInt16 eem_echo_response(UInt32 len)
+{
+    return kEEM_Command | (kEEM_Echo_Response << kEEM_Opcode_Shift) | len;
+}
+
+/* eem_next - the next EEM packet of a received transfer of size bytes
+ * off - where it starts, advanced past it
+ * Returns what it is (kEEMFrame etc.) and where its payload is: for frames the length for
+ * frameInput (with the CRC, without the sentinel), for echo commands the echo data. kEEMEnd
+ * at the end, kEEMBad if the packet is bad; then off is where it starts.
+ */
+static inline int eem_next(const UInt8 *buf, UInt32 size, UInt32 *off, UInt32 *data, UInt32 *len)
+{
+    UInt32 o = *off, n;
+    UInt16 header;
+    int kind;
+    
+    if (o + 2 > size)
+        return kEEMEnd;
+    header = OSReadLittleInt16(buf, o);
+    *data = o + 2;
+    if (header & kEEM_Command)
+        {
+        switch ((header >> kEEM_Opcode_Shift) & kEEM_Opcode_Mask)
+            {
+            case kEEM_Echo:
+                kind = kEEMEcho;
+                n = header & kEEM_Command_Length_Mask;
+                break;
+            case kEEM_Echo_Response:
+                kind = kEEMSkip;
+                n = header & kEEM_Command_Length_Mask;
+                break;
+            default:	// hints and tickle - nothing to do for us
+                kind = kEEMSkip;
+                n = 0;
+                break;
+            }
+        if (n > size - o - 2)
+            return kEEMBad;
+        *len = n;
+        }
+    else
+        {
+        n = header & kEEM_Length_Mask;
+        if (n == 0)
+            kind = kEEMSkip;	// zero length EEM packet
+        else if (n < 4 || n > size - o - 2)
+            return kEEMBad;
+        else if (header & kEEM_CRC)
+            kind = kEEMFrameCRC;	// frameInput<true> checks and trims the CRC
+        else if (OSReadBigInt32(buf, o + 2 + n - 4) != kEEM_Sentinel)
+            kind = kEEMBadSentinel;
+        else
+            kind = kEEMFrame;
+        *len = (kind == kEEMFrame) ? n - 4 : n;
+        }
+    *off = o + 2 + n;
+    return kind;
+}
+
+// Where ncm_walk_next is in a received NTB
+
+struct ncm_walk
+    {
+    const UInt8	*buf;
+    UInt32		size;
+    UInt32		nth;		// header length, the NDPs come after it
+    UInt32		ndp;		// next NDP (0 = none)
+    UInt32		ndps;		// NDPs taken so far
+    UInt32		entry;		// next entry of the current NDP
+    UInt32		end;		// end of the current NDP
+    bool		ncm32;		// the current NDP is an NDP32
+    };
+
+/* ncm_walk_start - check the NTH of a received NTB of size bytes
+ * Returns false if it isn't one.
+ */
+static inline bool ncm_walk_start(struct ncm_walk *w, const UInt8 *buf, UInt32 size)
+{
+    w->buf = buf;
+    w->size = size;
+    w->ndps = 0;
+    w->entry = w->end = 0;
+    w->ncm32 = false;
+    if (size < kNTH16_Length)
+        return false;
+    if (OSReadLittleInt32(buf, 0) == kNTH16_Signature)
+        {
+        w->nth = OSReadLittleInt16(buf, 4);
+        w->ndp = OSReadLittleInt16(buf, 10);
+        }
+    else if (OSReadLittleInt32(buf, 0) == kNTH32_Signature && size >= kNTH32_Length)
+        {
+        w->nth = OSReadLittleInt16(buf, 4);
+        w->ndp = OSReadLittleInt32(buf, 12);
+        }
+    else
+        return false;
+    return w->nth <= size;
+}
+
+/* ncm_walk_next - the next datagram of the NTB, following the chain of NDPs
+ * Returns 1 and the datagram's offset and length, 0 at the end, -1 if the NTB is bad
+ * (what has been returned so far is good).
+ */
+static inline int ncm_walk_next(struct ncm_walk *w, UInt32 *off, UInt32 *len)
+{
+    const UInt8 *buf = w->buf;
+    UInt32 ndpLen, idx, n;
+    
+    for (;;)
+        {
+        if (w->ncm32 && w->entry + 8 <= w->end)
+            {
+            idx = OSReadLittleInt32(buf, w->entry);
+            n = OSReadLittleInt32(buf, w->entry + 4);
+            w->entry += 8;
+            }
+        else if (!w->ncm32 && w->entry + 4 <= w->end)
+            {
+            idx = OSReadLittleInt16(buf, w->entry);
+            n = OSReadLittleInt16(buf, w->entry + 2);
+            w->entry += 4;
+            }
+        else
+            { // take the next NDP
+            if (w->ndp == 0)
+                return 0;
+            if (w->ndps++ >= kNCMMaxNdps || w->ndp < w->nth || w->ndp > w->size - kNDP16_Length)
+                return -1;	// loop or garbage
+            ndpLen = OSReadLittleInt16(buf, w->ndp + 4);
+            switch (OSReadLittleInt32(buf, w->ndp))
+                {
+                case kNDP16_Signature:
+                    if (ndpLen < kNDP16_Length + 4 || ndpLen > w->size - w->ndp)
+                        return -1;
+                    w->ncm32 = false;
+                    w->entry = w->ndp + kNDP16_Length;
+                    w->end = w->ndp + ndpLen;
+                    w->ndp = OSReadLittleInt16(buf, w->ndp + 6);
+                    break;
+                case kNDP32_Signature:
+                    if (ndpLen < kNDP32_Length + 8 || ndpLen > w->size - w->ndp)
+                        return -1;
+                    w->ncm32 = true;
+                    w->entry = w->ndp + kNDP32_Length;
+                    w->end = w->ndp + ndpLen;
+                    w->ndp = OSReadLittleInt32(buf, w->ndp + 8);
+                    break;
+                default:
+                    return -1;
+                }
+            continue;
+            }
+        if (idx == 0 || n == 0)
+            {
+            w->entry = w->end;	// terminator
+            continue;
+            }
+        if (idx > w->size || n > w->size - idx)
+            return -1;
+        *off = idx;
+        *len = n;
+        return 1;
+        }
+}
+
+#endif INCLUDE_FRAMING_H
+/* EOF */
@@ -58,6 +58,8 @@
 
 #include "Driver.h"
 
+OSDefineMetaClassAndStructors(net_lucid_cake_driver_AJZaurusUSBOutputQueue, IOOutputQueue);
+
 static struct MediumTable
 {
     UInt32	type;
@@ -111,7 +113,13 @@ void net_lucid_cake_driver_AJZaurusUSB::commReadComplete(void *obj, void *param,
  //       LogData(kUSBAnyDirn, dLen, me->fCommPipeBuffer);
         
         notif = me->fCommPipeBuffer[1];
-        if (dLen > 7)
+        if (me->fRNDIS)
+            { // RESPONSE_AVAILABLE - we only fetch responses for our own (synchronous) commands
+#if 0
+            IOLog("AJZaurusUSB::commReadComplete - RNDIS response available\n");
+#endif
+            }
+        else if (dLen > 7)
             {
             switch(notif)
                 {
@@ -175,21 +183,22 @@ void net_lucid_cake_driver_AJZaurusUSB::commReadComplete(void *obj, void *param,
 //		Method:		net_lucid_cake_driver_AJZaurusUSB::dataReadComplete
 //
 //		Inputs:		obj - me
-//                  param - unused
+//                  param - index of the input buffer
 //                  rc - return code
 //                  remaining - what's left
 //
 //		Outputs:	None
 //
-//		Desc:		BulkIn pipe (Data interface) read completion routine
+//		Desc:		BulkIn pipe (Data interface) read completion routine. Only notes the result
+//				and wakes up fRxSource: the reads are processed (and queued again) on the
+//				workloop by processReads, so other completions aren't held up.
 //
 /****************************************************************************************************/
 
 void net_lucid_cake_driver_AJZaurusUSB::dataReadComplete(void *obj, void *param, IOReturn rc, UInt32 remaining)
 {
     net_lucid_cake_driver_AJZaurusUSB	*me = (net_lucid_cake_driver_AJZaurusUSB*)obj;
-    UInt32		dLen;
-    IOReturn		ior;
+    pipeInBuffers	*buf = &me->fPipeInBuff[(uintptr_t) param];
     
     if(!me->fReady)
         {
@@ -199,65 +208,225 @@ void net_lucid_cake_driver_AJZaurusUSB::dataReadComplete(void *obj, void *param,
         return;
         }
 
-    if(rc == kIOReturnSuccess)	// If operation returned ok
+    buf->status = rc;
+    buf->length = (rc == kIOReturnSuccess) ? buf->pipeInMDP->getLength() - remaining : 0;
+    OSSynchronizeIO();
+    buf->done = true;
+    OSIncrementAtomic(&me->fInCompleted);
+    if (me->fRxSource)
+        me->fRxSource->interruptOccurred(0, 0, 0);
+	
+} /* end dataReadComplete */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::rxOccurred
+//
+//		Inputs:		owner, sender and count (of interruptOccurred calls)
+//
+//		Outputs:	
+//
+//		Desc:		Static member function called on the workloop after dataReadComplete.
+//					Forwards to processReads.
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::rxOccurred(OSObject *owner, IOInterruptEventSource *sender, int count)
+{
+    net_lucid_cake_driver_AJZaurusUSB	*target = OSDynamicCast(net_lucid_cake_driver_AJZaurusUSB, owner);
+    
+    if (target)
+        target->processReads();
+    
+}/* end rxOccurred */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::processReads
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Runs on the workloop. Replaces the completed reads first (with the buffers
+//				processed last time), so the device is kept busy, then processes all
+//				completed reads in the order they were queued and hands the frames to the
+//				stack in one go.
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::processReads(void)
+{
+    pipeInBuffers	*buf;
+    IOReturn		rc;
+    bool			clearStall = false;
+    UInt8			*data[kInBufSlots];
+    UInt32			length[kInBufSlots];
+    UInt32			slot[kInBufSlots];
+    UInt32			i, n = 0;
+    
+    if (!fReady)
+        return;
+    
+    // Queue the next reads
+    
+    fillReadRing();
+    
+    // Collect what has completed in order
+    
+    while ((buf = &fPipeInBuff[fInDeliver % fInSlots])->done)
         {
-		dLen=me->fPipeInMDP->getLength() - remaining;
+        OSSynchronizeIO();	// status and length were stored before done
+        buf->done = false;
+        rc = buf->status;
+        if(rc == kIOReturnSuccess)	// If operation returned ok
+            {
 #if 0
-        IOLog("AJZaurusUSB::dataReadComplete - len=%lu\n", dLen);
+            IOLog("AJZaurusUSB::processReads - len=%lu\n", buf->length);
 #endif   
-//        LogData(kUSBIn, dlen, me->fPipeInBuffer);
-        me->receivePacket(me->fPipeInBuffer, dLen);	// Move the incoming bytes up the stack
-        } 
-    else if(rc == kIOUSBPipeStalled)
-		{
-		IOLog("AJZaurusUSB::dataReadComplete - err=kIOUSBPipeStalled\n");
-		// rc = me->clearPipeStall(me->fInPipe);
-		rc = me->fInPipe->ClearPipeStall(true);
-		if(rc != kIOReturnSuccess)
-			IOLog("AJZaurusUSB::dataReadComplete - clear pipe stall failed: %d %s\n", rc, me->fDataInterface->stringFromReturn(rc));
-		}
-	else if(rc == kIOUSBTransactionTimeout)
-		{
-		IOLog("AJZaurusUSB::dataReadComplete - Timeout err: %d %s\n", rc, me->fDataInterface->stringFromReturn(rc));
-		rc = me->fInPipe->ClearPipeStall(true);
-		if(rc != kIOReturnSuccess)
-			IOLog("AJZaurusUSB::dataReadComplete - clear pipe stall failed: %d %s\n", rc, me->fDataInterface->stringFromReturn(rc));
-		}
-	else
-		IOLog("AJZaurusUSB::dataReadComplete - IO err: %d %s\n", rc, me->fDataInterface->stringFromReturn(rc));
-	
-    // Queue the next read
+//            LogData(kUSBIn, buf->length, buf->data);
+            slot[n] = fInDeliver % fInSlots;
+            data[n] = buf->data;
+            length[n] = buf->length;
+            fInPackets[n++] = buf->packet;	// receivePacket takes it if the frame is passed on
+            } 
+        else if(rc == kIOUSBPipeStalled)
+            {
+            IOLog("AJZaurusUSB::processReads - err=kIOUSBPipeStalled\n");
+            clearStall = true;
+            }
+        else if(rc == kIOUSBTransactionTimeout)
+            {
+            IOLog("AJZaurusUSB::processReads - Timeout err: %d %s\n", rc, fDataInterface->stringFromReturn(rc));
+            clearStall = true;
+            }
+        else if(rc != kIOReturnAborted)	// the others after a stall
+            IOLog("AJZaurusUSB::processReads - IO err: %d %s\n", rc, fDataInterface->stringFromReturn(rc));
+        fInDeliver++;
+        }
+    
+    // Process them as one batch (the CRCs of several frames are verified together)
+    
+    if (n > 0)
+        {
+        fInPacketCount = n;
+        receivePackets(data, length, n);	// Move the incoming bytes up the stack
+        fInPacketCount = 0;
+        for (i = 0; i < n; i++)
+            {
+            buf = &fPipeInBuff[slot[i]];
+            if (buf->packet && !fInPackets[i])
+                { // gone up the stack, queueRead needs a new one
+                buf->packetMDP->release();
+                buf->packetMDP = NULL;
+                buf->packet = NULL;
+                }
+            }
+        }
+    flushInput();
+    
+    // The stall is cleared when the ring is consistent again since it aborts the other reads
+    
+    if (clearStall)
+        {
+        // rc = clearPipeStall(fInPipe);
+        rc = fInPipe->ClearPipeStall(true);
+        if(rc != kIOReturnSuccess)
+            IOLog("AJZaurusUSB::processReads - clear pipe stall failed: %d %s\n", rc, fDataInterface->stringFromReturn(rc));
+        }
+    
+    // Read into the buffers processed above
+    
+    fillReadRing();
 	
-	ior = me->fInPipe->Read(me->fPipeInMDP,
-							10000,	// 10 seconds until timeout
-							10000,
-							me->fPipeInMDP->getLength(),
-							&me->fReadCompletionInfo,
-							NULL);
+} /* end processReads */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::queueRead
+//
+//		Inputs:		
+//
+//		Outputs:	Return code - kIOReturnSuccess or the error of the Read
+//
+//		Desc:		Queue a read into the next buffer of the ring (the caller checks that it is
+//				free). Sets fDataDead if it fails. For zero-copy receive the read goes into an
+//				mbuf (one in a single piece) if we can get one, else into the buffer of the slot.
+//
+/****************************************************************************************************/
+
+IOReturn net_lucid_cake_driver_AJZaurusUSB::queueRead(void)
+{
+    pipeInBuffers	*buf = &fPipeInBuff[fInSubmit % fInSlots];
+    IOMemoryDescriptor	*md = buf->pipeInMDP;
+    IOReturn		ior;
+    mbuf_t			m;
+    
+    if (fInZeroCopy && !buf->packet && (m = allocatePacket(fInBufSize)))
+        {
+        if (!mbuf_next(m) && mbuf_len(m) >= fInBufSize &&
+            (buf->packetMDP = IOMemoryDescriptor::withAddress(mbuf_data(m), fInBufSize, kIODirectionIn)))
+            buf->packet = m;
+        else
+            freePacket(m);
+        }
+    if (buf->packet)
+        md = buf->packetMDP;
+    buf->data = buf->packet ? (UInt8 *) mbuf_data(buf->packet) : buf->pipeInBuffer;
+    fInSubmit++;	// before the Read: the completion may come before it returns
+    ior = fInPipe->Read(md,
+						10000,	// 10 seconds until timeout
+						10000,
+						md->getLength(),
+						&buf->readCompletionInfo,
+						NULL);
 	
     if(ior != kIOReturnSuccess)
         {
-        IOLog("AJZaurusUSB::dataReadComplete - Failed to queue read: %d %s\n", ior, me->fDataInterface->stringFromReturn(rc));
+        IOLog("AJZaurusUSB::queueRead - Failed to queue read: %d %s\n", ior, fDataInterface->stringFromReturn(ior));
         if(ior == kIOUSBPipeStalled)
             {
-			//			IOLog("AJZaurusUSB::dataReadComplete - err=kIOUSBPipeStalled\n");
-            me->fInPipe->ClearPipeStall(true);
-			ior = me->fInPipe->Read(me->fPipeInMDP,
-									10000,	// 10 seconds until timeout
-									10000,
-									me->fPipeInMDP->getLength(),
-									&me->fReadCompletionInfo,
-									NULL);
-			
-            if(ior != kIOReturnSuccess)
-                {
-                IOLog("AJZaurusUSB::dataReadComplete - Failed again, read dead: %d %s\n", ior, me->fDataInterface->stringFromReturn(rc));
-                me->fDataDead = true;
-                }
+            fInPipe->ClearPipeStall(true);
+			ior = fInPipe->Read(md,
+								10000,	// 10 seconds until timeout
+								10000,
+								md->getLength(),
+								&buf->readCompletionInfo,
+								NULL);
+            }
+        if(ior != kIOReturnSuccess)
+            {
+            IOLog("AJZaurusUSB::queueRead - Failed again, read dead: %d %s\n", ior, fDataInterface->stringFromReturn(ior));
+            fInSubmit--;
+            fDataDead = true;
             }
         }
+    return ior;
 	
-} /* end dataReadComplete */
+} /* end queueRead */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::fillReadRing
+//
+//		Inputs:		
+//
+//		Outputs:	Return code - kIOReturnSuccess or the error of the first failed Read
+//
+//		Desc:		Queue reads until fInReads are in flight (or all buffers are busy). Only
+//				called on the workloop.
+//
+/****************************************************************************************************/
+
+IOReturn net_lucid_cake_driver_AJZaurusUSB::fillReadRing(void)
+{
+    IOReturn		ior = kIOReturnSuccess;
+    
+    while (ior == kIOReturnSuccess && rx_ring_room(fInSubmit, fInCompleted, fInDeliver, fInReads, fInSlots) > 0)
+        ior = queueRead();
+    return ior;
+	
+} /* end fillReadRing */
 
 /****************************************************************************************************/
 //
@@ -279,37 +448,36 @@ void net_lucid_cake_driver_AJZaurusUSB::dataWriteComplete(void *obj, void *param
     net_lucid_cake_driver_AJZaurusUSB	*me = (net_lucid_cake_driver_AJZaurusUSB *)obj;
     //UInt32		pktLen = 0;
     UInt32		poolIndx;
-    SInt32		dataCount = 0;
-    bool		stalled = FALSE;
 #if 0
     IOLog("AJZaurusUSB::dataWriteComplete\n");
 #endif
+    poolIndx = (UInt32)param;
+    if (poolIndx < kOutBufSlots)
+        { // for the depth controller (in reclaimOutputBuffers)
+        UInt64	now;
+        
+        clock_get_uptime(&now);
+        me->fPipeOutBuff[poolIndx].latency = (rc == kIOReturnSuccess) ? now - me->fPipeOutBuff[poolIndx].submitTime : 0;
+        }
+    if (me->completeOutputBuffer(poolIndx) && me->fTxDoneSource)
+        me->fTxDoneSource->interruptOccurred(0, 0, 0);	// first of a batch: make sure it gets reclaimed
     if (!me->fReady)
 		{
 		IOLog("AJZaurusUSB::dataWriteComplete - not ready\n");
         return;
 		}
-    poolIndx = (UInt32)param;
     
     if (rc == kIOReturnSuccess)						// If operation returned ok
         {
 #if 0
         IOLog("AJZaurusUSB::dataWriteComplete - pool index=%lu\n", poolIndx);
 #endif
-        IOSimpleLockLock(me->fLock);
-        --(me->fDataCount);
-        dataCount = me->fDataCount;
-        stalled = me->fOutputStalled;
-        if(stalled)
-            IOLog("AJZaurusUSB::dataWriteComplete - was stalled\n");
-        me->fOutputStalled = false; // no longer...
-		me->fPipeOutBuff[poolIndx].inuse = false;    // free up buffer
-        IOSimpleLockUnlock(me->fLock);
         } 
     else 
         {
         IOLog("AJZaurusUSB::dataWriteComplete - IO err %d\n", rc);
-        // FIXME: what do we do with the buffer?
+        if (me->fOutputErrsOK)
+            me->fpNetStats->outputErrors++;
         if (rc != kIOReturnAborted)
             {
 			
@@ -320,16 +488,251 @@ void net_lucid_cake_driver_AJZaurusUSB::dataWriteComplete(void *obj, void *param
                 }
             }
         }
-    if (stalled && dataCount == 0) 
-        {
-        IOLog("AJZaurusUSB:dataWriteComplete - trying to revive a stalled queue\n");
-        me->fTransmitQueue->service(IOBasicOutputQueue::kServiceAsync);	// revive a stalled transmit queue
-        }
     
     return;
     
 }/* end dataWriteComplete */
 
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::txDoneOccurred
+//
+//		Inputs:		owner, sender and count (of interruptOccurred calls)
+//
+//		Outputs:	
+//
+//		Desc:		Static member function called on the workloop after dataWriteComplete
+//					found the list of completed writes empty. Forwards to reclaimOutputBuffers.
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::txDoneOccurred(OSObject *owner, IOInterruptEventSource *sender, int count)
+{
+    net_lucid_cake_driver_AJZaurusUSB	*target = OSDynamicCast(net_lucid_cake_driver_AJZaurusUSB, owner);
+    
+    if (target)
+        target->reclaimOutputBuffers();
+    
+}/* end txDoneOccurred */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::initOutputBuffers
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Empty the free lists. growOutputBuffers puts the buffers there
+//					once the slab chunk behind them is allocated.
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::initOutputBuffers(void)
+{
+    UInt32	i;
+    
+    for (i=0; i<kOutBufSlots; i++)
+        fOutFreeNext[i] = kOutBufNone;
+    fOutFreeHead[0] = kOutBufNone;	// tag 0, empty
+    fOutFreeHead[1] = kOutBufNone;
+    fOutDoneHead = kOutBufNone;
+    fDataCount = 0;
+    
+}/* end initOutputBuffers */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::putOutputBuffers
+//
+//		Inputs:		first - first pool index of a chain linked through fOutFreeNext[]
+//					last - last pool index of that chain
+//
+//		Outputs:	
+//
+//		Desc:		Push a chain of free output buffers on the free list they belong to
+//					(regular or large). Does not touch fDataCount.
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::putOutputBuffers(UInt32 first, UInt32 last)
+{
+    index_stack_push(&fOutFreeHead[first >= kOutBufPool], fOutFreeNext, first, last);
+    
+}/* end putOutputBuffers */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::getOutputBuffers
+//
+//		Inputs:		poolIndx - where to store the pool indices
+//					count - how many we want
+//					large - need ones of fOutBufSize bytes instead of fOutSlotSize
+//
+//		Outputs:	Return code - how many we got (0 = all buffers in flight)
+//
+//		Desc:		Pop up to count free output buffers with a single compare-and-swap. Lock free,
+//					so it never waits for the write completion routine which pushes buffers back.
+//					shrinkOutputBuffers only frees a chunk whose buffers are all on the free
+//					list, so it doesn't care about fDataCount.
+//
+/****************************************************************************************************/
+
+UInt32 net_lucid_cake_driver_AJZaurusUSB::getOutputBuffers(UInt32 *poolIndx, UInt32 count, bool large)
+{
+    UInt32	n, i;
+    
+    n = index_stack_pop(&fOutFreeHead[large], fOutFreeNext, poolIndx, count);
+    if (n > 0)
+        OSAddAtomic(n, &fDataCount);
+    for (i = 0; i < n; i++)
+        fPipeOutBuff[poolIndx[i]].inuse = true;	// now in use
+    return n;
+    
+}/* end getOutputBuffers */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::retireOutputBuffer
+//
+//		Inputs:		poolIndx - pool index of a finished or failed write
+//
+//		Outputs:	
+//
+//		Desc:		Mark an output buffer as no longer in use and free the mbuf chain of a
+//					zero-copy write. The caller puts it back on a free list.
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::retireOutputBuffer(UInt32 poolIndx)
+{
+    fPipeOutBuff[poolIndx].inuse = false;
+    if (fPipeOutBuff[poolIndx].chainMDP)
+        { // zero-copy write is over
+        fPipeOutBuff[poolIndx].chainMDP->release();
+        fPipeOutBuff[poolIndx].chainMDP = NULL;
+        }
+    if (fPipeOutBuff[poolIndx].packet)
+        {
+        freePacket(fPipeOutBuff[poolIndx].packet);
+        fPipeOutBuff[poolIndx].packet = NULL;
+        }
+    
+}/* end retireOutputBuffer */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::releaseOutputBuffer
+//
+//		Inputs:		poolIndx - pool index
+//
+//		Outputs:	Return code - number of buffers still in flight
+//
+//		Desc:		Push an output buffer back on the free list (from completion or error paths)
+//					and free the mbuf chain of a zero-copy write
+//
+/****************************************************************************************************/
+
+SInt32 net_lucid_cake_driver_AJZaurusUSB::releaseOutputBuffer(UInt32 poolIndx)
+{
+    if (poolIndx >= kOutBufSlots || !fPipeOutBuff[poolIndx].inuse)
+        {
+        IOLog("AJZaurusUSB::releaseOutputBuffer - buffer %lu is not in use\n", poolIndx);
+        return fDataCount;
+        }
+    retireOutputBuffer(poolIndx);
+    putOutputBuffers(poolIndx, poolIndx);
+    return OSDecrementAtomic(&fDataCount) - 1;
+    
+}/* end releaseOutputBuffer */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::completeOutputBuffer
+//
+//		Inputs:		poolIndx - pool index of a finished write
+//
+//		Outputs:	Return code - true (the list was empty, nobody may be about to reclaim it)
+//
+//		Desc:		Record a completed write for reclaimOutputBuffers. Lock free and short,
+//					since this is called from the USB completion.
+//
+/****************************************************************************************************/
+
+bool net_lucid_cake_driver_AJZaurusUSB::completeOutputBuffer(UInt32 poolIndx)
+{
+    if (poolIndx >= kOutBufSlots || !fPipeOutBuff[poolIndx].inuse)
+        {
+        IOLog("AJZaurusUSB::completeOutputBuffer - buffer %lu is not in use\n", poolIndx);
+        return false;
+        }
+    return index_list_push(&fOutDoneHead, fOutFreeNext, poolIndx);
+    
+}/* end completeOutputBuffer */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::reclaimOutputBuffers
+//
+//		Inputs:		
+//
+//		Outputs:	Return code - number of buffers reclaimed
+//
+//		Desc:		Take all completed writes at once, free their mbufs (zero-copy), put the
+//					buffers back on the free lists with one push per list and restart the
+//					output queue (once) if it was stalled. The write latencies are fed to
+//					the depth controller on the way. Called by the transmit path
+//					when it needs buffers and on the workloop by fTxDoneSource.
+//
+/****************************************************************************************************/
+
+UInt32 net_lucid_cake_driver_AJZaurusUSB::reclaimOutputBuffers(void)
+{
+    UInt32	first[2] = { kOutBufNone, kOutBufNone };
+    UInt32	last[2] = { kOutBufNone, kOutBufNone };
+    UInt32	head, n, next, l;
+    UInt32	count = 0;
+    SInt32	dataCount;
+    UInt64	ns;
+    
+    if ((head = index_list_take(&fOutDoneHead)) == kOutBufNone)
+        return 0;	// somebody else was faster
+    
+    for (n = head; n != kOutBufNone; n = next)
+        {
+        next = fOutFreeNext[n];
+        if (fPipeOutBuff[n].latency)
+            {
+            absolutetime_to_nanoseconds(fPipeOutBuff[n].latency, &ns);
+            txDepthUpdate((UInt32)(ns / 1000));
+            }
+        retireOutputBuffer(n);
+        l = (n >= kOutBufPool);
+        fOutFreeNext[n] = first[l];
+        if (first[l] == kOutBufNone)
+            last[l] = n;
+        first[l] = n;
+        count++;
+        }
+    for (l = 0; l < 2; l++)
+        {
+        if (first[l] != kOutBufNone)
+            putOutputBuffers(first[l], last[l]);
+        }
+    dataCount = OSAddAtomic(-(SInt32)count, &fDataCount) - count;
+    
+    if (fOutputStalled && (dataCount <= 0 || tx_restart((UInt32) dataCount, fTxDepth.limit)) && fReady) 
+        { // enough writes have completed
+#if 0
+        IOLog("AJZaurusUSB:reclaimOutputBuffers - restarting the stalled queue (%ld writes in flight)\n", dataCount);
+#endif
+        fOutputStalled = false; // no longer...
+        fTransmitQueue->service(net_lucid_cake_driver_AJZaurusUSBOutputQueue::kServiceAsync);	// restart the stalled transmit queue
+        }
+    return count;
+    
+}/* end reclaimOutputBuffers */
+
 /****************************************************************************************************/
 //
 //		Method:		net_lucid_cake_driver_AJZaurusUSB::merWriteComplete
@@ -484,7 +887,7 @@ void net_lucid_cake_driver_AJZaurusUSB::statsWriteComplete(void *obj, void *para
 //		Outputs:	
 //
 //		Desc:		Static member function called when a timer event fires.
-//					Forwards this call to the timeOutOccurred method
+//					Forwards this call to the timeOutOccurred method (or flushTimeout for the NTB timer)
 //
 /****************************************************************************************************/
 
@@ -497,7 +900,11 @@ void net_lucid_cake_driver_AJZaurusUSB::timerFired(OSObject *owner, IOTimerEvent
         {
         net_lucid_cake_driver_AJZaurusUSB* target = OSDynamicCast(net_lucid_cake_driver_AJZaurusUSB, owner);
         
-        if (target)
+        if (target && sender == target->fNtbTimer)
+            {
+            target->flushTimeout();
+            }
+        else if (target)
             {
             target->timeoutOccurred(sender);
             }
@@ -524,7 +931,7 @@ bool net_lucid_cake_driver_AJZaurusUSB::createNetworkInterface()
     
     // Allocate memory for buffers etc
     
-    fTransmitQueue = (IOBasicOutputQueue*)getOutputQueue();
+    fTransmitQueue = OSDynamicCast(net_lucid_cake_driver_AJZaurusUSBOutputQueue, getOutputQueue());
     if (!fTransmitQueue) 
         {
         IOLog("AJZaurusUSB::createNetworkInterface - Output queue initialization failed\n");
@@ -555,6 +962,53 @@ bool net_lucid_cake_driver_AJZaurusUSB::createNetworkInterface()
         return false;
         }
     
+    // Allocate the event source which reclaims completed writes on the workloop
+    
+    fTxDoneSource = IOInterruptEventSource::interruptEventSource(this, txDoneOccurred);
+    if (!fTxDoneSource || fWorkLoop->addEventSource(fTxDoneSource) != kIOReturnSuccess)
+        {
+        IOLog("AJZaurusUSB::createNetworkInterface - Allocate completion event source failed\n");
+        fWorkLoop->removeEventSource(fTimerSource);
+        fTransmitQueue->release();
+        fTransmitQueue = NULL;
+        return false;
+        }
+    
+    // Allocate the event source which processes completed reads on the workloop
+    
+    fRxSource = IOInterruptEventSource::interruptEventSource(this, rxOccurred);
+    if (!fRxSource || fWorkLoop->addEventSource(fRxSource) != kIOReturnSuccess)
+        {
+        IOLog("AJZaurusUSB::createNetworkInterface - Allocate receive event source failed\n");
+        fWorkLoop->removeEventSource(fTxDoneSource);
+        fWorkLoop->removeEventSource(fTimerSource);
+        fTransmitQueue->release();
+        fTransmitQueue = NULL;
+        return false;
+        }
+    
+    // Allocate the NCM/RNDIS/EEM transmit aggregation timer
+    
+    if (fNCM || fRNDIS || fEEM)
+        {
+        fNtbTimer = IOTimerEventSource::timerEventSource(this, timerFired);
+        if (!fNtbTimer || fWorkLoop->addEventSource(fNtbTimer) != kIOReturnSuccess)
+            {
+            IOLog("AJZaurusUSB::createNetworkInterface - Allocate NTB timer failed\n");
+            if (fNtbTimer)
+                {
+                fNtbTimer->release();
+                fNtbTimer = NULL;
+                }
+            fWorkLoop->removeEventSource(fRxSource);
+            fWorkLoop->removeEventSource(fTxDoneSource);
+            fWorkLoop->removeEventSource(fTimerSource);
+            fTransmitQueue->release();
+            fTransmitQueue = NULL;
+            return false;
+            }
+        }
+    
     // Attach an IOEthernetInterface client
     
     IOLog("AJZaurusUSB::createNetworkInterface - attaching and registering interface\n");
@@ -562,6 +1016,14 @@ bool net_lucid_cake_driver_AJZaurusUSB::createNetworkInterface()
     if (!attachInterface((IONetworkInterface **)&fNetworkInterface, true))
         {	
 			IOLog("AJZaurusUSB::createNetworkInterface - attachInterface failed\n");
+			if (fNtbTimer)
+				{
+				fWorkLoop->removeEventSource(fNtbTimer);
+				fNtbTimer->release();
+				fNtbTimer = NULL;
+				}
+			fWorkLoop->removeEventSource(fRxSource);
+			fWorkLoop->removeEventSource(fTxDoneSource);
 			fWorkLoop->removeEventSource(fTimerSource);
 			fTransmitQueue->release();
 			fTransmitQueue = NULL;
@@ -595,7 +1057,7 @@ bool net_lucid_cake_driver_AJZaurusUSB::createNetworkInterface()
 IOOutputQueue* net_lucid_cake_driver_AJZaurusUSB::createOutputQueue()
 {
     IOLog("AJZaurusUSB::createOutputQueue\n");
-    return IOBasicOutputQueue::withTarget(this, TRANSMIT_QUEUE_SIZE);
+    return net_lucid_cake_driver_AJZaurusUSBOutputQueue::withTarget(this, TRANSMIT_QUEUE_SIZE);
 }/* end createOutputQueue */
 
 /****************************************************************************************************/
@@ -644,4 +1106,410 @@ bool net_lucid_cake_driver_AJZaurusUSB::createMediumTables()
     
 }/* end createMediumTables */
 
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSBOutputQueue::withTarget
+//
+//		Inputs:		target - the driver
+//					capacity - max. number of queued packets
+//
+//		Outputs:	Return code - the queue (or NULL)
+//
+//		Desc:		Factory for the output queue
+//
+/****************************************************************************************************/
+
+net_lucid_cake_driver_AJZaurusUSBOutputQueue *net_lucid_cake_driver_AJZaurusUSBOutputQueue::withTarget(net_lucid_cake_driver_AJZaurusUSB *target, UInt32 capacity)
+{
+    net_lucid_cake_driver_AJZaurusUSBOutputQueue	*queue = new net_lucid_cake_driver_AJZaurusUSBOutputQueue;
+    
+    if (queue && !queue->initWithTarget(target, capacity))
+        {
+        queue->release();
+        queue = NULL;
+        }
+    return queue;
+    
+}/* end withTarget */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSBOutputQueue::initWithTarget
+//
+//		Inputs:		target - the driver (not retained, it owns us)
+//					capacity - max. number of queued packets
+//
+//		Outputs:	Return code - true (ok), false (failed)
+//
+//		Desc:		Initialize an empty and stopped queue
+//
+/****************************************************************************************************/
+
+bool net_lucid_cake_driver_AJZaurusUSBOutputQueue::initWithTarget(net_lucid_cake_driver_AJZaurusUSB *target, UInt32 capacity)
+{
+    if (!IOOutputQueue::init() || !target)
+        return false;
+    fTarget = target;
+    fHead = fTail = NULL;
+    fSize = 0;
+    fCapacity = capacity;
+    fBatch = kTxBatchMax;
+    fState = 0;
+    fRestart = false;
+    fDropCount = fOutputCount = fRetryCount = fStallCount = 0;
+    fLock = IOLockAlloc();
+    return (fLock != NULL);
+    
+}/* end initWithTarget */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSBOutputQueue::free
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Drop what is still queued and free the lock
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSBOutputQueue::free()
+{
+    if (fLock)
+        {
+        flush();
+        IOLockFree(fLock);
+        fLock = NULL;
+        }
+    IOOutputQueue::free();
+    
+}/* end free */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSBOutputQueue::setBatchSize
+//
+//		Inputs:		batch - packets per outputPackets call
+//
+//		Outputs:	
+//
+//		Desc:		Set the batch size (clipped to 1...kTxBatchMax)
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSBOutputQueue::setBatchSize(UInt32 batch)
+{
+    fBatch = MAX(1, MIN(batch, kTxBatchMax));
+    
+}/* end setBatchSize */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSBOutputQueue::enqueue
+//
+//		Inputs:		m - a packet or a chain of packets (linked by nextpkt)
+//					param - not used
+//
+//		Outputs:	Return code - number of packets dropped because the queue is full
+//
+//		Desc:		Called by the network stack. Queue the packets and then drain the queue
+//					on the caller's thread unless it is stalled or being drained already.
+//
+/****************************************************************************************************/
+
+UInt32 net_lucid_cake_driver_AJZaurusUSBOutputQueue::enqueue(mbuf_t m, void *param)
+{
+    mbuf_t	next;
+    mbuf_t	drop = NULL;
+    UInt32	dropped = 0;
+    
+    IOLockLock(fLock);
+    for (; m; m = next)
+        {
+        next = mbuf_nextpkt(m);
+        if (fSize >= fCapacity)
+            { // full
+            mbuf_setnextpkt(m, drop);
+            drop = m;
+            dropped++;
+            continue;
+            }
+        mbuf_setnextpkt(m, NULL);
+        if (fTail)
+            mbuf_setnextpkt(fTail, m);
+        else
+            fHead = m;
+        fTail = m;
+        fSize++;
+        }
+    fDropCount += dropped;
+    IOLockUnlock(fLock);
+    
+    for (; drop; drop = next)
+        {
+        next = mbuf_nextpkt(drop);
+        mbuf_setnextpkt(drop, NULL);
+        fTarget->freePacket(drop);
+        }
+    drain();
+    return dropped;
+    
+}/* end enqueue */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSBOutputQueue::drain
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Hand the queued packets to the driver, up to fBatch per call and with the lock
+//					released meanwhile. What the driver doesn't take goes back to the head of the
+//					queue and the queue stalls until service() is called (by dataWriteComplete).
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSBOutputQueue::drain()
+{
+    mbuf_t	pkts[kTxBatchMax];
+    UInt32	count, done, i;
+    
+    IOLockLock(fLock);
+    if (fState & kQueueActive)
+        { // the other thread will also send what we just queued
+        IOLockUnlock(fLock);
+        return;
+        }
+    fState |= kQueueActive;
+    while ((fState & (kQueueRunning | kQueueStalled)) == kQueueRunning && fHead)
+        {
+        for (count = 0; count < fBatch && fHead; count++)
+            {
+            pkts[count] = fHead;
+            fHead = mbuf_nextpkt(fHead);
+            mbuf_setnextpkt(pkts[count], NULL);
+            }
+        if (!fHead)
+            fTail = NULL;
+        fSize -= count;
+        fRestart = false;
+        IOLockUnlock(fLock);
+        
+        done = fTarget->outputPackets(pkts, count);
+        
+        IOLockLock(fLock);
+        fOutputCount += done;
+        if (done < count)
+            { // out of output buffers: requeue the rest in order
+            for (i = count; i-- > done; )
+                {
+                mbuf_setnextpkt(pkts[i], fHead);
+                fHead = pkts[i];
+                if (!fTail)
+                    fTail = pkts[i];
+                }
+            fSize += count - done;
+            fRetryCount++;
+            if (!fRestart)
+                { // nobody has restarted us in the meantime
+                fState |= kQueueStalled;
+                fStallCount++;
+                }
+            }
+        }
+    fState &= ~kQueueActive;
+    IOLockUnlock(fLock);
+    
+}/* end drain */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSBOutputQueue::serviceThread
+//
+//		Inputs:		param - not used
+//
+//		Outputs:	
+//
+//		Desc:		Thread call scheduled by service(kServiceAsync)
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSBOutputQueue::serviceThread(void *param)
+{
+    drain();
+    
+}/* end serviceThread */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSBOutputQueue::service
+//
+//		Inputs:		options - kServiceAsync (drain on a thread call instead of the caller's thread)
+//
+//		Outputs:	Return code - true (the queue was stalled)
+//
+//		Desc:		Restart a stalled queue
+//
+/****************************************************************************************************/
+
+bool net_lucid_cake_driver_AJZaurusUSBOutputQueue::service(IOOptionBits options)
+{
+    bool	stalled;
+    bool	running;
+    
+    IOLockLock(fLock);
+    stalled = (fState & kQueueStalled) != 0;
+    running = (fState & kQueueRunning) != 0;
+    fState &= ~kQueueStalled;
+    fRestart = true;
+    IOLockUnlock(fLock);
+    if (running)
+        {
+        if (options & kServiceAsync)
+            scheduleServiceThread();
+        else
+            drain();
+        }
+    return stalled;
+    
+}/* end service */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSBOutputQueue::start
+//
+//		Inputs:		
+//
+//		Outputs:	Return code - true (the queue was stopped)
+//
+//		Desc:		Start handing packets to the driver
+//
+/****************************************************************************************************/
+
+bool net_lucid_cake_driver_AJZaurusUSBOutputQueue::start()
+{
+    bool	wasStopped;
+    
+    IOLockLock(fLock);
+    wasStopped = !(fState & kQueueRunning);
+    fState = (fState | kQueueRunning) & ~kQueueStalled;
+    IOLockUnlock(fLock);
+    if (wasStopped)
+        scheduleServiceThread();	// for packets queued while we were stopped
+    return wasStopped;
+    
+}/* end start */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSBOutputQueue::stop
+//
+//		Inputs:		
+//
+//		Outputs:	Return code - true (the queue was running)
+//
+//		Desc:		Stop handing packets to the driver (a batch already out is completed)
+//
+/****************************************************************************************************/
+
+bool net_lucid_cake_driver_AJZaurusUSBOutputQueue::stop()
+{
+    bool	wasRunning;
+    
+    IOLockLock(fLock);
+    wasRunning = (fState & kQueueRunning) != 0;
+    fState &= ~kQueueRunning;
+    IOLockUnlock(fLock);
+    cancelServiceThread();
+    return wasRunning;
+    
+}/* end stop */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSBOutputQueue::flush
+//
+//		Inputs:		
+//
+//		Outputs:	Return code - number of packets dropped
+//
+//		Desc:		Drop all queued packets
+//
+/****************************************************************************************************/
+
+UInt32 net_lucid_cake_driver_AJZaurusUSBOutputQueue::flush()
+{
+    mbuf_t	m, next;
+    UInt32	count;
+    
+    IOLockLock(fLock);
+    m = fHead;
+    count = fSize;
+    fHead = fTail = NULL;
+    fSize = 0;
+    fDropCount += count;
+    IOLockUnlock(fLock);
+    for (; m; m = next)
+        {
+        next = mbuf_nextpkt(m);
+        mbuf_setnextpkt(m, NULL);
+        fTarget->freePacket(m);
+        }
+    return count;
+    
+}/* end flush */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSBOutputQueue::setCapacity etc.
+//
+//		Desc:		Accessors required by IOOutputQueue
+//
+/****************************************************************************************************/
+
+bool net_lucid_cake_driver_AJZaurusUSBOutputQueue::setCapacity(UInt32 capacity)
+{
+    IOLockLock(fLock);
+    fCapacity = capacity;	// does not drop what is queued beyond the new capacity
+    IOLockUnlock(fLock);
+    return true;
+}
+
+UInt32 net_lucid_cake_driver_AJZaurusUSBOutputQueue::getCapacity() const
+{
+    return fCapacity;
+}
+
+UInt32 net_lucid_cake_driver_AJZaurusUSBOutputQueue::getSize() const
+{
+    return fSize;
+}
+
+UInt32 net_lucid_cake_driver_AJZaurusUSBOutputQueue::getDropCount()
+{
+    return fDropCount;
+}
+
+UInt32 net_lucid_cake_driver_AJZaurusUSBOutputQueue::getOutputCount()
+{
+    return fOutputCount;
+}
+
+UInt32 net_lucid_cake_driver_AJZaurusUSBOutputQueue::getRetryCount()
+{
+    return fRetryCount;
+}
+
+UInt32 net_lucid_cake_driver_AJZaurusUSBOutputQueue::getStallCount()
+{
+    return fStallCount;
+}
+
+UInt32 net_lucid_cake_driver_AJZaurusUSBOutputQueue::getState() const
+{
+    return fState;
+}/* end getState */
+
 /* EOF */
\ No newline at end of file
@@ -0,0 +1,2396 @@
+/*
+ File:		HostTest.cpp
+
+ Description:	Bit-exact checks and micro benchmarks of the CRC and checksum code of the driver
+ (CRC.h, CRC.cpp), a stress test of the lock free output buffer lists (IndexStack.h),
+ checks of the framing helpers (Framing.h) and simulations of the transmit policy
+ (TxControl.h), run in user space on the development machine or any Linux host.
+
+   make hosttest
+
+ Each check compares the driver code against a simple reference implementation and
+ counts failures; the exit code is the number of failures. The benchmarks print
+ nanoseconds per byte and, on x86, time stamp counter ticks per byte.
+
+ Copyright:		Copyright 2004-2010 H. Nikolaus Schaller
+
+ Disclaimer:		This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2, or (at your option)
+ any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_CLMUL	1
+#endif
+
+#include "CRC.h"
+
+static void stack_race(void);
+#define INDEX_STACK_RACE()	stack_race()
+#include "IndexStack.h"
+#include "Framing.h"
+#include "TxControl.h"
+
+static int failures;
+
+#define CHECK(cond, what, arg) \
+    do { if (!(cond)) { failures++; printf("FAIL: %s (%lu)\n", what, (unsigned long) (arg)); } } while (0)
+
+/*
+ * Benchmark support
+ * BENCH runs stmt often enough to touch about kBenchBytes and prints the time per byte,
+ * best of kBenchRuns to filter out other load on the host. BENCH_FRAME prints the time per
+ * run of stmt instead, for code that handles one frame of bytes.
+ * The statements feed their result into the next iteration so that nothing can be hoisted.
+ */
+
+#define kBenchBytes	(64 * 1024 * 1024)
+#define kBenchRuns	3
+#define kMaxFrame	0xea00		// largest MDLM transfer
+
+static volatile UInt32 sink;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static UInt64 ticks(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void report(const char *name, UInt32 bytes, UInt64 iters, double ns, UInt64 tsc)
+{
+    double total = (double) bytes * iters;
+    if (tsc)
+        printf("  %-36s %6lu bytes: %6.3f ns/byte %6.3f ticks/byte %8.1f MB/s\n",
+               name, (unsigned long) bytes, ns / total, tsc / total, total / ns * 1e3);
+    else
+        printf("  %-36s %6lu bytes: %6.3f ns/byte %8.1f MB/s\n",
+               name, (unsigned long) bytes, ns / total, total / ns * 1e3);
+}
+
+static void report_frame(const char *name, UInt32 bytes, UInt64 iters, double ns, UInt64 tsc)
+{
+    if (tsc)
+        printf("  %-36s %6lu bytes: %8.1f ns/frame %8.0f ticks/frame\n",
+               name, (unsigned long) bytes, ns / iters, (double) tsc / iters);
+    else
+        printf("  %-36s %6lu bytes: %8.1f ns/frame\n", name, (unsigned long) bytes, ns / iters);
+}
+
+#define BENCH(name, bytes, stmt)		BENCH_WITH(report, name, bytes, stmt)
+#define BENCH_FRAME(name, bytes, stmt)	BENCH_WITH(report_frame, name, bytes, stmt)
+
+#define BENCH_WITH(reporter, name, bytes, stmt) \
+    do { \
+        UInt64 _n = kBenchBytes / (bytes) + 1, _i, _t, _best_t = 0; \
+        double _ns, _best_ns = 0; \
+        int _r; \
+        for (_r = 0; _r < kBenchRuns; _r++) \
+            { \
+            _ns = now_ns(), _t = ticks(); \
+            for (_i = 0; _i < _n; _i++) \
+                { stmt; } \
+            _t = ticks() - _t, _ns = now_ns() - _ns; \
+            if (_r == 0 || _ns < _best_ns) \
+                _best_ns = _ns, _best_t = _t; \
+            } \
+        reporter(name, bytes, _n, _best_ns, _best_t); \
+    } while (0)
+
+static void fill(unsigned char *p, UInt32 len, UInt32 seed)
+{
+    while (len--)
+        *p++ = (unsigned char) ((seed = seed * 1103515245 + 12345) >> 16);
+}
+
+/*
+ * Reference CRC: bit at a time, reflected polynomial 0xedb88320
+ */
+
+static UInt32 crc_bitwise(const unsigned char *p, UInt32 len, UInt32 fcs)
+{
+    int k;
+    while (len--)
+        {
+        fcs ^= *p++;
+        for (k = 0; k < 8; k++)
+            fcs = (fcs >> 1) ^ (0xedb88320 & -(fcs & 1));
+        }
+    return fcs;
+}
+
+/* the byte at a time engine which slicing-by-8 replaced */
+
+static UInt32 crc_bytewise(const unsigned char *p, UInt32 len, UInt32 fcs)
+{
+    while (len--)
+        fcs = CRC32_FCS(fcs, *p++);
+    return fcs;
+}
+
+/*
+ * Slicing-by-8
+ */
+
+static void test_slice8(void)
+{
+    static unsigned char src[kMaxFrame + 16], dst[kMaxFrame + 16];
+    UInt32 len, al, k, n, fcs;
+
+    printf("slicing-by-8 CRC32\n");
+    for (k = 1; k < 8; k++)
+        for (n = 0; n < 256; n++)
+            CHECK(crc32_table[k][n] == ((crc32_table[k-1][n] >> 8) ^ crc32_table[0][crc32_table[k-1][n] & 0xff]),
+                  "crc32_table", k * 256 + n);
+    fill(src, sizeof(src), 1);
+    for (len = 0; len < 300; len++)
+        for (al = 0; al < 8; al++)
+            {
+            fcs = crc_bitwise(src + al, len, CRC32_INITFCS);
+            CHECK(fcs_compute32(src + al, len, CRC32_INITFCS) == fcs, "fcs_compute32", len);
+            CHECK(fcs_memcpy32(dst + (al ^ 3), src + al, len, CRC32_INITFCS) == fcs, "fcs_memcpy32", len);
+            CHECK(memcmp(dst + (al ^ 3), src + al, len) == 0, "fcs_memcpy32 copy", len);
+            }
+    fcs = ~fcs_compute32(src, 1514, CRC32_INITFCS);
+    OSWriteLittleInt32(src, 1514, fcs);
+    CHECK(fcs_compute32(src, 1514 + 4, CRC32_INITFCS) == CRC32_GOODFCS, "frame with FCS", 1514);
+    CHECK(fcs_compute32((unsigned char *) "123456789", 9, CRC32_INITFCS) == ~0xcbf43926U, "check value", 9);
+
+    fcs = CRC32_INITFCS;
+    BENCH("byte at a time", 64, fcs = crc_bytewise(src, 64, fcs));
+    BENCH("slicing-by-8", 64, fcs = fcs_compute32(src, 64, fcs));
+    BENCH("byte at a time", 1514, fcs = crc_bytewise(src, 1514, fcs));
+    BENCH("slicing-by-8", 1514, fcs = fcs_compute32(src, 1514, fcs));
+    BENCH("byte at a time", kMaxFrame, fcs = crc_bytewise(src, kMaxFrame, fcs));
+    BENCH("slicing-by-8", kMaxFrame, fcs = fcs_compute32(src, kMaxFrame, fcs));
+    sink = fcs;
+}
+
+/*
+ * Carry-less multiply folding
+ * The kext can't use it (CRC.h explains why), so this is a host only engine that measures
+ * what the table code leaves on the table, and proves the folding constants for the
+ * reflected polynomial in case a user space tool or a later kernel API wants them.
+ * Folds 4 x 128 bits per round, then down to 32 bits with a Barrett reduction.
+ * Takes and returns a raw fcs like the fcs_* functions; len must be at least 64.
+ */
+
+#ifdef HAVE_CLMUL
+__attribute__((target("pclmul,sse4.1")))
+static UInt32 crc_clmul(const unsigned char *buf, UInt32 len, UInt32 fcs)
+{
+    static const UInt64 k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+    static const UInt64 k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0ULL, 0x00ccaa009eULL };
+    static const UInt64 k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124ULL, 0 };
+    static const UInt64 poly[2] __attribute__((aligned(16))) = { 0x01db710641ULL, 0x01f7011641ULL };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) fcs));
+    x0 = _mm_load_si128((const __m128i *) k1k2);
+    for (buf += 64, len -= 64; len >= 64; buf += 64, len -= 64)
+        {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *) (buf + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *) (buf + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *) (buf + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *) (buf + 0x30)));
+        }
+    // fold the 4 lanes into one, then eat the remaining 16 byte blocks
+    x0 = _mm_load_si128((const __m128i *) k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+    for (; len >= 16; buf += 16, len -= 16)
+        {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *) buf)), x5);
+        }
+    // 128 -> 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_loadl_epi64((const __m128i *) k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i *) poly);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, x3), x0, 0x00);
+    fcs = (UInt32) _mm_extract_epi32(_mm_xor_si128(x1, x2), 1);
+    return fcs_compute32((unsigned char *) buf, len, fcs);	// tail
+}
+#endif
+
+static void test_clmul(void)
+{
+#ifdef HAVE_CLMUL
+    static unsigned char src[kMaxFrame + 16];
+    UInt32 len, al, fcs;
+
+    printf("carry-less multiply CRC32 (host only)\n");
+    if (!__builtin_cpu_supports("pclmul") || !__builtin_cpu_supports("sse4.1"))
+        {
+        printf("  no PCLMULQDQ on this CPU - skipped\n");
+        return;
+        }
+    fill(src, sizeof(src), 2);
+    for (len = 64; len < 600; len++)
+        for (al = 0; al < 4; al++)
+            CHECK(crc_clmul(src + al, len, CRC32_INITFCS) == fcs_compute32(src + al, len, CRC32_INITFCS), "crc_clmul", len);
+    CHECK(crc_clmul(src, kMaxFrame, 0x12345678) == fcs_compute32(src, kMaxFrame, 0x12345678), "crc_clmul", kMaxFrame);
+
+    fcs = CRC32_INITFCS;
+    BENCH("slicing-by-8", 64, fcs = fcs_compute32(src, 64, fcs));
+    BENCH("carry-less multiply", 64, fcs = crc_clmul(src, 64, fcs));
+    BENCH("slicing-by-8", 1514, fcs = fcs_compute32(src, 1514, fcs));
+    BENCH("carry-less multiply", 1514, fcs = crc_clmul(src, 1514, fcs));
+    BENCH("slicing-by-8", kMaxFrame, fcs = fcs_compute32(src, kMaxFrame, fcs));
+    BENCH("carry-less multiply", kMaxFrame, fcs = crc_clmul(src, kMaxFrame, fcs));
+    sink = fcs;
+#endif
+}
+
+/*
+ * Fused copy and CRC for the transmit staging copy
+ * Compared with plain memcpy and with memcpy followed by a CRC pass, for an aligned
+ * and a misaligned source (mbuf data may start anywhere) and destination.
+ */
+
+static void test_memcpy32(void)
+{
+    static unsigned char src[kMaxFrame + 16], dst[kMaxFrame + 16];
+    static const UInt32 sizes[] = { 64, 1514, kMaxFrame };
+    UInt32 s, sa, da, fcs;
+    char name[64];
+
+    printf("fused copy and CRC\n");
+    fill(src, sizeof(src), 3);
+    for (s = 0; s < 3; s++)
+        for (sa = 0; sa < 8; sa++)
+            for (da = 0; da < 8; da++)
+                {
+                memset(dst, 0x55, sizes[s] + 16);
+                fcs = fcs_memcpy32(dst + da, src + sa, sizes[s], CRC32_INITFCS);
+                CHECK(fcs == crc_bitwise(src + sa, sizes[s], CRC32_INITFCS), "fcs_memcpy32", sizes[s]);
+                CHECK(memcmp(dst + da, src + sa, sizes[s]) == 0, "fcs_memcpy32 copy", sizes[s]);
+                CHECK((da == 0 || dst[da - 1] == 0x55) && dst[da + sizes[s]] == 0x55, "fcs_memcpy32 overrun", sizes[s]);
+                }
+
+    fcs = CRC32_INITFCS;
+    for (s = 0; s < 3; s++)
+        for (sa = 0; sa < 2; sa++)
+            {
+            UInt32 len = sizes[s];
+            unsigned char *sp = src + sa, *dp = dst + 3 * sa;	// aligned, then both odd
+            snprintf(name, sizeof(name), "memcpy%s", sa ? " (unaligned)" : "");
+            BENCH(name, len, memcpy(dp, sp, len); sp[0] ^= dp[len - 1]);
+            snprintf(name, sizeof(name), "memcpy + fcs_compute32%s", sa ? " (unaligned)" : "");
+            BENCH(name, len, memcpy(dp, sp, len); fcs = fcs_compute32(dp, len, fcs));
+            snprintf(name, sizeof(name), "fcs_memcpy32%s", sa ? " (unaligned)" : "");
+            BENCH(name, len, fcs = fcs_memcpy32(dp, sp, len, fcs));
+            }
+    sink = fcs;
+}
+
+/*
+ * CRC of zero padding and CRC combining
+ */
+
+static void test_combine(void)
+{
+    static unsigned char src[kMaxFrame + 16], zero[1 << 20], pad[kMaxFrame + 16];
+    static const UInt32 large[] = { 255, 256, 257, 65535, 65536, 65537, 0x12345, kMaxFrame, 1 << 19, (1 << 20) - 1 };
+    UInt32 len, i, split, fcs, crc1, crc2;
+
+    printf("crc32_zeros, crc32_combine and fcs_pad32\n");
+    fill(src, sizeof(src), 4);
+    for (len = 0; len < 1000; len++)
+        CHECK(crc32_zeros(0x9abcdef0 ^ len, len) == crc_bitwise(zero, len, 0x9abcdef0 ^ len), "crc32_zeros", len);
+    for (i = 0; i < sizeof(large) / sizeof(large[0]); i++)
+        CHECK(crc32_zeros(CRC32_INITFCS, large[i]) == crc_bitwise(zero, large[i], CRC32_INITFCS), "crc32_zeros", large[i]);
+    for (split = 0; split <= 1514; split += 7)
+        {
+        // final CRCs (complemented) as well as raw fcs values with B started at 0
+        crc1 = ~fcs_compute32(src, split, CRC32_INITFCS);
+        crc2 = ~fcs_compute32(src + split, 1514 - split, CRC32_INITFCS);
+        CHECK(crc32_combine(crc1, crc2, 1514 - split) == ~crc_bitwise(src, 1514, CRC32_INITFCS), "crc32_combine", split);
+        crc1 = fcs_compute32(src, split, CRC32_INITFCS);
+        crc2 = fcs_compute32(src + split, 1514 - split, 0);
+        CHECK(crc32_combine(crc1, crc2, 1514 - split) == crc_bitwise(src, 1514, CRC32_INITFCS), "crc32_combine raw", split);
+        }
+    for (len = 0; len < 1600; len++)
+        {
+        fcs = crc_bitwise(src, 60, CRC32_INITFCS);
+        memset(pad, 0x55, len + 1);
+        CHECK(fcs_pad32(pad, len, fcs) == crc_bitwise(zero, len, fcs), "fcs_pad32", len);
+        CHECK(memcmp(pad, zero, len) == 0 && pad[len] == 0x55, "fcs_pad32 pad", len);
+        }
+
+    fcs = CRC32_INITFCS;
+    for (len = 4; len <= 4096; len *= 4)
+        {
+        BENCH("pad byte at a time", len, fcs = crc_bytewise(zero, len, fcs));
+        BENCH("fcs_pad32", len, fcs = fcs_pad32(pad, len, fcs));
+        BENCH("crc32_zeros", len, fcs = crc32_zeros(fcs, len));
+        }
+    sink = fcs;
+}
+
+/*
+ * Interleaved CRC of a batch of received frames
+ * Compared with verifying the frames one after the other, as frameInput did before.
+ */
+
+static void test_multi(void)
+{
+    static unsigned char src[CRC32_MAX_STREAMS][kMaxFrame + 16];
+    static const UInt32 sizes[] = { 64, 128, 256, 576, 1514, 4096, kMaxFrame };
+    unsigned char *sp[CRC32_MAX_STREAMS];
+    UInt32 len[CRC32_MAX_STREAMS], fcs[CRC32_MAX_STREAMS], ref[CRC32_MAX_STREAMS];
+    UInt32 seed = 6, round, n, i, s, total;
+    char name[64];
+
+    printf("interleaved CRC of up to %d frames\n", CRC32_MAX_STREAMS);
+    for (i = 0; i < CRC32_MAX_STREAMS; i++)
+        fill(src[i], sizeof(src[i]), 60 + i);
+    for (round = 0; round < 20000; round++)
+        {
+        n = 1 + round % CRC32_MAX_STREAMS;
+        for (i = 0; i < n; i++)
+            {
+            seed = seed * 1103515245 + 12345;
+            len[i] = (seed >> 8) % ((round & 1) ? 40 : 2000);	// short ones (< 8 bytes left) too
+            sp[i] = src[i] + (seed & 7);
+            fcs[i] = ref[i] = (round & 2) ? CRC32_INITFCS : seed;
+            ref[i] = crc_bitwise(sp[i], len[i], ref[i]);
+            }
+        fcs_compute32_multi(sp, len, fcs, n);
+        for (i = 0; i < n; i++)
+            CHECK(fcs[i] == ref[i], "fcs_compute32_multi", round);
+        }
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+        for (i = 0; i < CRC32_MAX_STREAMS; i++)
+            sp[i] = src[i], len[i] = sizes[s], fcs[i] = CRC32_INITFCS;
+        total = CRC32_MAX_STREAMS * sizes[s];
+        snprintf(name, sizeof(name), "%d frames serial", CRC32_MAX_STREAMS);
+        BENCH(name, total, for (i = 0; i < CRC32_MAX_STREAMS; i++) fcs[i] = fcs_compute32(sp[i], len[i], fcs[i]));
+        snprintf(name, sizeof(name), "%d frames interleaved", CRC32_MAX_STREAMS);
+        BENCH(name, total, fcs_compute32_multi(sp, len, fcs, CRC32_MAX_STREAMS));
+        }
+    // a typical mixed batch: TCP data and ACKs
+    len[0] = 1514, len[1] = 66, len[2] = 1514, len[3] = 590;
+    total = len[0] + len[1] + len[2] + len[3];
+    BENCH("mixed batch serial", total, for (i = 0; i < CRC32_MAX_STREAMS; i++) fcs[i] = fcs_compute32(sp[i], len[i], fcs[i]));
+    BENCH("mixed batch interleaved", total, fcs_compute32_multi(sp, len, fcs, CRC32_MAX_STREAMS));
+    sink = fcs[0] ^ fcs[1] ^ fcs[2] ^ fcs[3];
+}
+
+/*
+ * Lock free output buffer lists
+ * kStackThreads threads pop 1-4 indices at a time (like USBTransmitPacket and the
+ * aggregation code), claim them, and push them back as one chain (like
+ * reclaimOutputBuffers). A buffer claimed twice means the stack handed it out twice.
+ * The threads give up the CPU between reading the stack and the swap now and then,
+ * so that the others get in even on a single CPU host.
+ * Meanwhile another thread shrinks and grows the slab like shrinkOutputBuffers and
+ * growOutputBuffers do with the last chunk. While it is freed its buffers are marked,
+ * and a thread which pops one of them counts an error as well.
+ */
+
+#define kStackSlots		100			// kOutBufPool
+#define kStackChunk		80			// first index of the last chunk
+#define kStackThreads	4
+#define kStackRounds	1000000
+#define kStackFreed		0xffffffff	// owner of a buffer of a freed chunk
+#define kStackTimeout	120			// s - a chain with a loop makes the threads spin for ever
+
+static volatile UInt32 stackHead;
+static UInt16 stackLink[kStackSlots];
+static volatile UInt32 stackOwner[kStackSlots];
+static volatile UInt32 stackErrors;
+static volatile UInt32 stackRacing;
+static volatile UInt32 stackShrinking;
+static UInt32 stackShrinks, stackShrinkTries;
+static __thread UInt32 stackRaceSeed;
+static __thread bool stackRaceQuiet;		// the shrinking thread keeps its window short
+
+static void stack_race(void)
+{
+    stackRaceSeed = stackRaceSeed * 1103515245 + 12345;
+    if (stackRacing && !stackRaceQuiet && (stackRaceSeed >> 16) % 16 == 0)
+        sched_yield();
+}
+
+static void *stack_thread(void *arg)
+{
+    UInt32 me = (UInt32) (uintptr_t) arg, seed = me, round, indx[4], n, i, k;
+
+    stackRaceSeed = me;
+
+    for (round = 0; round < kStackRounds; round++)
+        {
+        seed = seed * 1103515245 + 12345;
+        n = index_stack_pop(&stackHead, stackLink, indx, 1 + (seed >> 16) % 4);
+        for (i = 0; i < n; i++)
+            if (!OSCompareAndSwap(0, me, &stackOwner[indx[i]]))
+                __sync_fetch_and_add(&stackErrors, 1);	// somebody else has it
+        for (i = k = 0; i < n; i++)
+            {
+            if (!OSCompareAndSwap(me, 0, &stackOwner[indx[i]]))
+                { // not ours (any more): don't push it twice
+                __sync_fetch_and_add(&stackErrors, 1);
+                continue;
+                }
+            if (k > 0)
+                stackLink[indx[k - 1]] = indx[i];
+            indx[k++] = indx[i];
+            }
+        if (k > 0)
+            index_stack_push(&stackHead, stackLink, indx[0], indx[k - 1]);
+        }
+    return NULL;
+}
+
+static void *stack_shrink_thread(void *arg)
+{
+    UInt32 i;
+
+    stackRaceQuiet = true;
+    while (stackShrinking)
+        {
+        stackShrinkTries++;
+        if (index_stack_remove_range(&stackHead, stackLink, kStackChunk, kStackSlots - kStackChunk))
+            { // the chunk is gone for a moment
+            stackShrinks++;
+            for (i = kStackChunk; i < kStackSlots; i++)
+                stackOwner[i] = kStackFreed;
+            sched_yield();
+            for (i = kStackChunk; i < kStackSlots; i++)
+                {
+                stackOwner[i] = 0;
+                stackLink[i] = i + 1;
+                }
+            index_stack_push(&stackHead, stackLink, kStackChunk, kStackSlots - 1);
+            }
+        sched_yield();
+        }
+    return NULL;
+}
+
+static void stack_hung(int sig)
+{
+    static const char msg[] = "FAIL: index stack test hung (a chain has a loop)\n";
+
+    write(1, msg, sizeof(msg) - 1);
+    _exit(1);
+}
+
+static double stack_run(UInt32 threads)
+{
+    pthread_t tid[kStackThreads], shrinker;
+    UInt32 i, n, count, indx;
+    double ns;
+
+    stackHead = INDEX_STACK_NONE;
+    for (i = 0; i < kStackSlots; i++)
+        {
+        stackLink[i] = i;
+        index_stack_push(&stackHead, stackLink, i, i);
+        }
+    stackRacing = (threads > 1);
+    stackShrinking = 1;
+    stackShrinks = stackShrinkTries = 0;
+    signal(SIGALRM, stack_hung);
+    alarm(kStackTimeout);
+    ns = now_ns();
+    for (i = 0; i < threads; i++)
+        pthread_create(&tid[i], NULL, stack_thread, (void *) (uintptr_t) (i + 1));
+    pthread_create(&shrinker, NULL, stack_shrink_thread, NULL);
+    for (i = 0; i < threads; i++)
+        pthread_join(tid[i], NULL);
+    ns = now_ns() - ns;
+    stackShrinking = 0;
+    pthread_join(shrinker, NULL);
+    alarm(0);
+    stackRacing = 0;
+    // everything must be back on the stack exactly once
+    for (count = 0; count <= kStackSlots && index_stack_pop(&stackHead, stackLink, &indx, 1) == 1; count++)
+        {
+        CHECK(indx < kStackSlots && stackOwner[indx] == 0, "index stack duplicate", indx);
+        if (indx < kStackSlots)
+            stackOwner[indx] = 1;
+        }
+    CHECK(count == kStackSlots, "index stack entry count", count);
+    for (n = 0; n < kStackSlots; n++)
+        stackOwner[n] = 0;
+    return ns;
+}
+
+static void test_index_stack(void)
+{
+    UInt32 threads;
+    double ns;
+
+    printf("lock free index stack\n");
+    for (threads = 1; threads <= kStackThreads; threads *= 2)
+        {
+        stackErrors = 0;
+        ns = stack_run(threads);
+        CHECK(stackErrors == 0, "index stack handed out an entry twice or a freed one", stackErrors);
+        CHECK(stackShrinks > 0, "index stack never shrunk", stackShrinkTries);
+        printf("  %lu thread(s): %6.1f ns per pop and push (%lu rounds each), shrunk %lu of %lu times\n",
+               (unsigned long) threads, ns / ((double) kStackRounds * threads), (unsigned long) kStackRounds,
+               (unsigned long) stackShrinks, (unsigned long) stackShrinkTries);
+        }
+}
+
+/*
+ * List of completed writes
+ * kDoneWriters threads complete writes like dataWriteComplete (index_list_push) while
+ * kDoneReclaimers threads take the list like reclaimOutputBuffers (index_list_take) and
+ * hand the buffers back. Every completed write must be reclaimed exactly once, and only
+ * a push onto an empty list may wake a reclaimer: there must be exactly as many of them
+ * as non-empty takes, so that one signal per batch is enough. Prints the batch sizes.
+ */
+
+#define kDoneSlots		100			// kOutBufPool
+#define kDoneWriters	3
+#define kDoneReclaimers	2
+#define kDoneRounds		100000
+
+static volatile UInt32 doneHead;
+static UInt16 doneLink[kDoneSlots];
+static volatile UInt32 doneState[kDoneSlots];	// 0 free, 1 in flight, 2 completed
+static volatile UInt32 doneErrors, doneWriting;
+static volatile UInt32 doneSignals, doneTakes, doneReclaimed;
+
+static void *done_writer(void *arg)
+{
+    UInt32 me = (UInt32) (uintptr_t) arg, round, i;
+
+    stackRaceSeed = me;
+    for (round = 0; round < kDoneRounds; round++)
+        {
+        i = (me + round * kDoneWriters) % kDoneSlots;
+        while (!OSCompareAndSwap(0, 1, &doneState[i]))
+            sched_yield();	// not reclaimed yet
+        OSCompareAndSwap(1, 2, &doneState[i]);	// the write completes
+        if (index_list_push(&doneHead, doneLink, i))
+            __sync_fetch_and_add(&doneSignals, 1);	// fTxDoneSource->interruptOccurred
+        }
+    return NULL;
+}
+
+static UInt32 done_reclaim(void)
+{
+    UInt32 n, next, count = 0;
+
+    if ((n = index_list_take(&doneHead)) == INDEX_STACK_NONE)
+        return 0;
+    __sync_fetch_and_add(&doneTakes, 1);
+    for (; n != INDEX_STACK_NONE; n = next, count++)
+        {
+        if (n >= kDoneSlots)
+            {
+            __sync_fetch_and_add(&doneErrors, 1);
+            break;
+            }
+        next = doneLink[n];	// before it may be pushed again
+        if (!OSCompareAndSwap(2, 0, &doneState[n]))
+            __sync_fetch_and_add(&doneErrors, 1);	// taken twice or never completed
+        }
+    __sync_fetch_and_add(&doneReclaimed, count);
+    stack_race();
+    return count;
+}
+
+static void *done_reclaimer(void *arg)
+{
+    stackRaceSeed = (UInt32) (uintptr_t) arg;
+    while (doneWriting)
+        if (done_reclaim() == 0)
+            sched_yield();
+    return NULL;
+}
+
+static void test_done_list(void)
+{
+    pthread_t writers[kDoneWriters], reclaimers[kDoneReclaimers];
+    UInt32 i, left;
+    double ns;
+
+    printf("lock free list of completed writes\n");
+    doneHead = INDEX_STACK_NONE;
+    doneErrors = doneSignals = doneTakes = doneReclaimed = 0;
+    stackRacing = 1;
+    doneWriting = 1;
+    signal(SIGALRM, stack_hung);
+    alarm(kStackTimeout);
+    ns = now_ns();
+    for (i = 0; i < kDoneReclaimers; i++)
+        pthread_create(&reclaimers[i], NULL, done_reclaimer, (void *) (uintptr_t) (100 + i));
+    for (i = 0; i < kDoneWriters; i++)
+        pthread_create(&writers[i], NULL, done_writer, (void *) (uintptr_t) (i + 1));
+    for (i = 0; i < kDoneWriters; i++)
+        pthread_join(writers[i], NULL);
+    doneWriting = 0;
+    for (i = 0; i < kDoneReclaimers; i++)
+        pthread_join(reclaimers[i], NULL);
+    done_reclaim();	// what came in after the last look
+    ns = now_ns() - ns;
+    alarm(0);
+    stackRacing = 0;
+    for (left = 0, i = 0; i < kDoneSlots; i++)
+        left += (doneState[i] != 0);
+    CHECK(doneErrors == 0, "done list reclaimed a write twice or one never completed", doneErrors);
+    CHECK(left == 0, "done list lost a write", left);
+    CHECK(doneSignals == doneTakes, "done list signals per batch", doneTakes);
+    printf("  %lu writes by %d threads, %lu batches (%.1f per batch), %.1f ns per write\n",
+           (unsigned long) doneReclaimed, kDoneWriters, (unsigned long) doneTakes,
+           (double) doneReclaimed / MAX(doneTakes, 1), ns / MAX(doneReclaimed, 1));
+}
+
+/*
+ * Internet checksum for the TSO segmentation
+ * The reference is RFC 1071: 16 bit big endian words, odd byte padded with zero,
+ * end around carry. The split test copies a segment chunk by chunk at random
+ * boundaries (mbufs of odd lengths) the way tsoSegment does.
+ */
+
+static UInt16 inet_rfc1071(const unsigned char *p, UInt32 len, UInt32 sum)
+{
+    for (; len > 1; len -= 2, p += 2)
+        sum += (p[0] << 8) | p[1];
+    if (len)
+        sum += p[0] << 8;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (UInt16) sum;
+}
+
+static void test_inet(void)
+{
+    static unsigned char src[0x10000 + 16], dst[0x10000 + 16];
+    UInt32 len, al, round, pos, chunk, seed = 20;
+    UInt16 part;
+    UInt64 sum;
+
+    printf("internet checksum\n");
+    fill(src, sizeof(src), 5);
+    for (len = 0; len < 300; len++)
+        for (al = 0; al < 4; al++)
+            {
+            CHECK(inet_fold(inet_sum(src + al, len, 0)) == inet_rfc1071(src + al, len, 0), "inet_sum", len);
+            memset(dst, 0x55, len + 8);
+            sum = inet_memcpy_sum(dst + 1, src + al, len, 0);
+            CHECK(inet_fold(sum) == inet_rfc1071(src + al, len, 0), "inet_memcpy_sum", len);
+            CHECK(memcmp(dst + 1, src + al, len) == 0 && dst[len + 1] == 0x55, "inet_memcpy_sum copy", len);
+            }
+    memset(src, 0xff, 0x10000);	// worst case for the carries
+    CHECK(inet_fold(inet_sum(src, 0x10000, 0xffffffffULL)) == inet_rfc1071(src, 0x10000, 0xffff), "inet_sum carry", 0x10000);
+    fill(src, sizeof(src), 5);
+    for (round = 0; round < 2000; round++)
+        {
+        len = 1 + round % 1448;
+        for (sum = 0, pos = 0; pos < len; pos += chunk)
+            {
+            seed = seed * 1103515245 + 12345;
+            chunk = MIN(len - pos, 1 + (seed >> 16) % 97);
+            if (pos & 1)
+                { // starts on an odd byte
+                part = inet_fold(inet_memcpy_sum(dst + pos, src + pos, chunk, 0));
+                sum += (UInt16) ((part << 8) | (part >> 8));
+                }
+            else
+                sum = inet_memcpy_sum(dst + pos, src + pos, chunk, sum);
+            }
+        CHECK(inet_fold(sum) == inet_rfc1071(src, len, 0), "inet_memcpy_sum chunks", len);
+        CHECK(memcmp(dst, src, len) == 0, "inet_memcpy_sum chunks copy", len);
+        }
+
+    sum = 0;
+    BENCH("memcpy + inet_sum", 1448, memcpy(dst, src, 1448); sum = inet_sum(dst, 1448, sum));
+    BENCH("inet_memcpy_sum", 1448, sum = inet_memcpy_sum(dst, src, 1448, sum));
+    BENCH("memcpy + inet_sum", 0x10000, memcpy(dst, src, 0x10000); sum = inet_sum(dst, 0x10000, sum));
+    BENCH("inet_memcpy_sum", 0x10000, sum = inet_memcpy_sum(dst, src, 0x10000, sum));
+    sink = (UInt32) sum;
+}
+
+/*
+ * Ring of bulk in reads
+ * A model of the receive path against a mock pipe which delivers frames back to back
+ * at kPipeMBs as long as a read is queued. The driver side costs kBatchUS per
+ * processReads call plus kFrameUS and the measured fcs_memcpy32 time per frame.
+ * The reads are queued before and after each batch, like processReads does, as far as
+ * fillReadRing's rx_ring_room lets them: up to reads in flight of 2 * reads slots. One
+ * read with one slot is the old dataReadComplete, which queued the read again after its
+ * frame was processed. Prints how busy the pipe is kept.
+ */
+
+#define kPipeMBs	40.0		// high speed bulk in, bytes per microsecond
+#define kBatchUS	15.0		// completion, workloop wakeup, flushInput
+#define kFrameUS	2.0			// per frame outside the CRC (mbuf, inputPacket)
+#define kPipeFrames	100000
+
+struct pipe_state
+    {
+    double	at;			// the pipe is done with what it has been given
+    double	busy;		// time spent transferring
+    UInt32	submit;		// fInSubmit
+    UInt32	completed;	// fInCompleted
+    UInt32	deliver;	// fInDeliver
+    };
+
+static void pipe_advance(struct pipe_state *p, double until, double xfer)
+{
+    for (; p->submit != p->completed && p->at + xfer <= until; p->completed++)
+        p->at += xfer, p->busy += xfer;
+}
+
+static void pipe_fill(struct pipe_state *p, double now, UInt32 reads, UInt32 slots)
+{
+    UInt32 n = rx_ring_room(p->submit, p->completed, p->deliver, reads, slots);
+
+    if (n > 0 && p->submit == p->completed)
+        p->at = MAX(p->at, now);	// was idle
+    p->submit += n;
+}
+
+static double pipe_model(UInt32 size, UInt32 reads, double crcUS)
+{
+    struct pipe_state p = { 0, 0, 0, 0, 0 };
+    UInt32 slots = (reads == 1) ? 1 : 2 * reads;
+    UInt32 frames = 0, batch;
+    double xfer = size / kPipeMBs, now, driver = 0;
+
+    pipe_fill(&p, 0, reads, slots);
+    while (frames < kPipeFrames)
+        {
+        pipe_advance(&p, driver, xfer);
+        if (p.completed == p.deliver)
+            pipe_advance(&p, now = p.at + xfer, xfer);	// wait for the next completion
+        else
+            now = driver;
+        // processReads: fillReadRing, the batch, fillReadRing
+        pipe_fill(&p, now, reads, slots);
+        batch = p.completed - p.deliver;
+        driver = now + kBatchUS + batch * (kFrameUS + crcUS);
+        frames += batch;
+        pipe_advance(&p, driver, xfer);
+        p.deliver += batch;
+        pipe_fill(&p, driver, reads, slots);
+        }
+    return p.busy / MAX(p.at, driver);
+}
+
+static void test_read_ring(void)
+{
+    static unsigned char src[kMaxFrame + 16], dst[kMaxFrame + 16];
+    static const UInt32 sizes[] = { 64, 590, 1514, 8192 };
+    UInt32 s, reads, i, fcs = CRC32_INITFCS;
+    double ns;
+
+    printf("bulk in read ring (model, %.0f MB/s pipe)\n", kPipeMBs);
+    fill(src, sizeof(src), 7);
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+        ns = now_ns();
+        for (i = 0; i < 10000; i++)
+            fcs = fcs_memcpy32(dst, src, sizes[s], fcs);
+        ns = (now_ns() - ns) / 10000;
+        printf("  %5lu byte frames (CRC and copy %5.2f us):", (unsigned long) sizes[s], ns / 1000);
+        for (reads = 1; reads <= 8; reads *= 2)
+            printf("  %lu read%s %5.1f%%", (unsigned long) reads, reads > 1 ? "s" : " ", 100 * pipe_model(sizes[s], reads, ns / 1000));
+        printf("\n");
+        }
+    sink = fcs;
+}
+
+/*
+ * Zero-copy receive
+ * Batches of frames from the mock pipe, each in its own cluster sized read buffer, go
+ * through frameInput's choice (rx_zero_copy): the frames it keeps in their mbuf are
+ * verified in place (interleaved, CRC32_MAX_STREAMS at a time), the others are verified
+ * while they are copied into a fresh buffer. Compared with copying every frame. Prints
+ * the copied bytes per received byte (what the driver publishes as RxBytesCopied /
+ * RxBytes) and the time per received byte.
+ */
+
+#define kClusterBytes	2048	// MCLBYTES
+
+struct rx_mix
+    {
+    const char	*name;
+    UInt32		sizes[8];	// frame sizes with FCS, repeated
+    };
+
+static UInt64 rxBytes, rxCopied;
+
+static UInt32 rx_copy_all(unsigned char **frames, const UInt32 *sizes, UInt32 n, unsigned char *dst, UInt32 fcs)
+{
+    UInt32 i;
+    for (i = 0; i < n; i++)
+        {
+        fcs ^= fcs_memcpy32(dst, frames[i], sizes[i], CRC32_INITFCS);
+        rxBytes += sizes[i] - 4, rxCopied += sizes[i] - 4;
+        }
+    return fcs;
+}
+
+static UInt32 rx_in_place(unsigned char **frames, const UInt32 *sizes, UInt32 n, unsigned char *dst, UInt32 fcs)
+{
+    unsigned char *sp[CRC32_MAX_STREAMS];
+    UInt32 len[CRC32_MAX_STREAMS], f[CRC32_MAX_STREAMS];
+    UInt32 i, j, m;
+
+    for (i = 0; i < n; i += CRC32_MAX_STREAMS)
+        {
+        for (m = 0, j = i; j < i + CRC32_MAX_STREAMS && j < n; j++)
+            {
+            rxBytes += sizes[j] - 4;
+            if (!rx_zero_copy(true, sizes[j] - 4))
+                {
+                fcs ^= fcs_memcpy32(dst, frames[j], sizes[j], CRC32_INITFCS);
+                rxCopied += sizes[j] - 4;
+                continue;
+                }
+            sp[m] = frames[j], len[m] = sizes[j], f[m++] = CRC32_INITFCS;
+            }
+        fcs_compute32_multi(sp, len, f, m);
+        for (j = 0; j < m; j++)
+            fcs ^= f[j];
+        }
+    return fcs;
+}
+
+static void test_zero_copy(void)
+{
+    static const struct rx_mix mixes[] = {
+        { "bulk download", { 1518, 1518, 1518, 1518, 1518, 1518, 1518, 1518 } },
+        { "download with ACKs", { 1518, 1518, 70, 1518, 1518, 70, 1518, 70 } },
+        { "interactive", { 70, 130, 70, 300, 70, 70, 590, 70 } },
+    };
+    static unsigned char pipe[64][kClusterBytes], dst[kClusterBytes];
+    unsigned char *frames[64];
+    UInt32 sizes[64], x, i, total, fcs = 0;
+    char name[64];
+
+    printf("zero-copy receive (mock pipe, batches of 64 frames)\n");
+    for (x = 0; x < sizeof(mixes) / sizeof(mixes[0]); x++)
+        {
+        for (total = 0, i = 0; i < 64; i++)
+            {
+            frames[i] = pipe[i];
+            sizes[i] = mixes[x].sizes[i % 8];
+            fill(pipe[i], sizes[i] - 4, 100 + i);
+            OSWriteLittleInt32(pipe[i], sizes[i] - 4, ~fcs_compute32(pipe[i], sizes[i] - 4, CRC32_INITFCS));
+            total += sizes[i] - 4;
+            }
+        rxBytes = rxCopied = 0;
+        fcs = rx_copy_all(frames, sizes, 64, dst, 0);
+        CHECK(fcs == 0, "copied frames verify", x);	// an even number of CRC32_GOODFCS xors to 0
+        printf("  %-20s copy everything: %4.2f bytes copied per byte", mixes[x].name, (double) rxCopied / rxBytes);
+        rxBytes = rxCopied = 0;
+        fcs = rx_in_place(frames, sizes, 64, dst, 0);
+        CHECK(fcs == 0, "zero-copy frames verify", x);
+        printf(", zero-copy: %4.2f\n", (double) rxCopied / rxBytes);
+        snprintf(name, sizeof(name), "%s, copy", mixes[x].name);
+        BENCH(name, total, fcs = rx_copy_all(frames, sizes, 64, dst, fcs));
+        snprintf(name, sizeof(name), "%s, zero-copy", mixes[x].name);
+        BENCH(name, total, fcs = rx_in_place(frames, sizes, 64, dst, fcs));
+        }
+    sink = fcs;
+}
+
+/*
+ * Single pass verify and copy on receive
+ * rx_two_pass is receivePacket before: CRC pass, then copy. rx_fused does what
+ * verifyReceivePacket does: verify while copying into an mbuf chain (a small first
+ * mbuf, then clusters). Both handle an extra byte (size % packet size == 1) with the
+ * driver's rx_fcs_body and rx_fcs_length, i.e. the FCS is checked before and after
+ * it without a second pass. Both return the frame length or -1 (dropped).
+ */
+
+#define kRxPacketSize	64		// fOutPacketSize (full speed / MDLM)
+#define kRxFirstMbuf	208		// MHLEN
+
+static int rx_two_pass(unsigned char *packet, UInt32 size, unsigned char *dst)
+{
+    UInt32 body = rx_fcs_body(size, kRxPacketSize), fcs;
+
+    fcs = fcs_compute32(packet, body, CRC32_INITFCS);
+    if ((size = rx_fcs_length(fcs, packet, body, size)) == 0)
+        return -1;
+    memcpy(dst, packet, size - 4);
+    return size - 4;
+}
+
+static int rx_fused(unsigned char *packet, UInt32 size, unsigned char *dst)
+{
+    UInt32 body = rx_fcs_body(size, kRxPacketSize), off, len, fcs = CRC32_INITFCS;
+
+    for (off = 0; off < body; off += len)
+        {
+        len = MIN(off == 0 ? kRxFirstMbuf : kClusterBytes, body - off);
+        fcs = fcs_memcpy32(dst + off, packet + off, len, fcs);
+        }
+    if ((size = rx_fcs_length(fcs, packet, body, size)) == 0)
+        return -1;
+    return size - 4;	// mbuf_adj trims the FCS
+}
+
+static void test_verify_copy(void)
+{
+    static unsigned char packet[kMaxFrame + 16], dst1[kMaxFrame + 16], dst2[kMaxFrame + 16];
+    static const UInt32 sizes[] = { 68, 591, 1473, 1518, 8192 };
+    UInt32 n, pad, bad, size, i;
+    int r1, r2;
+    char name[64];
+
+    printf("single pass verify and copy on receive\n");
+    for (n = 5; n < 3000; n++)	// frame length with FCS
+        for (pad = 0; pad < 2; pad++)
+            for (bad = 0; bad < 3; bad++)
+                {
+                fill(packet, n - 4, n);
+                OSWriteLittleInt32(packet, n - 4, ~fcs_compute32(packet, n - 4, CRC32_INITFCS));
+                size = n;
+                if (pad && (n % kRxPacketSize) == 0)
+                    packet[size++] = 0;	// the device pads to avoid a zero length packet
+                if (bad == 1)
+                    packet[n / 2] ^= 0x10;
+                else if (bad == 2)
+                    packet[n - 1] ^= 0x80;	// last FCS byte, possibly the extra one
+                r1 = rx_two_pass(packet, size, dst1);
+                r2 = rx_fused(packet, size, dst2);
+                CHECK(r1 == r2, "verify and copy result", n);
+                CHECK(bad ? r2 < 0 : r2 == (int) n - 4, "verify and copy verdict", n);
+                CHECK(r2 < 0 || memcmp(dst2, packet, r2) == 0, "verify and copy data", n);
+                }
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        {
+        size = sizes[i];	// 1473: the extra byte is part of the FCS, so the CRC misses first
+        fill(packet, size - 4, size);
+        OSWriteLittleInt32(packet, size - 4, ~fcs_compute32(packet, size - 4, CRC32_INITFCS));
+        r1 = 0;
+        snprintf(name, sizeof(name), "two pass%s", (size % kRxPacketSize) == 1 ? " (extra byte)" : "");
+        BENCH(name, size, r1 += rx_two_pass(packet, size, dst1); packet[0] = dst1[0]);
+        snprintf(name, sizeof(name), "single pass%s", (size % kRxPacketSize) == 1 ? " (extra byte)" : "");
+        BENCH(name, size, r1 += rx_fused(packet, size, dst2); packet[0] = dst2[0]);
+        sink = r1;
+        }
+}
+
+/*
+ * Sampled receive FCS verification
+ * frameInput's countdown (rx_fcs_sample): with an interval of N only every Nth frame is
+ * verified (0 = never), the others are just trimmed. Zero-copy frames, so no copy either way.
+ */
+
+static UInt32 rx_sampled(unsigned char **frames, const UInt32 *sizes, UInt32 n, UInt32 interval, UInt32 *countdown, UInt32 *checked)
+{
+    UInt32 i, fcs = 0;
+
+    for (i = 0; i < n; i++)
+        {
+        if (!rx_fcs_sample(interval, countdown))
+            continue;	// trimmed without verifying
+        (*checked)++;
+        fcs ^= fcs_compute32(frames[i], sizes[i], CRC32_INITFCS);
+        }
+    return fcs;
+}
+
+static void test_sampled(void)
+{
+    static unsigned char pipe[64][kClusterBytes];
+    static const UInt32 intervals[] = { 1, 4, 16, 0 };
+    unsigned char *frames[64];
+    UInt32 sizes[64], i, x, countdown, checked, total = 0, fcs = 0;
+    char name[64];
+
+    printf("sampled receive FCS verification\n");
+    for (i = 0; i < 64; i++)
+        {
+        frames[i] = pipe[i];
+        sizes[i] = (i % 4 == 3) ? 70 : 1518;
+        fill(pipe[i], sizes[i], 200 + i);
+        total += sizes[i];
+        }
+    for (x = 0; x < sizeof(intervals) / sizeof(intervals[0]); x++)
+        {
+        countdown = 1, checked = 0;
+        rx_sampled(frames, sizes, 64, intervals[x], &countdown, &checked);
+        CHECK(checked == (intervals[x] ? 64 / intervals[x] : 0), "verify interval", intervals[x]);
+        countdown = 1;
+        snprintf(name, sizeof(name), "FCSVerifyInterval %lu", (unsigned long) intervals[x]);
+        BENCH(name, total, fcs ^= rx_sampled(frames, sizes, 64, intervals[x], &countdown, &checked));
+        }
+    sink = fcs;
+}
+
+/*
+ * Receive completion handler
+ * dataReadComplete runs on the USB completion thread, so every other completion on the
+ * controller (writes, the interrupt pipe) waits for it. Before, it verified the FCS, copied the
+ * frame into a new mbuf and passed it up right there (rx_inline). Now it only notes status and
+ * length in the slot of the read ring, sets done and wakes fRxSource (rx_record), and
+ * processReads on the workloop takes the completed slots in order and does that work for all
+ * of them (rx_process). Prints the time spent in the completion handler per read and the time
+ * processReads takes per frame, timed a pass of kRxHandlerSlots reads at a time. The wakeup
+ * of the workloop thread itself (interruptOccurred) is an atomic add here.
+ */
+
+#define kRxHandlerSlots	16			// fInSlots
+
+struct rx_slot
+    {
+    volatile bool	done;
+    UInt32			status, length;
+    UInt8			data[kClusterBytes];
+    };
+
+struct rx_handler
+    {
+    struct rx_slot	slot[kRxHandlerSlots];
+    UInt32			deliver;		// fInDeliver
+    volatile SInt32	completed;		// fInCompleted
+    volatile SInt32	signals;		// fRxSource
+    UInt8			mbuf[kClusterBytes];
+    UInt32			delivered, bad;
+    };
+
+static void rx_input(struct rx_handler *h, const UInt8 *data, UInt32 length)
+{
+    if (fcs_memcpy32(h->mbuf, (unsigned char *) data, length, CRC32_INITFCS) == CRC32_GOODFCS)
+        h->delivered++;	// verifyReceivePacket, then up the stack
+    else
+        h->bad++;
+}
+
+static void rx_inline(struct rx_handler *h, UInt32 i, UInt32 length)
+{
+    rx_input(h, h->slot[i].data, length);
+}
+
+static void rx_record(struct rx_handler *h, UInt32 i, UInt32 length)
+{
+    h->slot[i].status = 0;
+    h->slot[i].length = length;
+    OSSynchronizeIO();
+    h->slot[i].done = true;
+    __sync_fetch_and_add(&h->completed, 1);
+    __sync_fetch_and_add(&h->signals, 1);
+}
+
+static void rx_process(struct rx_handler *h)
+{
+    struct rx_slot *s;
+
+    while ((s = &h->slot[h->deliver % kRxHandlerSlots])->done)
+        {
+        OSSynchronizeIO();
+        s->done = false;
+        if (s->status == 0)
+            rx_input(h, s->data, s->length);
+        h->deliver++;
+        }
+}
+
+static void test_rx_handler(void)
+{
+    static struct rx_handler h;
+    static const UInt32 sizes[] = { 70, 590, 1518 };
+    UInt32 x, i, r, p, rounds, len;
+    double t, ns[3], best[3];
+
+    printf("receive completion handler (mock pipe, %d reads per pass)\n", kRxHandlerSlots);
+    for (x = 0; x < sizeof(sizes) / sizeof(sizes[0]); x++)
+        {
+        len = sizes[x];
+        for (i = 0; i < kRxHandlerSlots; i++)
+            {
+            fill(h.slot[i].data, len - 4, 700 + i);
+            OSWriteLittleInt32(h.slot[i].data, len - 4, ~fcs_compute32(h.slot[i].data, len - 4, CRC32_INITFCS));
+            }
+        h.delivered = h.bad = h.deliver = 0;
+        rounds = kBenchBytes / (kRxHandlerSlots * len) + 1;
+        for (r = 0; r < kBenchRuns; r++)
+            {
+            for (ns[0] = ns[1] = ns[2] = 0, p = 0; p < rounds; p++)
+                {
+                // before: everything in the completion handler
+                for (t = now_ns(), i = 0; i < kRxHandlerSlots; i++)
+                    rx_inline(&h, i, len);
+                ns[0] += now_ns() - t;
+                // now: record and signal, processReads once per pass
+                for (t = now_ns(), i = 0; i < kRxHandlerSlots; i++)
+                    rx_record(&h, i, len);
+                ns[1] += now_ns() - t;
+                t = now_ns();
+                rx_process(&h);
+                ns[2] += now_ns() - t;
+                }
+            for (i = 0; i < 3; i++)
+                best[i] = (r == 0) ? ns[i] : MIN(best[i], ns[i]);
+            }
+        printf("  %4lu byte frames: completion handler %6.1f ns before, %5.1f ns now; processReads %6.1f ns per frame\n",
+               (unsigned long) len, best[0] / (rounds * kRxHandlerSlots), best[1] / (rounds * kRxHandlerSlots),
+               best[2] / (rounds * kRxHandlerSlots));
+        CHECK(h.bad == 0 && h.delivered == 2 * kBenchRuns * rounds * kRxHandlerSlots, "deferred receive delivers every frame", len);
+        CHECK(h.completed == h.signals && (UInt32) h.completed == h.deliver, "deferred receive takes every completion", len);
+        h.completed = h.signals = 0;
+        }
+}
+
+/*
+ * Framing per mode
+ * What frameOutput and frameInput do per frame in each mode selectFraming picks from: the
+ * mbuf chain (a header and the rest) is copied, with the CRC computed on the way if the mode
+ * has one, and frame_trailer appends padding, CRC and the extra byte; the receive side checks
+ * the FCS like frameInput (rx_fcs_body, rx_fcs_length) and trims it. Every frame must come
+ * back with its payload and a padded frame must never end on a full packet. Prints the time
+ * of transmit plus receive per frame for each mode.
+ */
+
+#define kFramePacket	64			// full speed bulk packets (the Zaurus)
+
+template <bool Padded, bool Checksum>
+static UInt32 frame_tx(UInt8 *buf, UInt8 *payload, UInt32 len, UInt32 packetSize)
+{
+    UInt32 seg[2] = { 14, len - 14 }, fcs = CRC32_INITFCS, off = 0, i;
+
+    for (i = 0; i < 2; i++)
+        {
+        if (Checksum)
+            fcs = fcs_memcpy32(buf + off, payload + off, seg[i], fcs);
+        else
+            memcpy(buf + off, payload + off, seg[i]);
+        off += seg[i];
+        }
+    if (Padded || Checksum)
+        off += frame_trailer<Padded, Checksum>(buf + off, off, fcs, packetSize);
+    return off;
+}
+
+template <bool Checksum>
+static UInt32 frame_rx(const UInt8 *buf, UInt32 size, UInt32 packetSize)
+{
+    UInt32 body;
+
+    if (!Checksum)
+        return size;
+    if (size < 4)
+        return 0;
+    body = rx_fcs_body(size, packetSize);
+    if ((size = rx_fcs_length(fcs_compute32((unsigned char *) buf, body, CRC32_INITFCS), buf, body, size)) == 0)
+        return 0;
+    return size - 4;
+}
+
+template <bool Padded, bool Checksum>
+static UInt32 frame_txrx(UInt8 *buf, UInt8 *payload, UInt32 len)
+{
+    return frame_rx<Checksum>(buf, frame_tx<Padded, Checksum>(buf, payload, len, kFramePacket), kFramePacket);
+}
+
+template <bool Padded, bool Checksum>
+static void frame_mode(const char *name)
+{
+    static UInt8 payload[1514], buf[1514 + 2 * 512];
+    static const UInt32 lengths[] = { 60, 590, 1514 };
+    UInt32 (*txrx)(UInt8 *, UInt8 *, UInt32) = frame_txrx<Padded, Checksum>;	// like fFrameOutput
+    UInt32 len, size, got, p, x, sum = 0, packets[] = { kFramePacket, 512 };
+    bool same = true, zlp = false, bad = false;
+
+    fill(payload, sizeof(payload), 7);
+    for (p = 0; p < 2; p++)
+        for (len = 15; len <= sizeof(payload); len++)
+            {
+            size = frame_tx<Padded, Checksum>(buf, payload, len, packets[p]);
+            got = frame_rx<Checksum>(buf, size, packets[p]);
+            same = same && size <= frame_length<Padded, Checksum>(len, packets[p]) + 1 && got >= len && memcmp(buf, payload, len) == 0;
+            zlp = zlp || (Padded && size % packets[p] == 0);
+            buf[len / 2] ^= 0x10;
+            bad = bad || (Checksum && frame_rx<Checksum>(buf, size, packets[p]) != 0);
+            }
+    CHECK(same, "framing round trip", Padded * 2 + Checksum);
+    CHECK(!zlp, "framing zero length packet", Padded * 2 + Checksum);
+    CHECK(!bad, "framing bad FCS", Padded * 2 + Checksum);
+    for (x = 0; x < sizeof(lengths) / sizeof(lengths[0]); x++)
+        {
+        payload[0] = (UInt8) x;
+        BENCH_FRAME(name, lengths[x], sum += txrx(buf, payload, lengths[x]); payload[0] += (UInt8) sum);
+        }
+    sink = sum;
+}
+
+static void test_framing(void)
+{
+    printf("framing per mode (transmit and receive, %d byte packets)\n", kFramePacket);
+    frame_mode<true, true>("MDLM (padded, CRC)");
+    frame_mode<true, false>("padded");
+    frame_mode<false, true>("CRC");
+    frame_mode<false, false>("ECM, CDC Subset");
+}
+
+/*
+ * Zero-copy transmit
+ * Packets as the stack hands them over, an mbuf with the headers and the payload in one or
+ * more mbufs, go through USBTransmitPacket's choice: tx_map lists the mbufs for the descriptor
+ * like mapOutput (and computes the CRC in place and builds the trailer in the pool buffer if
+ * the mode has them), tx_copy copies the frame into the pool buffer like frameOutput. The mock
+ * pipe reads the frame by DMA, i.e. it gathers the ranges. Compared with copying every packet.
+ * Prints the bytes copied and the bytes the CPU reads or writes per transmitted byte, and the
+ * time per packet. Not included: the cost of the descriptor itself (withRanges, prepare),
+ * which is why short packets are still copied (kTxZeroCopyMin).
+ */
+
+#define kTxPackets		64
+#define kTxHeader		54			// Ethernet, IP and TCP headers
+
+struct tx_mix
+    {
+    const char	*name;
+    UInt32		sizes[8];			// packet sizes, repeated
+    UInt32		segments;			// mbufs per packet (if the packet is long enough)
+    };
+
+struct tx_chain
+    {
+    UInt8	*seg[kTxMaxSegments + 1];	// mbuf_data
+    UInt32	len[kTxMaxSegments + 1];	// mbuf_len
+    UInt32	n, total;
+    };
+
+struct tx_range
+    {
+    const UInt8	*address;			// IOVirtualRange
+    UInt32		length;
+    };
+
+static UInt64 txBytes, txCopied, txTouched;
+
+template <bool Padded, bool Checksum>
+static UInt32 tx_copy(const struct tx_chain *c, UInt8 *buf)
+{
+    UInt32 fcs = CRC32_INITFCS, rTotal = 0, i;
+
+    for (i = 0; i < c->n; i++)
+        {
+        if (Checksum)
+            fcs = fcs_memcpy32(buf + rTotal, c->seg[i], c->len[i], fcs);
+        else
+            memcpy(buf + rTotal, c->seg[i], c->len[i]);
+        rTotal += c->len[i];
+        }
+    if (Padded || Checksum)
+        rTotal += frame_trailer<Padded, Checksum>(buf + rTotal, rTotal, fcs, kFramePacket);
+    txBytes += c->total, txCopied += c->total, txTouched += 2 * rTotal;
+    return rTotal;
+}
+
+/* the ranges of the descriptor; 0 if the packet was copied to buf instead */
+
+template <bool Padded, bool Checksum>
+static UInt32 tx_map(const struct tx_chain *c, UInt8 *buf, struct tx_range *ranges)
+{
+    UInt32 fcs = CRC32_INITFCS, n;
+
+    if (!tx_zero_copy(c->total, c->n))
+        {
+        tx_copy<Padded, Checksum>(c, buf);
+        return 0;
+        }
+    for (n = 0; n < c->n; n++)
+        {
+        ranges[n].address = c->seg[n], ranges[n].length = c->len[n];
+        if (Checksum)
+            fcs = fcs_compute32(c->seg[n], c->len[n], fcs);
+        }
+    txBytes += c->total;
+    if (Checksum)
+        txTouched += c->total;
+    if (Padded || Checksum)
+        {
+        ranges[n].address = buf;
+        ranges[n].length = frame_trailer<Padded, Checksum>(buf, c->total, fcs, kFramePacket);
+        txTouched += ranges[n].length;
+        if (ranges[n].length > 0)
+            n++;
+        }
+    return n;
+}
+
+/* the mock pipe: the frame as it goes over the wire */
+
+static UInt32 tx_wire(UInt8 *wire, const UInt8 *buf, UInt32 size, const struct tx_range *ranges, UInt32 n)
+{
+    UInt32 i;
+
+    if (n == 0)
+        {
+        memcpy(wire, buf, size);
+        return size;
+        }
+    for (size = 0, i = 0; i < n; i++)
+        {
+        memcpy(wire + size, ranges[i].address, ranges[i].length);
+        size += ranges[i].length;
+        }
+    return size;
+}
+
+template <bool Padded, bool Checksum>
+static UInt32 tx_one_copy(const struct tx_chain *c, UInt8 *buf)
+{
+    return tx_copy<Padded, Checksum>(c, buf);
+}
+
+template <bool Padded, bool Checksum>
+static UInt32 tx_one_map(const struct tx_chain *c, UInt8 *buf)
+{
+    struct tx_range ranges[kTxMaxSegments + 1];
+    UInt32 n = tx_map<Padded, Checksum>(c, buf, ranges);
+
+    return n ? ranges[0].length + n : buf[0];
+}
+
+template <bool Padded, bool Checksum>
+static void tx_mode(const char *mode, const struct tx_mix *mixes, UInt32 count)
+{
+    static UInt8 payload[kTxPackets][1514], buf[2048], copied[2048], wire[2048];
+    struct tx_chain chains[kTxPackets];
+    struct tx_range ranges[kTxMaxSegments + 1];
+    UInt32 (*copy)(const struct tx_chain *, UInt8 *) = tx_one_copy<Padded, Checksum>;	// like fFrameOutput
+    UInt32 (*map)(const struct tx_chain *, UInt8 *) = tx_one_map<Padded, Checksum>;		// like fMapOutput
+    UInt32 x, i, j, k, off, n, size, total, sum = 0;
+    UInt64 copyCopied, copyTouched;
+    bool same = true;
+    char name[64];
+
+    for (x = 0; x < count; x++)
+        {
+        for (total = 0, i = 0; i < kTxPackets; i++)
+            {
+            struct tx_chain *c = &chains[i];
+            c->total = mixes[x].sizes[i % 8];
+            fill(payload[i], c->total, 300 + i);
+            c->n = (c->total > kTxHeader) ? mixes[x].segments : 1;
+            for (off = 0, j = 0; j < c->n; j++)
+                { // the header mbuf, then the payload in equal parts
+                c->seg[j] = payload[i] + off;
+                c->len[j] = (j == 0 && c->n > 1) ? kTxHeader : (c->total - kTxHeader) / (c->n - 1);
+                if (j == c->n - 1)
+                    c->len[j] = c->total - off;
+                off += c->len[j];
+                }
+            total += c->total;
+            }
+        for (i = 0; i < kTxPackets; i++)
+            {
+            size = tx_copy<Padded, Checksum>(&chains[i], copied);
+            n = tx_map<Padded, Checksum>(&chains[i], buf, ranges);
+            same = same && tx_wire(wire, buf, size, ranges, n) == size && memcmp(wire, copied, size) == 0;
+            }
+        txBytes = txCopied = txTouched = 0;
+        for (i = 0; i < kTxPackets; i++)
+            tx_copy<Padded, Checksum>(&chains[i], buf);
+        copyCopied = txCopied, copyTouched = txTouched;
+        txBytes = txCopied = txTouched = 0;
+        for (i = 0; i < kTxPackets; i++)
+            tx_map<Padded, Checksum>(&chains[i], buf, ranges);
+        printf("  %-4s %-17s bytes copied per byte %4.2f, zero-copy %4.2f; CPU memory traffic per byte %4.2f, zero-copy %4.2f\n",
+               mode, mixes[x].name, (double) copyCopied / txBytes, (double) txCopied / txBytes,
+               (double) copyTouched / txBytes, (double) txTouched / txBytes);
+        k = 0;	// every packet of the mix in turn
+        snprintf(name, sizeof(name), "%s, %s, copy", mode, mixes[x].name);
+        BENCH_FRAME(name, total / kTxPackets, sum += copy(&chains[k++ % kTxPackets], buf));
+        snprintf(name, sizeof(name), "%s, %s, zero-copy", mode, mixes[x].name);
+        BENCH_FRAME(name, total / kTxPackets, sum += map(&chains[k++ % kTxPackets], buf));
+        }
+    CHECK(same, "zero-copy transmit sends the copied frame", Padded * 2 + Checksum);
+    sink = sum;
+}
+
+static void test_tx_zero_copy(void)
+{
+    static const struct tx_mix mixes[] = {
+        { "bulk upload", { 1514, 1514, 1514, 1514, 1514, 1514, 1514, 1514 }, 2 },
+        { "upload with ACKs", { 1514, 1514, 66, 1514, 1514, 66, 1514, 66 }, 2 },
+        { "interactive", { 66, 130, 66, 300, 66, 66, 590, 66 }, 2 },
+        { "long chains", { 1514, 1514, 1514, 1514, 1514, 1514, 1514, 1514 }, kTxMaxSegments + 1 },
+    };
+
+    printf("zero-copy transmit (mock pipe, %d packets, ECM and CDC Subset, MDLM with %d byte packets)\n",
+           kTxPackets, kFramePacket);
+    tx_mode<false, false>("ECM", mixes, sizeof(mixes) / sizeof(mixes[0]));
+    tx_mode<true, true>("MDLM", mixes, sizeof(mixes) / sizeof(mixes[0]));
+}
+
+/*
+ * Batched output queue
+ * Bursts of packets from the stack go through a model of our output queue (enqueue and drain
+ * under one lock, up to batch packets per pass) into outputPackets and transmitPackets: the
+ * output buffers are reserved with one index_stack_pop (acquireOutputBuffers), each frame is
+ * copied into its buffer with the next one prefetched, and the mock pipe completes the write
+ * at once (index_list_push; the next reservation reclaims the list like reclaimOutputBuffers).
+ * With a batch of 1 every packet costs a pass, a lock round trip and a reservation, like the
+ * IOBasicOutputQueue and outputPacket did. The pipe checks that the packets arrive in order.
+ * Prints the packets per second (one CPU, the lock is never contended).
+ */
+
+#define kQueueBatchMax	16			// kTxBatchMax
+#define kQueueCapacity	64			// TRANSMIT_QUEUE_SIZE
+#define kQueueBuffers	64			// output buffers
+#define kQueueBurst		32			// packets the stack hands over at once
+
+struct q_pkt
+    {
+    struct q_pkt	*next;			// mbuf_nextpkt
+    UInt32			len;
+    UInt8			data[1514];
+    };
+
+struct q_state
+    {
+    pthread_mutex_t	lock;			// fLock
+    struct q_pkt	*head, *tail;
+    UInt32			size, batch;	// fSize, fBatch
+    volatile UInt32	freeHead;		// free output buffers
+    volatile UInt32	doneHead;		// completed writes
+    UInt16			link[kQueueBuffers];
+    UInt8			buf[kQueueBuffers][2048];
+    UInt32			seq, errors, dropped;
+    };
+
+static void q_reclaim(struct q_state *q)
+{
+    UInt32 first = index_list_take(&q->doneHead), last;
+
+    if (first == INDEX_STACK_NONE)
+        return;
+    for (last = first; q->link[last] != INDEX_STACK_NONE; last = q->link[last])
+        ;
+    index_stack_push(&q->freeHead, q->link, first, last);
+}
+
+static UInt32 q_transmit(struct q_state *q, struct q_pkt **pkts, UInt32 count)
+{
+    UInt32 indx[kQueueBatchMax], n, i;
+
+    q_reclaim(q);
+    n = index_stack_pop(&q->freeHead, q->link, indx, count);
+    for (i = 0; i < n; i++)
+        {
+        if (i + 1 < n)
+            __builtin_prefetch(pkts[i + 1]->data);
+        memcpy(q->buf[indx[i]], pkts[i]->data, pkts[i]->len);
+        if (OSReadLittleInt32(q->buf[indx[i]], 0) != q->seq++)
+            q->errors++;	// the pipe got it out of order
+        index_list_push(&q->doneHead, q->link, indx[i]);
+        }
+    return n;
+}
+
+static void q_drain(struct q_state *q)
+{
+    struct q_pkt *pkts[kQueueBatchMax];
+    UInt32 count;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->head)
+        {
+        for (count = 0; count < q->batch && q->head; count++)
+            pkts[count] = q->head, q->head = q->head->next;
+        if (!q->head)
+            q->tail = NULL;
+        q->size -= count;
+        pthread_mutex_unlock(&q->lock);
+        if (q_transmit(q, pkts, count) != count)
+            q->errors++;	// never out of buffers, the writes complete at once
+        pthread_mutex_lock(&q->lock);
+        }
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void q_enqueue(struct q_state *q, struct q_pkt *m)
+{
+    struct q_pkt *next;
+
+    pthread_mutex_lock(&q->lock);
+    for (; m; m = next)
+        {
+        next = m->next;
+        if (q->size >= kQueueCapacity)
+            {
+            q->dropped++;
+            continue;
+            }
+        m->next = NULL;
+        if (q->tail)
+            q->tail->next = m;
+        else
+            q->head = m;
+        q->tail = m;
+        q->size++;
+        }
+    pthread_mutex_unlock(&q->lock);
+    q_drain(q);
+}
+
+/* one burst from the stack; the sequence numbers go into the frames */
+
+static void q_burst(struct q_state *q, struct q_pkt *pkts, UInt32 len)
+{
+    UInt32 i;
+
+    for (i = 0; i < kQueueBurst; i++)
+        {
+        pkts[i].next = (i + 1 < kQueueBurst) ? &pkts[i + 1] : NULL;
+        pkts[i].len = len;
+        OSWriteLittleInt32(pkts[i].data, 0, q->seq + i);
+        }
+    q_enqueue(q, pkts);
+}
+
+static void test_output_queue(void)
+{
+    static struct q_state q;
+    static struct q_pkt pkts[kQueueBurst];
+    static const UInt32 batches[] = { 1, 4, kQueueBatchMax }, lengths[] = { 66, 1514 };
+    UInt32 indx[kQueueBuffers], b, l, i, r, rounds, n;
+    double ns, best;
+
+    printf("batched output queue (mock pipe, bursts of %d packets)\n", kQueueBurst);
+    pthread_mutex_init(&q.lock, NULL);
+    for (i = 0; i < kQueueBurst; i++)
+        fill(pkts[i].data, sizeof(pkts[i].data), 500 + i);
+    for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+        for (b = 0; b < sizeof(batches) / sizeof(batches[0]); b++)
+            {
+            for (i = 0; i < kQueueBuffers; i++)
+                q.link[i] = (i + 1 < kQueueBuffers) ? i + 1 : INDEX_STACK_NONE;
+            q.freeHead = 0, q.doneHead = INDEX_STACK_NONE;
+            q.batch = batches[b], q.seq = q.errors = q.dropped = 0;
+            rounds = kBenchBytes / (kQueueBurst * lengths[l]) + 1;
+            for (best = 0, r = 0; r < kBenchRuns; r++)
+                {
+                ns = now_ns();
+                for (i = 0; i < rounds; i++)
+                    q_burst(&q, pkts, lengths[l]);
+                ns = now_ns() - ns;
+                if (r == 0 || ns < best)
+                    best = ns;
+                }
+            q_reclaim(&q);
+            n = index_stack_pop(&q.freeHead, q.link, indx, kQueueBuffers);
+            printf("  %4lu byte packets, %2lu per pass: %6.2f Mpps, %6.1f ns per packet\n",
+                   (unsigned long) lengths[l], (unsigned long) batches[b],
+                   rounds * kQueueBurst / best * 1e3, best / (rounds * kQueueBurst));
+            CHECK(q.errors == 0 && q.dropped == 0 && q.seq == kBenchRuns * rounds * kQueueBurst,
+                  "output queue sends every packet in order", batches[b]);
+            CHECK(n == kQueueBuffers, "output queue gets every buffer back", n);
+            }
+    pthread_mutex_destroy(&q.lock);
+}
+
+/*
+ * NCM transfer blocks
+ * NTBs are filled like ncmTransmitPacket does (datagrams at ncm_align'ed offsets, as many as
+ * ncm_ntb_length lets fit), finished with ncm_finish and walked with ncm_walk_next like
+ * ncmFrameInput does, for NTB-16 and NTB-32 and several alignments. Every datagram must come
+ * back where it was put. Then damaged NTBs must be refused without reading past their end,
+ * and the walk is timed.
+ */
+
+#define kNtbMax		8192	// kNCMMaxNtbOutSize
+#define kNtbDgMax	32		// kNCMMaxDatagrams
+
+struct ntb
+    {
+    UInt32	index[kNtbDgMax];
+    UInt32	length[kNtbDgMax];
+    UInt32	count;
+    UInt32	total;
+    };
+
+static void ntb_build(unsigned char *buf, struct ntb *t, bool ncm32, UInt32 divisor, UInt32 remainder, UInt32 ndpAlign, UInt32 seed)
+{
+    UInt32 length = ncm32 ? kNTH32_Length : kNTH16_Length, off, len, rnd = seed;
+
+    for (t->count = 0; t->count < kNtbDgMax; t->count++)
+        {
+        len = 14 + (rnd = rnd * 1103515245 + 12345) % 1501;
+        off = ncm_align(length, divisor, remainder);
+        if (ncm_ntb_length(off + len, ncm32, ndpAlign, t->count + 1) + 1 > kNtbMax)
+            break;
+        memset(buf + length, 0xee, off - length);	// ncmTransmitPacket zeroes the gap, ncm_walk_next must not care
+        fill(buf + off, len, rnd);
+        t->index[t->count] = off;
+        t->length[t->count] = len;
+        length = off + len;
+        }
+    t->total = ncm_finish(buf, length, ncm32, ndpAlign, (UInt16) seed, t->index, t->length, t->count);
+    CHECK(t->total == ncm_ntb_length(length, ncm32, ndpAlign, t->count), "NTB length", t->count);
+}
+
+/* walk like ncmFrameInput; returns what ncm_walk_next returned last, -2 if the NTH is bad */
+
+static int ntb_walk(const unsigned char *buf, UInt32 size, UInt32 *off, UInt32 *len, UInt32 max, UInt32 *n)
+{
+    struct ncm_walk w;
+    int more;
+
+    *n = 0;
+    if (!ncm_walk_start(&w, buf, size))
+        return -2;
+    while ((more = ncm_walk_next(&w, &off[*n % max], &len[*n % max])) > 0)
+        {
+        CHECK(off[*n % max] + len[*n % max] <= size, "NTB datagram inside", *n);
+        (*n)++;
+        }
+    return more;
+}
+
+static void test_ncm(void)
+{
+    static unsigned char buf[kNtbMax + 16];
+    static const UInt32 params[][3] = { { 4, 0, 4 }, { 4, 2, 4 }, { 64, 14, 8 }, { 512, 0, 16 } };	// divisor, remainder, NDP alignment
+    struct ntb t;
+    UInt32 off[kNtbDgMax], len[kNtbDgMax], n, ncm32, p, seed, i, ndp, total;
+    int more;
+    bool same;
+    char name[64];
+
+    printf("NCM transfer blocks\n");
+    for (ncm32 = 0; ncm32 < 2; ncm32++)
+        for (p = 0; p < sizeof(params) / sizeof(params[0]); p++)
+            for (seed = 1; seed < 200; seed++)
+                {
+                ntb_build(buf, &t, ncm32, params[p][0], params[p][1], params[p][2], seed);
+                more = ntb_walk(buf, t.total, off, len, kNtbDgMax, &n);
+                CHECK(more == 0 && n == t.count, "NTB round trip", seed);
+                for (same = true, i = 0; i < n && i < t.count; i++)
+                    same = same && off[i] == t.index[i] && len[i] == t.length[i] &&
+                           off[i] % params[p][0] == params[p][1];
+                CHECK(same, "NTB datagrams", seed);
+                CHECK(OSReadLittleInt16(buf, 6) == (UInt16) seed, "NTB sequence", seed);
+                }
+
+    for (ncm32 = 0; ncm32 < 2; ncm32++)
+        {
+        ntb_build(buf, &t, ncm32, 4, 0, 4, 7);
+        total = t.total;
+        ndp = ncm32 ? OSReadLittleInt32(buf, 12) : OSReadLittleInt16(buf, 10);
+        more = ntb_walk(buf, total - 1, off, len, kNtbDgMax, &n);
+        CHECK(more < 0 && n == 0, "truncated NTB", ncm32);	// the NDP is at the end
+        buf[1] ^= 1;
+        CHECK(ntb_walk(buf, total, off, len, kNtbDgMax, &n) == -2, "NTH signature", ncm32);
+        buf[1] ^= 1;
+        buf[ndp] ^= 1;
+        CHECK(ntb_walk(buf, total, off, len, kNtbDgMax, &n) == -1 && n == 0, "NDP signature", ncm32);
+        buf[ndp] ^= 1;
+        if (ncm32)
+            OSWriteLittleInt32(buf, ndp + 8, ndp);	// NDP chained to itself
+        else
+            OSWriteLittleInt16(buf, ndp + 6, ndp);
+        CHECK(ntb_walk(buf, total, off, len, kNtbDgMax, &n) == -1 && n == kNCMMaxNdps * t.count, "NDP loop", ncm32);
+        if (ncm32)
+            OSWriteLittleInt32(buf, ndp + 8, 4);	// NDP inside the NTH
+        else
+            OSWriteLittleInt16(buf, ndp + 6, 4);
+        CHECK(ntb_walk(buf, total, off, len, kNtbDgMax, &n) == -1 && n == t.count, "NDP in the NTH", ncm32);
+        if (ncm32)
+            OSWriteLittleInt32(buf, ndp + 8, 0), OSWriteLittleInt32(buf, ndp + kNDP32_Length + 8 + 4, total);
+        else
+            OSWriteLittleInt16(buf, ndp + 6, 0), OSWriteLittleInt16(buf, ndp + kNDP16_Length + 4 + 2, total);
+        CHECK(ntb_walk(buf, total, off, len, kNtbDgMax, &n) == -1 && n == 1, "datagram past the end", ncm32);
+        if (ncm32)
+            OSWriteLittleInt32(buf, ndp + kNDP32_Length + 8 + 4, 0);	// a terminator ends the NDP early
+        else
+            OSWriteLittleInt16(buf, ndp + kNDP16_Length + 4 + 2, 0);
+        CHECK(ntb_walk(buf, total, off, len, kNtbDgMax, &n) == 0 && n == 1, "early terminator", ncm32);
+        }
+
+    for (ncm32 = 0; ncm32 < 2; ncm32++)
+        {
+        ntb_build(buf, &t, ncm32, 4, 0, 4, 11);
+        snprintf(name, sizeof(name), "NTB-%d walk, %lu datagrams", ncm32 ? 32 : 16, (unsigned long) t.count);
+        i = 0;
+        BENCH(name, t.total, ntb_walk(buf, t.total, off, len, kNtbDgMax, &n); i += n + len[0]);
+        sink = i;
+        }
+}
+
+/*
+ * RNDIS data messages
+ * A simulated device: frames are batched into transfers of REMOTE_NDIS_PACKET_MSGs like
+ * rndisTransmitPacket and rndisFlush do (rndis_packet_length, rndis_packet, tx_short_packet),
+ * the device hands the transfers back unchanged and they are split like rndisFrameInput does
+ * (rndis_next). Every frame must come back intact, and damaged messages must be refused.
+ * Then the CPU time to batch and split, and what a high speed pipe with a fixed cost per
+ * transfer (kXferUS) delivers with one message per transfer and with batches.
+ */
+
+#define kRndisMax		8192	// kRNDISMaxTransferOut
+#define kRndisFrames	256
+#define kXferUS			30.0	// per transfer: completion, callback, the next submit
+
+/* one transfer like rndisTransmitPacket and rndisFlush; returns how many frames went into it */
+
+static UInt32 rndis_transmit(unsigned char *buf, unsigned char **frames, const UInt32 *len, UInt32 n,
+                             UInt32 maxCount, UInt32 align, UInt32 packetSize, UInt32 *total)
+{
+    UInt32 length = 0, count, msgLen;
+
+    for (count = 0; count < n && count < maxCount; count++)
+        {
+        msgLen = rndis_packet_length(len[count], align);
+        if (length + msgLen + 1 > kRndisMax)
+            break;	// full (with a possible short packet byte)
+        rndis_packet(buf + length, len[count], msgLen);
+        memcpy(buf + length + kRNDIS_Packet_Length, frames[count], len[count]);
+        length += msgLen;
+        }
+    if (tx_short_packet(length, packetSize, kRndisMax, 1))
+        buf[length++] = 0;
+    *total = length;
+    return count;
+}
+
+/* split a transfer like rndisFrameInput; returns what rndis_next returned last */
+
+static int rndis_receive(const unsigned char *buf, UInt32 size, UInt32 *off, UInt32 *len, UInt32 max, UInt32 *n)
+{
+    UInt32 o = 0;
+    int more;
+
+    for (*n = 0; *n < max && (more = rndis_next(buf, size, &o, &off[*n], &len[*n])) > 0; (*n)++)
+        CHECK(off[*n] + len[*n] <= size, "RNDIS frame inside", *n);
+    return more;
+}
+
+/* batch frames of size bytes (0 = mixed) through the simulated device; returns the transfers */
+
+static UInt32 rndis_run(unsigned char *buf, unsigned char **frames, const UInt32 *len, UInt32 maxCount, UInt32 *sum)
+{
+    UInt32 off[kRndisFrames], got[kRndisFrames], i, m, n, total, xfers = 0;
+
+    for (i = 0; i < kRndisFrames; i += m, xfers++)
+        {
+        m = rndis_transmit(buf, frames + i, len + i, kRndisFrames - i, maxCount, 4, 512, &total);
+        rndis_receive(buf, total, off, got, kRndisFrames, &n);
+        *sum += n + buf[off[0]];
+        }
+    return xfers;
+}
+
+static void test_rndis(void)
+{
+    static unsigned char buf[kRndisMax + 16], src[kRndisFrames][1514];
+    static const UInt32 aligns[] = { 1, 4, 8 }, packets[] = { 64, 512 }, sizes[] = { 64, 590, 1514 };
+    unsigned char *frames[kRndisFrames];
+    UInt32 len[kRndisFrames], off[kRndisFrames], got[kRndisFrames];
+    UInt32 a, p, s, seed, i, j, m, n, total, xfers, sum = 0, bytes;
+    int more;
+    bool same;
+    double ns, us1, us;
+    char name[64];
+
+    printf("RNDIS data messages (simulated device)\n");
+    for (i = 0; i < kRndisFrames; i++)
+        frames[i] = src[i], fill(src[i], sizeof(src[i]), 300 + i);
+    for (a = 0; a < sizeof(aligns) / sizeof(aligns[0]); a++)
+        for (p = 0; p < sizeof(packets) / sizeof(packets[0]); p++)
+            for (seed = 1; seed < 50; seed++)
+                {
+                for (i = 0, j = seed; i < kRndisFrames; i++)
+                    len[i] = 14 + (j = j * 1103515245 + 12345) % 1501;
+                for (i = 0; i < kRndisFrames; i += m)
+                    {
+                    m = rndis_transmit(buf, frames + i, len + i, kRndisFrames - i, 32, aligns[a], packets[p], &total);
+                    CHECK(m > 0 && total <= kRndisMax, "RNDIS transfer", i);
+                    CHECK(total % packets[p] != 0 || total == kRndisMax, "RNDIS short packet", total);
+                    more = rndis_receive(buf, total, off, got, kRndisFrames, &n);
+                    CHECK(more == 0 && n == m, "RNDIS round trip", seed);
+                    for (same = true, j = 0; j < n && j < m; j++)
+                        same = same && got[j] == len[i + j] && memcmp(buf + off[j], frames[i + j], got[j]) == 0 &&
+                               off[j] % aligns[a] == kRNDIS_Packet_Length % aligns[a];
+                    CHECK(same, "RNDIS frames", seed);
+                    }
+                }
+
+    for (i = 0; i < 3; i++)
+        len[i] = 100;
+    rndis_transmit(buf, frames, len, 3, 32, 4, 512, &total);
+    m = rndis_packet_length(100, 4);	// the second message starts here
+    OSWriteLittleInt32(buf, m, 2);
+    CHECK(rndis_receive(buf, total, off, got, kRndisFrames, &n) == -1 && n == 1, "RNDIS message type", n);
+    OSWriteLittleInt32(buf, m, kRNDIS_Packet_Msg);
+    OSWriteLittleInt32(buf, m + 4, total - m + 1);
+    CHECK(rndis_receive(buf, total, off, got, kRndisFrames, &n) == -1 && n == 1, "RNDIS message length", n);
+    OSWriteLittleInt32(buf, m + 4, kRNDIS_Packet_Length - 4);
+    CHECK(rndis_receive(buf, total, off, got, kRndisFrames, &n) == -1 && n == 1, "RNDIS short message", n);
+    OSWriteLittleInt32(buf, m + 4, rndis_packet_length(100, 4));
+    OSWriteLittleInt32(buf, m + 8, 0xfffffffc);	// would wrap to 4 with the header added
+    CHECK(rndis_receive(buf, total, off, got, kRndisFrames, &n) == -1 && n == 1, "RNDIS data offset", n);
+    OSWriteLittleInt32(buf, m + 8, kRNDIS_Packet_Length - 8);
+    OSWriteLittleInt32(buf, m + 12, 101);
+    CHECK(rndis_receive(buf, total, off, got, kRndisFrames, &n) == -1 && n == 1, "RNDIS data length", n);
+    OSWriteLittleInt32(buf, m + 12, 100);
+    CHECK(rndis_receive(buf, total, off, got, kRndisFrames, &n) == 0 && n == 3, "RNDIS repaired", n);
+
+    printf("  %-20s %28s %28s\n", "", "one message per transfer", "batched");
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+        for (bytes = 0, i = 0; i < kRndisFrames; i++)
+            len[i] = sizes[s], bytes += sizes[s];
+        ns = now_ns();
+        xfers = rndis_run(buf, frames, len, 1, &sum);
+        ns = now_ns() - ns;
+        us1 = xfers * kXferUS + (bytes + xfers * kRNDIS_Packet_Length) / kPipeMBs + ns / 1000;
+        ns = now_ns();
+        xfers = rndis_run(buf, frames, len, 32, &sum);
+        ns = now_ns() - ns;
+        us = xfers * kXferUS + (bytes + kRndisFrames * kRNDIS_Packet_Length) / kPipeMBs + ns / 1000;
+        printf("  %5lu byte frames    %9.0f frames/s %5.1f MB/s %9.0f frames/s %5.1f MB/s (%.1f per transfer)\n",
+               (unsigned long) sizes[s], kRndisFrames / us1 * 1e6, bytes / us1, kRndisFrames / us * 1e6, bytes / us,
+               (double) kRndisFrames / xfers);
+        snprintf(name, sizeof(name), "batch and split, %lu byte frames", (unsigned long) sizes[s]);
+        BENCH(name, bytes, rndis_run(buf, frames, len, 32, &sum));
+        }
+    sink = sum;
+}
+
+/*
+ * EEM packets
+ * Transfers of random EEM packets (frames with sentinel or CRC, echo commands and responses,
+ * other commands, zero length packets, frames with a bad sentinel) are built, frames with
+ * eem_packet like eemTransmitPacket, ended like eemFlush does (tx_short_packet), and taken
+ * apart with eem_next like eemFrameInput does. Each packet must be found as what it is, with
+ * the right payload. Then truncated packets must be refused, and the split is timed.
+ */
+
+#define kEemMax		8192	// kEEMMaxTransferOut
+#define kEemPkts	64
+
+struct eem_pkt
+    {
+    int		kind;
+    UInt32	data;
+    UInt32	len;
+    };
+
+static UInt32 eem_build(unsigned char *buf, struct eem_pkt *pkt, UInt32 *count, UInt32 packetSize, UInt32 seed)
+{
+    UInt32 length = 0, len, n, r;
+    int kind;
+
+    for (n = 0; n < kEemPkts - 1; n++)
+        {
+        r = (seed = seed * 1103515245 + 12345) >> 8;
+        kind = kEEMFrame + r % 5;
+        len = (kind == kEEMFrame || kind == kEEMFrameCRC) ? 14 + (r >> 4) % 1501 : (r >> 4) % 100;
+        if (length + 2 + len + 4 + 2 > kEemMax)
+            break;
+        pkt[n].kind = kind, pkt[n].data = length + 2, pkt[n].len = len;
+        fill(buf + length + 2, len, r);
+        switch (kind)
+            {
+            case kEEMFrame:
+                length += eem_packet(buf + length, len);
+                if ((r & 0x300) == 0)
+                    buf[length - 1] ^= 1, pkt[n].kind = kEEMBadSentinel, pkt[n].len = len + 4;
+                break;
+            case kEEMFrameCRC:
+                OSWriteLittleInt32(buf, length + 2 + len, ~fcs_compute32(buf + length + 2, len, CRC32_INITFCS));
+                pkt[n].len = len += 4;
+                OSWriteLittleInt16(buf, length, kEEM_CRC | len);
+                length += 2 + len;
+                break;
+            case kEEMEcho:
+                OSWriteLittleInt16(buf, length, kEEM_Command | (kEEM_Echo << kEEM_Opcode_Shift) | len);
+                length += 2 + len;
+                break;
+            case kEEMBadSentinel:	// an echo response
+                pkt[n].kind = kEEMSkip;
+                OSWriteLittleInt16(buf, length, eem_echo_response(len));
+                length += 2 + len;
+                break;
+            default:	// a tickle or a zero length packet
+                OSWriteLittleInt16(buf, length, (r & 1) ? kEEM_Command | (3 << kEEM_Opcode_Shift) : 0);
+                pkt[n].len = 0;
+                length += 2;
+                break;
+            }
+        }
+    if (tx_short_packet(length, packetSize, kEemMax, 2))
+        {
+        OSWriteLittleInt16(buf, length, 0);
+        pkt[n].kind = kEEMSkip, pkt[n].data = length + 2, pkt[n++].len = 0;
+        length += 2;
+        }
+    *count = n;
+    return length;
+}
+
+static void test_eem(void)
+{
+    static unsigned char buf[kEemMax + 16];
+    struct eem_pkt pkt[kEemPkts];
+    UInt32 seed, n, i, size, off, data, len, p, sum = 0, packets[] = { 64, 512 };
+    int kind;
+    bool same;
+
+    printf("EEM packets\n");
+    for (p = 0; p < 2; p++)
+        for (seed = 1; seed < 500; seed++)
+            {
+            size = eem_build(buf, pkt, &n, packets[p], seed);
+            CHECK(size % packets[p] != 0 || size > kEemMax - 2, "EEM zero length packet", size);
+            for (same = true, off = 0, i = 0; (kind = eem_next(buf, size, &off, &data, &len)) > kEEMEnd; i++)
+                {
+                same = same && i < n && kind == pkt[i].kind && (kind == kEEMSkip || (data == pkt[i].data && len == pkt[i].len));
+                if (kind == kEEMFrameCRC)
+                    same = same && fcs_compute32(buf + data, len, CRC32_INITFCS) == CRC32_GOODFCS;
+                }
+            CHECK(kind == kEEMEnd && i == n && off == size, "EEM split", seed);
+            CHECK(same, "EEM packets", seed);
+            }
+
+    OSWriteLittleInt16(buf, 0, eem_echo_response(37));
+    off = 0;
+    CHECK(eem_next(buf, 39, &off, &data, &len) == kEEMSkip && len == 37 && off == 39, "EEM echo response", len);
+    off = 0;
+    CHECK(eem_next(buf, 38, &off, &data, &len) == kEEMBad && off == 0, "EEM truncated response", off);
+    OSWriteLittleInt16(buf, 0, kEEM_Command | (kEEM_Echo << kEEM_Opcode_Shift) | 37);
+    CHECK(eem_next(buf, 38, &off, &data, &len) == kEEMBad && off == 0, "EEM truncated echo", off);
+    eem_packet(buf, 100);
+    CHECK(eem_next(buf, 105, &off, &data, &len) == kEEMBad && off == 0, "EEM truncated frame", off);
+    CHECK(eem_next(buf, 106, &off, &data, &len) == kEEMFrame && len == 100 && off == 106, "EEM frame", len);
+    OSWriteLittleInt16(buf, 0, 3);
+    off = 0;
+    CHECK(eem_next(buf, 106, &off, &data, &len) == kEEMBad, "EEM runt", off);
+    off = 0;
+    CHECK(eem_next(buf, 1, &off, &data, &len) == kEEMEnd, "EEM odd byte", off);
+
+    for (size = 0, i = 0; i < 5; i++)
+        size += eem_packet(buf + size, 1514);
+    BENCH("EEM split, 5 x 1514 byte frames", size,
+          for (off = 0; eem_next(buf, size, &off, &data, &len) > kEEMEnd; ) sum += len);
+    sink = sum;
+}
+
+/*
+ * Adaptive transmit coalescing
+ * Small frames arrive at random gaps, at several rates, and go through the decisions of
+ * txCoalesce: tx_gap_update, tx_send_now and, for the first frame of a transfer, a timer of
+ * tx_hold_us. When a transfer can't be started because kCoalesceDepth writes are in flight
+ * the frames wait in the output queue until reclaimOutputBuffers restarts it (tx_restart),
+ * and then come in back to back. The mock pipe takes one transfer at a time, for
+ * kXferUS plus the bytes at kPipeMBs. Prints the frames per transfer like TxBatchHistogram
+ * (tx_batch_bucket) and how long the frames were held back for aggregation.
+ */
+
+#define kCoalesceFrames		200000
+#define kCoalesceBytes		66			// a TCP ACK
+#define kCoalesceMax		32			// kNCMMaxDatagrams
+#define kCoalesceTimeout	400			// kNCMTxTimeoutUS
+#define kCoalesceWrites		1024
+#define kCoalesceDepth		16			// fTxDepth
+
+struct coalesce_run
+    {
+    UInt32	hist[kTxBatchBuckets];
+    UInt32	transfers;
+    double	held, heldMax;			// us
+    double	backlog;				// us the pipe is still busy after the last frame
+    UInt32	queued;					// frames still in the output queue then
+    };
+
+struct coalesce_state
+    {
+    double	added[kCoalesceMax];	// when the frames of the transfer being filled were added
+    UInt32	count;
+    double	deadline;				// fNtbTimer
+    UInt32	gapAvg;					// fTxGapAvg
+    double	last;					// fTxLastArrival
+    UInt32	queued;					// frames in the output queue
+    bool	stalled;				// fOutputStalled
+    double	pipeFree;
+    double	done[kCoalesceWrites];	// completion of the writes, a ring
+    UInt32	submitted, completed;
+    };
+
+static void coalesce_flush(struct coalesce_state *s, struct coalesce_run *r, double at)
+{
+    UInt32 i;
+
+    for (i = 0; i < s->count; i++)
+        {
+        r->held += at - s->added[i];
+        r->heldMax = MAX(r->heldMax, at - s->added[i]);
+        }
+    r->hist[tx_batch_bucket(s->count)]++;
+    r->transfers++;
+    s->pipeFree = MAX(s->pipeFree, at) + kXferUS + s->count * kCoalesceBytes / kPipeMBs;
+    s->done[s->submitted++ % kCoalesceWrites] = s->pipeFree;
+    s->count = 0;
+}
+
+/* one frame through ncmTransmitPacket and txCoalesce; false if it has to stay in the queue */
+
+static bool coalesce_add(struct coalesce_state *s, struct coalesce_run *r, double at, bool idle)
+{
+    UInt32 inFlight = s->submitted - s->completed;
+
+    if (s->count == 0 && inFlight >= kCoalesceDepth)
+        return false;	// no buffer for a new transfer
+    s->gapAvg = tx_gap_update(s->gapAvg, (UInt64) (at - s->last));
+    s->last = at;
+    s->added[s->count++] = at;
+    if (tx_send_now(s->count >= kCoalesceMax, idle, inFlight + 1, s->gapAvg, kCoalesceTimeout))
+        coalesce_flush(s, r, at);
+    else if (s->count == 1)
+        s->deadline = at + tx_hold_us(s->gapAvg, kCoalesceTimeout);
+    return true;
+}
+
+/* completions and timeouts up to t */
+
+static void coalesce_advance(struct coalesce_state *s, struct coalesce_run *r, double t)
+{
+    double done;
+
+    for (;;)
+        {
+        done = (s->completed < s->submitted) ? s->done[s->completed % kCoalesceWrites] : t + 1;
+        if (s->count > 0 && s->deadline <= MIN(done, t))
+            {
+            coalesce_flush(s, r, s->deadline);
+            continue;
+            }
+        if (done > t)
+            break;
+        s->completed++;
+        if (s->stalled && tx_restart(s->submitted - s->completed, kCoalesceDepth))
+            { // dataWriteComplete restarts the queue
+            s->stalled = false;
+            while (s->queued > 0 && coalesce_add(s, r, done, s->queued == 1))
+                s->queued--;
+            s->stalled = (s->queued > 0);
+            }
+        }
+}
+
+static void coalesce_model(double fps, struct coalesce_run *r)
+{
+    struct coalesce_state s;
+    UInt32 i, seed = 1;
+    double t = 0;
+
+    memset(&s, 0, sizeof(s));
+    memset(r, 0, sizeof(*r));
+    s.gapAvg = kTxGapMaxUS;
+    for (i = 0; i < kCoalesceFrames; i++)
+        {
+        seed = seed * 1103515245 + 12345;
+        t += -log(((seed >> 8) + 1.0) / 16777217.0) * 1e6 / fps;
+        coalesce_advance(&s, r, t);
+        if (s.stalled || !coalesce_add(&s, r, t, true))
+            s.queued++, s.stalled = true;
+        }
+    r->backlog = s.pipeFree - t;
+    r->queued = s.queued;
+}
+
+static void test_coalesce(void)
+{
+    static const double rates[] = { 1000, 10000, 30000, 100000, 300000 };
+    struct coalesce_run r;
+    UInt32 x, b;
+
+    printf("adaptive transmit coalescing (model, %d byte frames, %.0f us + %.0f MB/s per transfer)\n",
+           kCoalesceBytes, kXferUS, kPipeMBs);
+    printf("  %-14s %7s %7s %7s %7s %7s %7s %10s %9s %9s\n", "", "1", "2", "3-4", "5-8", "9-16", "17+",
+           "xfer/frame", "held avg", "held max");
+    for (x = 0; x < sizeof(rates) / sizeof(rates[0]); x++)
+        {
+        coalesce_model(rates[x], &r);
+        printf("  %6.0f frames/s", rates[x]);
+        for (b = 0; b < kTxBatchBuckets; b++)
+            printf(" %6.1f%%", 100.0 * r.hist[b] / r.transfers);
+        printf(" %10.3f %6.1f us %6.1f us\n", (double) r.transfers / kCoalesceFrames,
+               r.held / kCoalesceFrames, r.heldMax);
+        CHECK(r.heldMax <= kCoalesceTimeout, "coalescing holds at most the timeout", rates[x]);
+        CHECK(r.queued < kCoalesceDepth * kCoalesceMax && r.backlog < kCoalesceDepth * (kXferUS + kCoalesceMax * kCoalesceBytes / kPipeMBs),
+              "coalescing keeps up with the frames", rates[x]);
+        if (rates[x] * (kXferUS + kCoalesceBytes / kPipeMBs) < 1e5)
+            CHECK(r.held / kCoalesceFrames < 1, "coalescing doesn't hold a light load", rates[x]);
+        }
+}
+
+/*
+ * Transmit flow control
+ * A host simulator of a bulk out pipe: writes of kDepthBytes go over the link one after the
+ * other at its rate and complete fixedUS (the host controller's schedule) after they are
+ * through. The transmit path stalls when limit writes are in flight, like acquireOutputBuffers,
+ * and reclaimOutputBuffers restarts it with tx_restart. Also run with the old watermark (a
+ * quarter of the limit) to show what restarting only when (almost) all writes are done costs.
+ * With limit 0 the depth controller sets the limit: completions feed tx_depth_update, a stall
+ * sets hit and tx_depth_tick runs once per simulated second.
+ */
+
+#define kDepthBytes		1514
+#define kDepthSeconds	40
+#define kDepthWrites	256			// ring of writes in flight, more than kOutBufHighWater
+
+struct depth_link
+    {
+    const char	*name;
+    double		mbs;			// bytes per us
+    double		fixedUS;		// completion latency on top of the transfer
+    };
+
+struct depth_run
+    {
+    double	latAvg, busy;		// in the second half
+    UInt32	restarts, writes;
+    UInt32	limitMin, limitMax;	// depth controller, in the second half
+    UInt32	limit1s;			// after one second
+    double	base;
+    };
+
+static void depth_model(const struct depth_link *link, double load, UInt32 limit, bool quarter, struct depth_run *r)
+{
+    struct tx_depth d;
+    double submit[kDepthWrites], done[kDepthWrites];
+    double t = 0, linkFree = 0, next = 0, tick = 1e6, half = kDepthSeconds * 1e6 / 2, end = 2 * half;
+    double xfer = kDepthBytes / link->mbs, gap = xfer / load, lat, samples = 0;
+    UInt32 head = 0, tail = 0, queued = 0, inFlight;
+    bool stalled = false, adapt = (limit == 0);
+
+    tx_depth_init(&d, kTxDelayTargetUS, kStackSlots);
+    memset(r, 0, sizeof(*r));
+    r->limitMin = 0xffffffff;
+    while (t < end)
+        {
+        // the next event: a completion, a frame from the sender or the watchdog
+        if (adapt)
+            limit = d.limit;
+        t = adapt ? MIN(tick, next) : next;
+        if (tail != head)
+            t = MIN(t, done[tail % kDepthWrites]);
+        if (tail != head && done[tail % kDepthWrites] <= t)
+            { // reclaimOutputBuffers
+            lat = t - submit[tail % kDepthWrites];
+            if (adapt && tx_depth_update(&d, (UInt32) lat))
+                limit = d.limit;
+            if (t >= half)
+                r->latAvg += lat, samples++;
+            tail++;
+            if (stalled && (quarter ? head - tail <= limit / 4 : tx_restart(head - tail, limit)))
+                stalled = false, r->restarts++;
+            }
+        else if (adapt && t == tick)
+            {
+            tx_depth_tick(&d);
+            if (t <= 1e6)
+                r->limit1s = d.limit;
+            tick += 1e6;
+            }
+        else
+            { // the sender: saturating (load 1) or one frame per gap
+            queued = (load >= 1) ? 1 : queued + 1;
+            next = (load >= 1) ? end : t + gap;
+            }
+        // the transmit path takes what it can while the queue isn't stalled
+        while (!stalled && queued > 0)
+            {
+            inFlight = head - tail;
+            if (inFlight >= limit)
+                {
+                d.hit = true;
+                stalled = true;
+                break;
+                }
+            submit[head % kDepthWrites] = t;
+            linkFree = MAX(linkFree, t) + xfer;
+            done[head % kDepthWrites] = linkFree + link->fixedUS;
+            if (linkFree > half)
+                r->busy += MAX(0, MIN(linkFree, end) - MAX(linkFree - xfer, half));
+            head++;
+            if (load < 1)
+                queued--;
+            }
+        if (t >= half)
+            {
+            r->limitMin = MIN(r->limitMin, limit);
+            r->limitMax = MAX(r->limitMax, limit);
+            }
+        }
+    r->writes = head;
+    r->base = tx_depth_base(&d);
+    r->busy /= half;
+    r->latAvg /= MAX(samples, 1);
+}
+
+static void test_flow_control(void)
+{
+    static const struct depth_link links[] = {
+        { "full speed", 1.1, 1000 },		// about 1 MB/s, 1 ms frames
+        { "high speed", 40.0, 125 },		// 125 us microframes
+    };
+    static const UInt32 limits[] = { kTxDepthMin, 3, 4, 5, 8, kTxDepthInit };
+    struct depth_run old, r;
+    double xfer;
+    UInt32 x, l, left;
+
+    printf("transmit flow control (simulated bulk out pipe, saturating sender, link busy and restarts per write)\n");
+    printf("  %-10s %5s %18s %18s\n", "", "depth", "quarter", "tx_restart");
+    for (x = 0; x < sizeof(links) / sizeof(links[0]); x++)
+        for (l = 0; l < sizeof(limits) / sizeof(limits[0]); l++)
+            {
+            depth_model(&links[x], 1, limits[l], true, &old);
+            depth_model(&links[x], 1, limits[l], false, &r);
+            printf("  %-10s %5lu %8.1f%% %7.3f  %8.1f%% %7.3f\n", links[x].name, (unsigned long) limits[l],
+                   100 * old.busy, (double) old.restarts / old.writes, 100 * r.busy, (double) r.restarts / r.writes);
+            // at depth 3 both restart with room for 2 or 3 writes, anywhere else tx_restart must do better
+            CHECK(r.busy >= old.busy - 0.02, "tx_restart keeps the link at least as busy", limits[l]);
+            // the writes still in flight at the restart cover the completion latency
+            for (left = limits[l]; !tx_restart(left, limits[l]); left--)
+                ;
+            xfer = kDepthBytes / links[x].mbs;
+            if (left * xfer >= links[x].fixedUS)
+                CHECK(r.busy > 0.99, "tx_restart keeps the link busy", limits[l]);
+            }
+}
+
+/*
+ * In-flight depth controller
+ * The pipe of the flow control test with the limit left to the controller. A saturating
+ * sender must get the link (almost) fully used without the writes queueing for much longer
+ * than TxDelayTargetUS; a sender at half the link rate must not grow the depth. The latency is
+ * held against the real one of an idle pipe, the transfer plus fixedUS: under a saturating
+ * sender the controller's own base (tx_depth_base) never sees an empty pipe and reads high.
+ */
+
+static void test_depth(void)
+{
+    static const struct depth_link links[] = {
+        { "full speed", 1.1, 1000 },
+        { "high speed", 40.0, 125 },
+    };
+    static const double loads[] = { 1, 0.5 };
+    struct depth_run r;
+    double idle;
+    UInt32 x, l;
+
+    printf("in-flight depth controller (simulated bulk out pipe, %d byte writes, %d us target)\n",
+           kDepthBytes, kTxDelayTargetUS);
+    for (x = 0; x < sizeof(links) / sizeof(links[0]); x++)
+        for (l = 0; l < sizeof(loads) / sizeof(loads[0]); l++)
+            {
+            depth_model(&links[x], loads[l], 0, false, &r);
+            idle = kDepthBytes / links[x].mbs + links[x].fixedUS;
+            printf("  %-10s %3.0f%% load: depth %3lu after 1 s, %3lu-%3lu later, latency %6.0f us (base %5.0f us), link %5.1f%% busy\n",
+                   links[x].name, 100 * loads[l], (unsigned long) r.limit1s, (unsigned long) r.limitMin,
+                   (unsigned long) r.limitMax, r.latAvg, r.base, 100 * r.busy);
+            CHECK(r.limitMin >= kTxDepthMin && r.limitMax <= kStackSlots, "depth in range", x);
+            if (loads[l] >= 1)
+                {
+                CHECK(r.busy > 0.9, "depth keeps the link busy", x);
+                CHECK(r.latAvg < idle + 1.5 * kTxDelayTargetUS, "depth doesn't queue", x);
+                }
+            else
+                CHECK(r.limitMax <= kTxDepthInit && r.latAvg < 2 * idle, "depth doesn't grow at half load", x);
+            }
+}
+
+int main(void)
+{
+    test_slice8();
+    test_clmul();
+    test_memcpy32();
+    test_combine();
+    test_multi();
+    test_index_stack();
+    test_done_list();
+    test_inet();
+    test_read_ring();
+    test_zero_copy();
+    test_verify_copy();
+    test_sampled();
+    test_rx_handler();
+    test_framing();
+    test_tx_zero_copy();
+    test_output_queue();
+    test_ncm();
+    test_rndis();
+    test_eem();
+    test_coalesce();
+    test_flow_control();
+    test_depth();
+    if (failures)
+        printf("%d checks FAILED\n", failures);
+    else
+        printf("all checks passed\n");
+    return failures;
+}
+
+/* EOF */
@@ -0,0 +1,134 @@
+/*
+ File:		HostTest.h
+
+ Description:	User space stand-ins for the few kernel definitions used by CRC.h, CRC.cpp, IndexStack.h, Framing.h and TxControl.h,
+ so that they can be compiled on a host (Mac OS X or Linux) by 'make hosttest'.
+ Only included if HOST_TEST is defined; the kext never sees this file.
+
+ Copyright:		Copyright 2004-2010 H. Nikolaus Schaller
+
+ Disclaimer:		This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2, or (at your option)
+ any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+ */
+
+#ifndef INCLUDE_HOSTTEST_H
+#define INCLUDE_HOSTTEST_H
+
+#include <limits.h>					/* UINT_MAX */
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>				/* bzero */
+
+typedef uint8_t		UInt8;
+typedef uint16_t	UInt16;
+typedef uint32_t	UInt32;
+typedef uint64_t	UInt64;
+typedef int32_t		SInt32;
+
+// sys/param.h
+
+#ifndef MIN
+#define	MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+#define	MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+// libkern/OSByteOrder.h - unaligned access is fine on the hosts we care about
+
+static inline UInt32 OSHostToLittle32(UInt32 v)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap32(v);
+#else
+    return v;
+#endif
+}
+
+static inline UInt32 OSHostToBig32(UInt32 v)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return v;
+#else
+    return __builtin_bswap32(v);
+#endif
+}
+
+static inline UInt32 OSReadLittleInt32(const void *base, uintptr_t offset)
+{
+    UInt32 v;
+    memcpy(&v, (const UInt8 *) base + offset, 4);
+    return OSHostToLittle32(v);
+}
+
+static inline void OSWriteLittleInt32(void *base, uintptr_t offset, UInt32 v)
+{
+    v = OSHostToLittle32(v);
+    memcpy((UInt8 *) base + offset, &v, 4);
+}
+
+static inline UInt16 OSReadLittleInt16(const void *base, uintptr_t offset)
+{
+    const UInt8 *p = (const UInt8 *) base + offset;
+    return (UInt16) (p[1] << 8 | p[0]);
+}
+
+static inline void OSWriteLittleInt16(void *base, uintptr_t offset, UInt16 v)
+{
+    UInt8 *p = (UInt8 *) base + offset;
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static inline UInt32 OSReadBigInt32(const void *base, uintptr_t offset)
+{
+    UInt32 v;
+    memcpy(&v, (const UInt8 *) base + offset, 4);
+    return OSHostToBig32(v);
+}
+
+static inline void OSWriteBigInt32(void *base, uintptr_t offset, UInt32 v)
+{
+    v = OSHostToBig32(v);
+    memcpy((UInt8 *) base + offset, &v, 4);
+}
+
+static inline UInt16 OSReadBigInt16(const void *base, uintptr_t offset)
+{
+    const UInt8 *p = (const UInt8 *) base + offset;
+    return (UInt16) (p[0] << 8 | p[1]);
+}
+
+static inline void OSWriteBigInt16(void *base, uintptr_t offset, UInt16 v)
+{
+    UInt8 *p = (UInt8 *) base + offset;
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+// libkern/OSAtomic.h - full barriers like the kernel versions
+
+static inline bool OSCompareAndSwap(UInt32 oldValue, UInt32 newValue, volatile UInt32 *address)
+{
+    return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+
+static inline void OSSynchronizeIO(void)
+{
+    __sync_synchronize();
+}
+
+#endif INCLUDE_HOSTTEST_H
+/* EOF */
@@ -0,0 +1,150 @@
+/*
+ File:		IndexStack.h
+
+ Description:	Lock free stack of small array indices, used for the free lists of the output
+ buffers (fPipeOutBuff[]), and the list of completed writes. Kept apart from Driver.h so that 'make hosttest' can
+ hammer it from several threads in user space.
+
+ Copyright:		Copyright 2004-2010 H. Nikolaus Schaller
+
+ Disclaimer:		This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2, or (at your option)
+ any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+ */
+
+#ifndef INCLUDE_INDEXSTACK_H
+#define INCLUDE_INDEXSTACK_H
+
+#ifdef HOST_TEST
+#include "HostTest.h"				/* make hosttest */
+#else
+#include <libkern/OSAtomic.h>
+#endif
+
+// The head is tag<<16 | top index, the entries are linked through an array of UInt16.
+// The tag is bumped on every update so that a pop can't be fooled by ABA.
+
+#define INDEX_STACK_NONE	0xffff	// empty / end of chain
+
+#ifndef INDEX_STACK_RACE
+#define INDEX_STACK_RACE()			// hosttest widens the window before the swap here
+#endif
+
+/* index_stack_push - push a chain of indices
+ * first..last must already be linked through link[]; link[last] is set here.
+ */
+static inline void index_stack_push(volatile UInt32 *head, UInt16 *link, UInt32 first, UInt32 last)
+{
+    UInt32 top, next;
+
+    do
+        {
+        top = *head;
+        link[last] = top & 0xffff;
+        next = ((top + 0x10000) & 0xffff0000) | first;
+        OSSynchronizeIO();	// make the link visible before the new head (eieio on PPC)
+        INDEX_STACK_RACE();
+        } while (!OSCompareAndSwap(top, next, head));
+}
+
+/* index_stack_pop - pop up to count indices with a single compare-and-swap
+ * Returns how many were stored in indx[] (0 = empty). The links are read before the
+ * swap, but if anybody changed the stack meanwhile the tag differs and we retry.
+ */
+static inline UInt32 index_stack_pop(volatile UInt32 *head, const UInt16 *link, UInt32 *indx, UInt32 count)
+{
+    UInt32 top, next, i, n;
+
+    do
+        {
+        top = *head;
+        for (n = 0, i = top & 0xffff; n < count && i != INDEX_STACK_NONE; i = link[i])
+            indx[n++] = i;
+        if (n == 0)
+            break;	// empty
+        next = ((top + 0x10000) & 0xffff0000) | i;
+        INDEX_STACK_RACE();
+        } while (!OSCompareAndSwap(top, next, head));
+    return n;
+}
+
+/* index_stack_remove_range - take the indices first..first+count-1 off the stack for good
+ * Takes the whole stack, and if all of them are on it (i.e. none is in use anywhere) unlinks
+ * them and pushes the rest back. Returns true if so; then nobody can get one of them any more.
+ * Otherwise everything is pushed back. Pushes and pops may race with this, other removers not.
+ */
+static inline bool index_stack_remove_range(volatile UInt32 *head, UInt16 *link, UInt32 first, UInt32 count)
+{
+    UInt32 top, i, n = 0, keep = INDEX_STACK_NONE, tail = INDEX_STACK_NONE, next;
+
+    do
+        {
+        top = *head;
+        } while (!OSCompareAndSwap(top, ((top + 0x10000) & 0xffff0000) | INDEX_STACK_NONE, head));
+    for (i = top & 0xffff; i != INDEX_STACK_NONE; i = link[i])
+        if (i - first < count)
+            n++;
+    for (i = top & 0xffff; i != INDEX_STACK_NONE; i = next)
+        {
+        next = link[i];
+        if (n == count && i - first < count)
+            continue;	// removed
+        if (tail == INDEX_STACK_NONE)
+            keep = i;
+        else
+            link[tail] = i;
+        tail = i;
+        }
+    if (keep != INDEX_STACK_NONE)
+        index_stack_push(head, link, keep, tail);
+    return (n == count);
+}
+
+/* index_list_push - push one index onto a list which is only ever taken as a whole
+ * Nobody pops single entries, so there is no ABA and the head needs no tag.
+ * Returns true if the list was empty, i.e. the taker may have to be told.
+ */
+static inline bool index_list_push(volatile UInt32 *head, UInt16 *link, UInt32 indx)
+{
+    UInt32 top;
+
+    do
+        {
+        top = *head;
+        link[indx] = top;
+        OSSynchronizeIO();	// make the link visible before the new head (eieio on PPC)
+        INDEX_STACK_RACE();
+        } while (!OSCompareAndSwap(top, indx, head));
+    return (top == INDEX_STACK_NONE);
+}
+
+/* index_list_take - take the whole list (most recently pushed first)
+ * Returns its first index, INDEX_STACK_NONE if it is empty. Several takers may race.
+ */
+static inline UInt32 index_list_take(volatile UInt32 *head)
+{
+    UInt32 top;
+
+    do
+        {
+        top = *head;
+        if (top == INDEX_STACK_NONE)
+            break;	// somebody else was faster
+        INDEX_STACK_RACE();
+        } while (!OSCompareAndSwap(top, INDEX_STACK_NONE, head));
+    return top;
+}
+
+#endif INCLUDE_INDEXSTACK_H
+/* EOF */
@@ -98,7 +98,7 @@ bool net_lucid_cake_driver_AJZaurusUSB::configureDevice(UInt8 numConfigs)
     UInt16					numends = 0;
     UInt16					alt;
 	const IOUSBConfigurationDescriptor	*cd = NULL;		// configuration descriptor
-	UInt8				cval;
+	UInt16				cval;					// up to 2 * 255
 	UInt8				config = 0;
 	UInt8				idx;
 	
@@ -117,17 +117,22 @@ bool net_lucid_cake_driver_AJZaurusUSB::configureDevice(UInt8 numConfigs)
 	 2			6				found - it is the Interrupt interface of Familiar (ECM)
 	 2			10				found - it is the Interrupt interface of Zaurus (MDLM)
 	 10			0				data interface of Familiar - but that might be found in the RNDIS configuration as well - skip
-	 2			2				Interrupt interface of RNDIS for Familiar - skip
+	 2			13				found - it is the Interrupt interface of a CDC NCM device
+	 2			12				found - EEM (protocol 7), has only Data pipes
+	 2			2				Interrupt interface of RNDIS for Familiar (protocol 255) - only if nothing else is found
+	 224		1				Interrupt interface of RNDIS (wireless controller class, protocol 3) - dto.
 	 255		0				found - has only Data pipe (CDC Ethernet Subclass)
+	 
+	 Therefore we make two passes: the second one (cval >= numConfigs) accepts RNDIS as well
 	 */
 	
-	for(cval=0; cval<numConfigs; cval++)
+	for(cval=0; cval<2*numConfigs; cval++)
 		{
 		IOUSBInterface	*interface;
 #if 1
-		IOLog("AJZaurusUSB::configureDevice - Checking Configuration %u\n", cval);
+		IOLog("AJZaurusUSB::configureDevice - Checking Configuration %u\n", cval % numConfigs);
 #endif
-		cd = fpDevice->GetFullConfigurationDescriptor(cval);
+		cd = fpDevice->GetFullConfigurationDescriptor(cval % numConfigs);
 		if(!cd)
 			{
 			IOLog("AJZaurusUSB::configureDevice -   Error getting the full configuration descriptor\n");
@@ -173,6 +178,22 @@ bool net_lucid_cake_driver_AJZaurusUSB::configureDevice(UInt8 numConfigs)
 #endif
 						fPadded = true;
 						fChecksum = true;
+						fNCM = false;
+						fRNDIS = false;
+						fEEM = false;
+						break;
+					}
+				if(interface->GetInterfaceClass() == 2 && interface->GetInterfaceSubClass() == kNCM)
+					{ // found a CDC NCM configuration (e.g. Linux g_ncm)
+#if 1
+						IOLog("AJZaurusUSB::configureDevice -   NCM interface found\n");
+						IOSleep(20);
+#endif
+						fPadded = false;
+						fChecksum = false;
+						fNCM = true;
+						fRNDIS = false;
+						fEEM = false;
 						break;
 					}
 				if(interface->GetInterfaceClass() == 2 && interface->GetInterfaceSubClass() == kEthernetControlModel)
@@ -183,6 +204,22 @@ bool net_lucid_cake_driver_AJZaurusUSB::configureDevice(UInt8 numConfigs)
 #endif
 						fPadded = false;
 						fChecksum = false;
+						fNCM = false;
+						fRNDIS = false;
+						fEEM = false;
+						break;
+					}
+				if(interface->GetInterfaceClass() == 2 && interface->GetInterfaceSubClass() == kEEM && interface->GetInterfaceProtocol() == kEEMProtocol)
+					{ // found a CDC EEM configuration (e.g. Linux g_ether use_eem=1)
+#if 1
+						IOLog("AJZaurusUSB::configureDevice -   EEM interface found\n");
+						IOSleep(20);
+#endif
+						fPadded = false;
+						fChecksum = false;
+						fNCM = false;
+						fRNDIS = false;
+						fEEM = true;
 						break;
 					}
 				if(interface->GetInterfaceClass() == 255 && interface->GetInterfaceSubClass() == 0)
@@ -193,12 +230,30 @@ bool net_lucid_cake_driver_AJZaurusUSB::configureDevice(UInt8 numConfigs)
 #endif
 						fPadded = false;
 						fChecksum = false;
+						fNCM = false;
+						fRNDIS = false;
+						fEEM = false;
+						break;
+					}
+				if(cval >= numConfigs &&
+				   ((interface->GetInterfaceClass() == 2 && interface->GetInterfaceSubClass() == kRNDIS && interface->GetInterfaceProtocol() == kRNDISProtocol) ||
+					(interface->GetInterfaceClass() == kWirelessController && interface->GetInterfaceSubClass() == 1 && interface->GetInterfaceProtocol() == 3)))
+					{ // found an RNDIS configuration and there is nothing better
+#if 1
+						IOLog("AJZaurusUSB::configureDevice -   RNDIS interface found\n");
+						IOSleep(20);
+#endif
+						fPadded = false;
+						fChecksum = false;
+						fNCM = false;
+						fRNDIS = true;
+						fEEM = false;
 						break;
 					}
 			}
 		if(!interface)
 			{ // we have checked all interfaces - try next configuration
-				IOLog("AJZaurusUSB::configureDevice -   no matching interface for configuration %d\n", cval);
+				IOLog("AJZaurusUSB::configureDevice -   no matching interface for configuration %d\n", cval % numConfigs);
 				IOSleep(20);
 				continue;
 			}
@@ -209,12 +264,14 @@ bool net_lucid_cake_driver_AJZaurusUSB::configureDevice(UInt8 numConfigs)
 		break;
 		}
 	
-	if(cval == numConfigs)
+	if(cval == 2*numConfigs)
 		{
 		IOLog("AJZaurusUSB::configureDevice -  no matching Interface descriptor found\n");
 		return false;
 		}
 	
+	selectFraming();	// fPadded and fChecksum are fixed from now on
+	
 	// Save the ID's
 	
 	fVendorID = fpDevice->GetVendorID();
@@ -251,12 +308,34 @@ bool net_lucid_cake_driver_AJZaurusUSB::configureDevice(UInt8 numConfigs)
         return false;
         }
     
-    if(fInterfaceSubClass != kEthernetControlModel)
-        { // Zaurus (MDLM) uses a single interface for comm&data but separates endpoints
+    if(fNCM && !ncmConfigure())	// must be done while the data interface is still in alternate setting 0
+        {
+        IOLog("AJZaurusUSB::configureDevice - ncmConfigure failed\n");
+        return false;
+        }
+    
+    if(fRNDIS && !rndisConfigure())
+        {
+        IOLog("AJZaurusUSB::configureDevice - rndisConfigure failed\n");
+        return false;
+        }
+    
+    if(fEEM)
+        { // nothing to negotiate - EEM has neither descriptors nor requests
+        fNtbInMaxSize = kEEMMaxTransferIn;
+        fNtbOutMaxSize = kEEMMaxTransferOut;
+        fNtbOutMaxDatagrams = kNCMMaxDatagrams;
+        if (fNtbTxMaxSize == 0 || fNtbTxMaxSize > fNtbOutMaxSize)
+            fNtbTxMaxSize = fNtbOutMaxSize;
+        fMax_Block_Size = kEEMMaxFrameSize;
+        }
+    
+    if(fInterfaceSubClass != kEthernetControlModel && !fNCM && !fRNDIS)
+        { // Zaurus (MDLM) and EEM use a single interface for comm&data but separate endpoints
 			fDataInterface = fCommInterface;	// use the same
 		}
     else
-        { // open the separate comm interface here if we have a ECM device
+        { // open the separate comm interface here if we have a ECM (or NCM, RNDIS) device
 #if 1
 			IOLog("AJZaurusUSB::configureDevice - comm interface %p\n", fCommInterface);
 			IOLog("AJZaurusUSB::configureDevice -   ConfigValue %d\n", fCommInterface->GetConfigValue());
@@ -538,6 +617,9 @@ bool net_lucid_cake_driver_AJZaurusUSB::getFunctionalDescriptors()
                 break;
 				case Union_FunctionalDescriptor:
                 IOLog("AJZaurusUSB::getFunctionalDescriptors - Union Functional Descriptor - type=%d subtype=%d\n", funcDesc->bDescriptorType, funcDesc->bDescriptorSubtype);
+                break;
+				case NCM_Functional_Descriptor:
+                IOLog("AJZaurusUSB::getFunctionalDescriptors - NCM Functional Descriptor - type=%d subtype=%d\n", funcDesc->bDescriptorType, funcDesc->bDescriptorSubtype);
                 break;
 				default:
                 IOLog("AJZaurusUSB::getFunctionalDescriptors - unknown Functional Descriptor - type=%d subtype=%d\n", funcDesc->bDescriptorType, funcDesc->bDescriptorSubtype);
@@ -646,6 +728,329 @@ bool net_lucid_cake_driver_AJZaurusUSB::getFunctionalDescriptors()
     
 }/* end getFunctionalDescriptors */
 
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::ncmConfigure
+//
+//		Inputs:		
+//
+//		Outputs:	return Code - true (parameters set), false (device doesn't talk NCM)
+//
+//		Desc:		Read the NTB parameters of a CDC NCM device, select the NTB format and
+//					announce our receive buffer size.
+//
+/****************************************************************************************************/
+
+bool net_lucid_cake_driver_AJZaurusUSB::ncmConfigure(void)
+{
+    IOUSBDevRequest	devreq;
+    NTBParameters	param;
+    UInt8			inSize[4];
+    IOReturn		ior;
+    
+    bzero(&param, sizeof(param));
+    devreq.bmRequestType = USBmakebmRequestType(kUSBIn, kUSBClass, kUSBInterface);
+    devreq.bRequest = kGet_NTB_Parameters;
+    devreq.wValue = 0;
+    devreq.wIndex = fCommInterfaceNumber;
+    devreq.wLength = sizeof(param);
+    devreq.pData = &param;
+    ior = fpDevice->DeviceRequest(&devreq);
+    if (ior != kIOReturnSuccess)
+        {
+        IOLog("AJZaurusUSB::ncmConfigure - GET_NTB_PARAMETERS failed: %d %s\n", ior, this->stringFromReturn(ior));
+        return false;
+        }
+    
+    fNtbInMaxSize = MIN(OSReadLittleInt32(param.dwNtbInMaxSize, 0), kNCMMaxNtbInSize);
+    fNtbOutMaxSize = MIN(OSReadLittleInt32(param.dwNtbOutMaxSize, 0), kNCMMaxNtbOutSize);
+    fNdpOutDivisor = OSReadLittleInt16(param.wNdpOutDivisor, 0);
+    if (fNdpOutDivisor == 0)
+        fNdpOutDivisor = 4;
+    fNdpOutRemainder = OSReadLittleInt16(param.wNdpOutPayloadRemainder, 0) % fNdpOutDivisor;
+    fNdpOutAlignment = MAX(OSReadLittleInt16(param.wNdpOutAlignment, 0), 4);
+    fNtbOutMaxDatagrams = OSReadLittleInt16(param.wNtbOutMaxDatagrams, 0);
+    if (fNtbOutMaxDatagrams == 0)
+        fNtbOutMaxDatagrams = kNCMMaxDatagrams;	// 0 means no limit
+    if (fNtbInMaxSize < 2048 || fNtbOutMaxSize < 2048)
+        {
+        IOLog("AJZaurusUSB::ncmConfigure - NTB sizes too small: in=%lu out=%lu\n", fNtbInMaxSize, fNtbOutMaxSize);
+        return false;
+        }
+    
+    if (!(OSReadLittleInt16(param.bmNtbFormatsSupported, 0) & 2))
+        fNCM32 = false;	// NTB-16 is mandatory, NTB-32 optional
+    else
+        {
+        devreq.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBClass, kUSBInterface);
+        devreq.bRequest = kSet_NTB_Format;
+        devreq.wValue = fNCM32 ? 1 : 0;
+        devreq.wIndex = fCommInterfaceNumber;
+        devreq.wLength = 0;
+        devreq.pData = 0;
+        ior = fpDevice->DeviceRequest(&devreq);
+        if (ior != kIOReturnSuccess)
+            {
+            IOLog("AJZaurusUSB::ncmConfigure - SET_NTB_FORMAT failed: %d %s\n", ior, this->stringFromReturn(ior));
+            fNCM32 = false;	// device stays at the default (NTB-16)
+            }
+        }
+    
+    OSWriteLittleInt32(inSize, 0, fNtbInMaxSize);
+    devreq.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBClass, kUSBInterface);
+    devreq.bRequest = kSet_NTB_Input_Size;
+    devreq.wValue = 0;
+    devreq.wIndex = fCommInterfaceNumber;
+    devreq.wLength = sizeof(inSize);
+    devreq.pData = inSize;
+    ior = fpDevice->DeviceRequest(&devreq);
+    if (ior != kIOReturnSuccess && fNtbInMaxSize < OSReadLittleInt32(param.dwNtbInMaxSize, 0))
+        {
+        IOLog("AJZaurusUSB::ncmConfigure - SET_NTB_INPUT_SIZE failed: %d %s\n", ior, this->stringFromReturn(ior));
+        return false;	// device may send NTBs larger than our buffer
+        }
+    
+    if (fNtbTxMaxSize == 0 || fNtbTxMaxSize > fNtbOutMaxSize)
+        fNtbTxMaxSize = fNtbOutMaxSize;
+    
+    IOLog("AJZaurusUSB::ncmConfigure - NTB-%d in=%lu out=%lu (aggregate %lu bytes, %u datagrams, %lu us) divisor=%u remainder=%u alignment=%u\n",
+          fNCM32 ? 32 : 16, fNtbInMaxSize, fNtbOutMaxSize, fNtbTxMaxSize, fNtbOutMaxDatagrams, fNtbTxTimeout,
+          fNdpOutDivisor, fNdpOutRemainder, fNdpOutAlignment);
+    return true;
+    
+}/* end ncmConfigure */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::rndisCommand
+//
+//		Inputs:		buf - control message (kRNDISControlSize bytes), replaced by the reply
+//					len - length of the message, replaced by the length of the reply
+//
+//		Outputs:	Return code - kIOReturnSuccess (completed with RNDIS_STATUS_SUCCESS), or error
+//
+//		Desc:		Send an RNDIS control message (SEND_ENCAPSULATED_COMMAND) and poll for its
+//					completion (GET_ENCAPSULATED_RESPONSE). Must not be called from a completion.
+//
+/****************************************************************************************************/
+
+IOReturn net_lucid_cake_driver_AJZaurusUSB::rndisCommand(UInt8 *buf, UInt32 *len)
+{
+    IOUSBDevRequest	devreq;
+    UInt32			type = OSReadLittleInt32(buf, 0);
+    UInt32			requestId = OSReadLittleInt32(buf, 8);
+    IOReturn		ior;
+    int				i;
+    
+    devreq.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBClass, kUSBInterface);
+    devreq.bRequest = kSend_Encapsulated_Command;
+    devreq.wValue = 0;
+    devreq.wIndex = fCommInterfaceNumber;
+    devreq.wLength = *len;
+    devreq.pData = buf;
+    ior = fpDevice->DeviceRequest(&devreq);
+    if (ior != kIOReturnSuccess)
+        {
+        IOLog("AJZaurusUSB::rndisCommand - SEND_ENCAPSULATED_COMMAND %08lx failed: %d %s\n", type, ior, this->stringFromReturn(ior));
+        return ior;
+        }
+    
+    for (i = 0; i < 50; i++)
+        { // the device also signals RESPONSE_AVAILABLE on the interrupt pipe but we simply poll
+        devreq.bmRequestType = USBmakebmRequestType(kUSBIn, kUSBClass, kUSBInterface);
+        devreq.bRequest = kGet_Encapsulated_Response;
+        devreq.wValue = 0;
+        devreq.wIndex = fCommInterfaceNumber;
+        devreq.wLength = kRNDISControlSize;
+        devreq.pData = buf;
+        devreq.wLenDone = 0;
+        ior = fpDevice->DeviceRequest(&devreq);
+        if (ior != kIOReturnSuccess)
+            {
+            IOLog("AJZaurusUSB::rndisCommand - GET_ENCAPSULATED_RESPONSE failed: %d %s\n", ior, this->stringFromReturn(ior));
+            return ior;
+            }
+        if (devreq.wLenDone < 16)
+            { // nothing there yet
+            IOSleep(10);
+            continue;
+            }
+        if (OSReadLittleInt32(buf, 0) != (type | kRNDIS_Completion) || OSReadLittleInt32(buf, 8) != requestId)
+            continue;	// status indication or a stale reply
+        *len = MIN(devreq.wLenDone, OSReadLittleInt32(buf, 4));
+        if (OSReadLittleInt32(buf, 12) != kRNDIS_Status_Success)
+            return kIOReturnError;
+        return kIOReturnSuccess;
+        }
+    IOLog("AJZaurusUSB::rndisCommand - no reply for %08lx\n", type);
+    return kIOReturnTimeout;
+    
+}/* end rndisCommand */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::rndisQuery
+//
+//		Inputs:		oid - what to query
+//					data - where to store the value
+//					len - size of data, replaced by the length of the value
+//
+//		Outputs:	Return code - kIOReturnSuccess, or error
+//
+//		Desc:		Send REMOTE_NDIS_QUERY_MSG.
+//
+/****************************************************************************************************/
+
+IOReturn net_lucid_cake_driver_AJZaurusUSB::rndisQuery(UInt32 oid, void *data, UInt32 *len)
+{
+    UInt8		*buf;
+    UInt32		msgLen, infoLen, infoOff;
+    IOReturn	ior;
+    
+    if (*len > kRNDISControlSize - kRNDIS_Request_Length)
+        return kIOReturnBadArgument;
+    buf = (UInt8 *)IOMalloc(kRNDISControlSize);
+    if (!buf)
+        return kIOReturnNoMemory;
+    msgLen = kRNDIS_Request_Length + *len;	// some devices want an information buffer of the expected size
+    bzero(buf, msgLen);
+    OSWriteLittleInt32(buf, 0, kRNDIS_Query_Msg);
+    OSWriteLittleInt32(buf, 4, msgLen);
+    OSWriteLittleInt32(buf, 8, ++fRndisRequestId);
+    OSWriteLittleInt32(buf, 12, oid);
+    OSWriteLittleInt32(buf, 16, *len);
+    OSWriteLittleInt32(buf, 20, kRNDIS_Request_Length - 8);	// offsets count from the request id
+    ior = rndisCommand(buf, &msgLen);
+    if (ior == kIOReturnSuccess)
+        {
+        infoLen = OSReadLittleInt32(buf, 16);
+        infoOff = OSReadLittleInt32(buf, 20) + 8;
+        if (msgLen < 24 || infoOff > msgLen || infoLen > msgLen - infoOff)
+            ior = kIOReturnUnderrun;
+        else
+            {
+            bcopy(buf + infoOff, data, MIN(infoLen, *len));
+            *len = infoLen;
+            }
+        }
+    IOFree(buf, kRNDISControlSize);
+    return ior;
+    
+}/* end rndisQuery */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::rndisSet
+//
+//		Inputs:		oid - what to set
+//					data, len - the value
+//
+//		Outputs:	Return code - kIOReturnSuccess, or error
+//
+//		Desc:		Send REMOTE_NDIS_SET_MSG.
+//
+/****************************************************************************************************/
+
+IOReturn net_lucid_cake_driver_AJZaurusUSB::rndisSet(UInt32 oid, const void *data, UInt32 len)
+{
+    UInt8		*buf;
+    UInt32		msgLen = kRNDIS_Request_Length + len;
+    IOReturn	ior;
+    
+    if (len > kRNDISControlSize - kRNDIS_Request_Length)
+        return kIOReturnBadArgument;
+    buf = (UInt8 *)IOMalloc(kRNDISControlSize);
+    if (!buf)
+        return kIOReturnNoMemory;
+    bzero(buf, kRNDIS_Request_Length);
+    OSWriteLittleInt32(buf, 0, kRNDIS_Set_Msg);
+    OSWriteLittleInt32(buf, 4, msgLen);
+    OSWriteLittleInt32(buf, 8, ++fRndisRequestId);
+    OSWriteLittleInt32(buf, 12, oid);
+    OSWriteLittleInt32(buf, 16, len);
+    OSWriteLittleInt32(buf, 20, kRNDIS_Request_Length - 8);
+    bcopy(data, buf + kRNDIS_Request_Length, len);
+    ior = rndisCommand(buf, &msgLen);
+    IOFree(buf, kRNDISControlSize);
+    return ior;
+    
+}/* end rndisSet */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::rndisConfigure
+//
+//		Inputs:		
+//
+//		Outputs:	return Code - true (device initialized), false (device doesn't talk RNDIS)
+//
+//		Desc:		Initialize an RNDIS device and query what we need to know: transfer limits,
+//					Ethernet address, frame size and multicast list size. The packet filter
+//					is set by enable (USBSetPacketFilter).
+//
+/****************************************************************************************************/
+
+bool net_lucid_cake_driver_AJZaurusUSB::rndisConfigure(void)
+{
+    UInt8		*buf;
+    UInt32		len;
+    UInt32		value;
+    UInt8		addr[kIOEthernetAddressSize];
+    IOReturn	ior;
+    
+    buf = (UInt8 *)IOMalloc(kRNDISControlSize);
+    if (!buf)
+        return false;
+    len = kRNDIS_Initialize_Length;
+    bzero(buf, len);
+    OSWriteLittleInt32(buf, 0, kRNDIS_Initialize_Msg);
+    OSWriteLittleInt32(buf, 4, len);
+    OSWriteLittleInt32(buf, 8, ++fRndisRequestId);
+    OSWriteLittleInt32(buf, 12, 1);						// major version
+    OSWriteLittleInt32(buf, 16, 0);						// minor version
+    OSWriteLittleInt32(buf, 20, kRNDISMaxTransferIn);	// we can receive that much per transfer
+    ior = rndisCommand(buf, &len);
+    if (ior != kIOReturnSuccess || len < 44)
+        {
+        IOLog("AJZaurusUSB::rndisConfigure - REMOTE_NDIS_INITIALIZE_MSG failed: %d %s\n", ior, this->stringFromReturn(ior));
+        IOFree(buf, kRNDISControlSize);
+        return false;
+        }
+    
+    fNtbInMaxSize = kRNDISMaxTransferIn;
+    fNtbOutMaxSize = MIN(OSReadLittleInt32(buf, 36), kRNDISMaxTransferOut);
+    value = OSReadLittleInt32(buf, 32);
+    fNtbOutMaxDatagrams = MIN(MAX(value, 1), kNCMMaxDatagrams);
+    value = OSReadLittleInt32(buf, 40);
+    fRndisAlignment = 1 << MIN(value, 6);
+    IOFree(buf, kRNDISControlSize);
+    if (fNtbOutMaxSize < kRNDIS_Packet_Length + 1514)
+        {
+        IOLog("AJZaurusUSB::rndisConfigure - transfer size too small: %lu\n", fNtbOutMaxSize);
+        return false;
+        }
+    if (fNtbTxMaxSize == 0 || fNtbTxMaxSize > fNtbOutMaxSize)
+        fNtbTxMaxSize = fNtbOutMaxSize;
+    
+    len = sizeof(addr);
+    if (rndisQuery(kOID_802_3_Permanent_Address, addr, &len) == kIOReturnSuccess && len == sizeof(addr))
+        bcopy(addr, fEaddr, sizeof(addr));
+    len = sizeof(value);
+    if (rndisQuery(kOID_Gen_Maximum_Frame_Size, &value, &len) == kIOReturnSuccess && len == sizeof(value))
+        fMax_Block_Size = OSSwapLittleToHostInt32(value) + 14;	// without the Ethernet header
+    len = sizeof(value);
+    if (rndisQuery(kOID_802_3_Maximum_List_Size, &value, &len) == kIOReturnSuccess && len == sizeof(value))
+        fMcFilters = MIN(OSSwapLittleToHostInt32(value), kFiltersSupportedMask);
+    
+    IOLog("AJZaurusUSB::rndisConfigure - out=%lu (aggregate %lu bytes, %u packets, %lu us) alignment=%lu frame=%lu filters=%d\n",
+          fNtbOutMaxSize, fNtbTxMaxSize, fNtbOutMaxDatagrams, fNtbTxTimeout, fRndisAlignment, fMax_Block_Size, fMcFilters);
+    IOLog("AJZaurusUSB::rndisConfigure - Ethernet address: %02x.%02x.%02x.%02x.%02x.%02x\n",
+          (unsigned) fEaddr[0], (unsigned) fEaddr[1], (unsigned) fEaddr[2],
+          (unsigned) fEaddr[3], (unsigned) fEaddr[4], (unsigned) fEaddr[5]);
+    return true;
+    
+}/* end rndisConfigure */
+
 /****************************************************************************************************/
 //
 //		Method:		net_lucid_cake_driver_AJZaurusUSB::setWakeOnMagicPacket
@@ -907,195 +1312,971 @@ IOReturn net_lucid_cake_driver_AJZaurusUSB::setPromiscuousMode(bool active)
 
 /****************************************************************************************************/
 //
-//		Method:		net_lucid_cake_driver_AJZaurusUSB::USBTransmitPacket
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::frameOutput
 //
-//		Inputs:		packet - the packet
+//		Inputs:		buf - output buffer: a slab slot of fOutSlotSize bytes, or of fOutBufSize
+//					(fMax_Block_Size) if transmitPackets found that the frame needs a large one
+//					packet - the packet
 //
-//		Outputs:	Return code - true (transmit started), false (it didn't)
+//		Outputs:	Return code - number of bytes to transmit, 0 if the packet doesn't fit
 //
-//		Desc:		Set up and then transmit the packet
+//		Desc:		Copy the mbuf chain into the output buffer and add padding and CRC.
+//					Instantiated for every <Padded, Checksum> combination so that the per packet
+//					code has no mode tests; selectFraming() picks the right one.
 //
 /****************************************************************************************************/
 
-bool net_lucid_cake_driver_AJZaurusUSB::USBTransmitPacket(mbuf_t packet)
+template <bool Padded, bool Checksum>
+UInt32 net_lucid_cake_driver_AJZaurusUSB::frameOutput(UInt8 *buf, mbuf_t packet)
 {
-    UInt32		numbufs = 0;		// number of mbufs for this packet
     mbuf_t		m;				// current mbuf
-    UInt32		total_pkt_length = 0;
-    UInt32		new_pkt_length;
-    UInt32		checksum_length;
-    UInt32		fcs;
-    UInt32		pad;
-    UInt32		rTotal = 0;
-    IOReturn	ior = kIOReturnSuccess;
-    UInt32		poolIndx;
-    UInt16		tryCount = 0;
-    // Count the number of mbufs in this packet
+    UInt32		total_pkt_length = mbuf_pkthdr_len(packet);
+    UInt32		len;
+    UInt32		fcs = CRC32_INITFCS;
+    UInt32		rTotal = 0;		// running total
     
-    m = packet;
-    while (m)
-        {
-        total_pkt_length += mbuf_len(m);
-        numbufs++;
-        m = mbuf_next(m);
-        }
+    if (frame_length<Padded, Checksum>(total_pkt_length, fOutPacketSize)+1 > fMax_Block_Size)
+        return 0;
     
-    checksum_length = fChecksum?4:0;	// Calculate size including CRC and padding
-    if (fPadded)
-        { // we need to pad so that after appending the CRC we have a multiple of packetsize less one
-			new_pkt_length = fOutPacketSize * ( ((total_pkt_length + checksum_length) / fOutPacketSize) + 1) - 1;
-        }
-    else
+    // single pass over the mbuf chain - the length comes from the packet header
+    
+    for (m = packet; m; m = mbuf_next(m))
         {
-        if (fChecksum)  // require a minimum of one full packet
-            new_pkt_length = MAX(fOutPacketSize, total_pkt_length + checksum_length);
+        if ((len = mbuf_len(m)) == 0)		// Ignore zero length mbufs
+            continue;
+        if (rTotal + len > total_pkt_length)
+            return 0;						// chain is longer than the packet header says
+        if (Checksum)
+            fcs = fcs_memcpy32(&buf[rTotal], (unsigned char*) mbuf_data(m), len, fcs);
         else
-            new_pkt_length = total_pkt_length;
+            bcopy(mbuf_data(m), &buf[rTotal], len);
+        rTotal += len;
         }
-	
-#if 0
-    IOLog("AJZaurusUSB::USBTransmitPacket %p padded:%d checksum:%d length:%lu mbufs:%lu\n", packet, fPadded, fChecksum, new_pkt_length, numbufs);
-#endif
-    if (new_pkt_length+1 > fMax_Block_Size)
+    if (rTotal != total_pkt_length)
+        return 0;
+    if (Padded || Checksum)
+        rTotal += frame_trailer<Padded, Checksum>(&buf[rTotal], rTotal, fcs, fOutPacketSize);
+    return rTotal;
+    
+}/* end frameOutput */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::mapOutput
+//
+//		Inputs:		packet - the packet
+//					poolIndx - pool entry (its buffer takes the trailer)
+//
+//		Outputs:	Return code - memory descriptor covering the frame, NULL if it should be copied
+//
+//		Desc:		Scatter-gather transmit: wrap the mbuf chain of a packet in a memory descriptor.
+//					If the mode needs padding or a CRC, the CRC is computed in place and padding,
+//					CRC and extra byte are built in the pool buffer and appended as the last range.
+//					Short packets and chains with more than kTxMaxSegments mbufs take the copy path.
+//
+/****************************************************************************************************/
+
+template <bool Padded, bool Checksum>
+IOMemoryDescriptor *net_lucid_cake_driver_AJZaurusUSB::mapOutput(mbuf_t packet, UInt32 poolIndx)
+{
+    IOVirtualRange	ranges[kTxMaxSegments+1];
+    UInt32			total_pkt_length = mbuf_pkthdr_len(packet);
+    UInt32			n = 0;
+    UInt32			len;
+    UInt32			rTotal = 0;
+    UInt32			fcs = CRC32_INITFCS;
+    mbuf_t			m;
+    
+    if (!tx_zero_copy(total_pkt_length, 1) || frame_length<Padded, Checksum>(total_pkt_length, fOutPacketSize)+1 > fMax_Block_Size)
+        return NULL;	// copying is cheaper or frameOutput will drop it
+    for (m = packet; m && n <= kTxMaxSegments; m = mbuf_next(m))
         {
-        IOLog("AJZaurusUSB::USBTransmitPacket - Bad packet size\n");	// Note for now and revisit later
-        if (fOutputErrsOK)
-            fpNetStats->outputErrors++;
-        return false;
-        }
-	
-    // Find a free ouput buffer in the pool
-	
-    IOSimpleLockLock(fLock);
-    while(TRUE)
-        { // try to get a buffer
-			for(poolIndx=0; poolIndx<kOutBufPool; poolIndx++)
-				{
-				if(!fPipeOutBuff[poolIndx].inuse)
-					break;  // got one
-				}
-			if(poolIndx<kOutBufPool)
-				break;  // break while loop
-			tryCount++;
-			if(tryCount > kOutBuffThreshold)
-				{ // waited too long
-					IOLog("AJZaurusUSB::USBTransmitPacket - Exceeded output buffer wait threshold - output stalled\n");
-					if(fOutputErrsOK)
-						fpNetStats->outputErrors++;
-					IOSimpleLockUnlock(fLock);
-					fOutputStalled = true;
-					return false;
-				}
-			IOLog("AJZaurusUSB::USBTransmitPacket - Waiting %d-th time for output buffer\n", tryCount);
-			IOSleep(1);	// sleep 1 second
-        }
-    fPipeOutBuff[poolIndx].inuse = true;	// now in use
-    ++fDataCount;
-    if(fDataCount > kOutBufPool-10)
-        IOLog("AJZaurusUSB::USBTransmitPacket - Warning %ld of %d output buffers in use!\n", fDataCount, kOutBufPool);
-    if(fOutputStalled)
-        IOLog("AJZaurusUSB::USBTransmitPacket - Output no longer stalled\n");
-    fOutputStalled = false;
-    IOSimpleLockUnlock(fLock);
-    
-    fcs = CRC32_INITFCS;
-    m = packet;							// start with the first mbuf of the packet
-    rTotal = 0;							// running total				
-    while(m)
-        {  
-            if (mbuf_len(m) > 0)					// Ignore zero length mbufs
-				{
-				fcs = fcs_memcpy32(&(fPipeOutBuff[poolIndx].pipeOutBuffer[rTotal]), (unsigned char*) mbuf_data(m), mbuf_len(m), fcs);
-				rTotal += mbuf_len(m);
-				}
-            m = mbuf_next(m);
-        }
-    if ((pad = new_pkt_length - rTotal - checksum_length) > 0)
-        { // pad to required length less four (CRC), copy fcs and append pad byte if required
-			fcs = fcs_pad32(&(fPipeOutBuff[poolIndx].pipeOutBuffer[rTotal]), pad, fcs);
-			rTotal += pad;
+        if ((len = mbuf_len(m)) == 0)			// Ignore zero length mbufs
+            continue;
+        if (rTotal + len > total_pkt_length)
+            return NULL;
+        if (n < kTxMaxSegments)
+            {
+            ranges[n].address = (IOVirtualAddress) mbuf_data(m);
+            ranges[n].length = len;
+            }
+        rTotal += len;
+        n++;
         }
-    fcs = ~fcs;
-    if (fChecksum)
-        {
-        fPipeOutBuff[poolIndx].pipeOutBuffer[rTotal++] = fcs&0xff;
-        fPipeOutBuff[poolIndx].pipeOutBuffer[rTotal++] = (fcs>>8)&0xff;
-        fPipeOutBuff[poolIndx].pipeOutBuffer[rTotal++] = (fcs>>16)&0xff;
-        fPipeOutBuff[poolIndx].pipeOutBuffer[rTotal++] = (fcs>>24)&0xff;
+    if (!tx_zero_copy(total_pkt_length, n) || rTotal != total_pkt_length)
+        return NULL;	// too many mbufs or the chain is shorter than the packet header says
+    if (Padded || Checksum)
+        { // only now the CRC pass - the chain will be transmitted from where it is
+        if (Checksum)
+            for (len = 0; len < n; len++)
+                fcs = fcs_compute32((unsigned char*) ranges[len].address, ranges[len].length, fcs);
+        ranges[n].address = (IOVirtualAddress) fPipeOutBuff[poolIndx].pipeOutBuffer;
+        ranges[n].length = frame_trailer<Padded, Checksum>(fPipeOutBuff[poolIndx].pipeOutBuffer, rTotal, fcs, fOutPacketSize);
+        if (ranges[n].length > 0)
+            n++;
         }
+    return IOMemoryDescriptor::withRanges(ranges, n, kIODirectionOut, kernel_task);
     
-    // append a byte if required, we over-allocated by one to allow for this
-    if (fPadded)
+}/* end mapOutput */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::acquireOutputBuffers
+//
+//		Inputs:		poolIndx - where to store the indices of the buffers
+//					count - how many are wanted
+//					large - the frames don't fit into a regular buffer
+//
+//		Outputs:	Return code - number of buffers (0 = output must stall)
+//
+//		Desc:		Get free output buffers unless fTxDepth.limit writes are in flight. When we get
+//					less than count, fOutputStalled is set and dataWriteComplete restarts the queue.
+//					Another slab chunk is added before the regular buffers run out.
+//
+/****************************************************************************************************/
+
+UInt32 net_lucid_cake_driver_AJZaurusUSB::acquireOutputBuffers(UInt32 *poolIndx, UInt32 count, bool large)
+{
+    UInt32	n;
+    SInt32	depth;
+    
+    if (fOutDoneHead != kOutBufNone)
+        reclaimOutputBuffers();		// completed writes which the workloop hasn't reclaimed yet
+    if (fDataCount > fOutSlabPeak)
+        fOutSlabPeak = fDataCount;	// for shrinkOutputBuffers
+    if (large)
         {
-        if (!(rTotal % fOutPacketSize))
+        fOutSlabLargeUsed = true;
+        if (!fOutSlab[kOutSlabLarge])
+            growOutputBuffers(true);
+        }
+    else if (fOutSlabCount < kOutSlabChunks && fDataCount + count + kOutSlabSlots/4 >= fOutSlabCount * kOutSlabSlots)
+        growOutputBuffers(false);
+    depth = fTxDepth.limit;
+    if (fDataCount + count > depth)
+        fTxDepth.hit = true;	// could use more depth
+    n = (fDataCount < depth) ? getOutputBuffers(poolIndx, MIN(count, depth - fDataCount), large) : 0;
+    if (n == 0)
+        { // too many writes in flight - stall the queue, dataWriteComplete restarts it
+        fOutputStalled = true;
+        OSSynchronizeIO();
+        // check again: all completions may have come in before the flag was visible
+        n = (fDataCount < depth) ? getOutputBuffers(poolIndx, MIN(count, depth - fDataCount), large) : 0;
+        if (n == 0)
             {
-            fPipeOutBuff[poolIndx].pipeOutBuffer[rTotal++] = 0;
+#if 0
+            IOLog("AJZaurusUSB::acquireOutputBuffers - %ld writes in flight - output stalled\n", fDataCount);
+#endif
+            return 0;
             }
+        fOutputStalled = false;
         }
+    if (n < count)
+        fOutputStalled = true;	// the rest waits - our own writes will restart the queue
+    return n;
+    
+}/* end acquireOutputBuffers */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::txDepthUpdate
+//
+//		Inputs:		latency - submit to completion time of a write (us)
+//
+//		Outputs:	
+//
+//		Desc:		Adjust fTxDepth.limit (AIMD, see tx_depth_update). The base latency is the minimum
+//					seen in the last kTxLatencyWindow seconds, i.e. a write which didn't wait behind
+//					others. Once per round the depth is cut by a quarter if the average latency
+//					exceeds the base by more than TxDelayTargetUS, since more writes in flight would
+//					only queue on the host. Otherwise it grows by one if the transmit path ran into
+//					it. So a full-speed device settles at a few writes, a high-speed one higher.
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::txDepthUpdate(UInt32 latency)
+{
+    if (!tx_depth_update(&fTxDepth, latency))
+        return;	// the round isn't over
 #if 0
-    IOLog("AJZaurusUSB::USBTransmitPacket - length=%lu checksum=%08lx\n", rTotal, fcs);
+    IOLog("AJZaurusUSB::txDepthUpdate - depth=%lu latency=%lu base=%lu\n", fTxDepth.limit, fTxDepth.latAvg, tx_depth_base(&fTxDepth));
 #endif
-	
+    
+}/* end txDepthUpdate */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::acquireOutputBuffer
+//
+//		Inputs:		poolIndx - where to store the index of the buffer
+//					large - the frame doesn't fit into a regular buffer
+//
+//		Outputs:	Return code - true (got a buffer), false (output must stall)
+//
+//		Desc:		Same as acquireOutputBuffers for a single buffer
+//
+/****************************************************************************************************/
+
+bool net_lucid_cake_driver_AJZaurusUSB::acquireOutputBuffer(UInt32 *poolIndx, bool large)
+{
+    return (acquireOutputBuffers(poolIndx, 1, large) == 1);
+    
+}/* end acquireOutputBuffer */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::writeOutputBuffer
+//
+//		Inputs:		poolIndx - the output buffer (completion)
+//					md - what to write
+//					length - number of bytes
+//
+//		Outputs:	Return code - true (write started), false (buffer released, count as error)
+//
+//		Desc:		Start the bulk out transfer, retrying once after clearing a pipe stall.
+//
+/****************************************************************************************************/
+
+bool net_lucid_cake_driver_AJZaurusUSB::writeOutputBuffer(UInt32 poolIndx, IOMemoryDescriptor *md, UInt32 length)
+{
+    IOReturn	ior;
+    
     fPipeOutBuff[poolIndx].writeCompletionInfo.parameter = (void *)poolIndx;
-    fPipeOutBuff[poolIndx].pipeOutMDP->setLength(rTotal);
-    ior = fOutPipe->Write(fPipeOutBuff[poolIndx].pipeOutMDP, 
+    clock_get_uptime(&fPipeOutBuff[poolIndx].submitTime);
+    ior = fOutPipe->Write(md, 
 						  5000,
 						  5000,
-						  fPipeOutBuff[poolIndx].pipeOutMDP->getLength(),
+						  length,
 						  &(fPipeOutBuff[poolIndx].writeCompletionInfo));
     if (ior != kIOReturnSuccess)
         {
-        IOLog("AJZaurusUSB::USBTransmitPacket - Write failed: ior=%d %s\n", ior, this->stringFromReturn(ior));
+        IOLog("AJZaurusUSB::writeOutputBuffer - Write failed: ior=%d %s\n", ior, this->stringFromReturn(ior));
         if (ior == kIOUSBPipeStalled)
             {
-            IOLog("AJZaurusUSB::USBTransmitPacket - Pipe stalled\n");
+            IOLog("AJZaurusUSB::writeOutputBuffer - Pipe stalled\n");
 			
             fOutPipe->ClearPipeStall(true);  // reset and try again
-            ior = fOutPipe->Write(fPipeOutBuff[poolIndx].pipeOutMDP, 
+            ior = fOutPipe->Write(md, 
 								  5000,
 								  5000,
-								  fPipeOutBuff[poolIndx].pipeOutMDP->getLength(),
+								  length,
 								  &(fPipeOutBuff[poolIndx].writeCompletionInfo));
             if (ior != kIOReturnSuccess)
-                {
-				
-                IOLog("AJZaurusUSB::USBTransmitPacket - Write really failed: %d %s\n", ior, this->stringFromReturn(ior));
-                if(fOutputErrsOK)
-                    fpNetStats->outputErrors++;
-                IOSimpleLockLock(fLock);
-                --fDataCount;
-                fPipeOutBuff[poolIndx].inuse = false;
-                IOSimpleLockUnlock(fLock);
-                return false;
-                }
+                IOLog("AJZaurusUSB::writeOutputBuffer - Write really failed: %d %s\n", ior, this->stringFromReturn(ior));
             }
-        else
-            { // other error - drop transmit packet
-				IOSimpleLockLock(fLock);
-				--fDataCount;
-				fPipeOutBuff[poolIndx].inuse = false;
-				IOSimpleLockUnlock(fLock);
-				return false;
+        if (ior != kIOReturnSuccess)
+            { // drop transmit packet
+            if(fOutputErrsOK)
+                fpNetStats->outputErrors++;
+            releaseOutputBuffer(poolIndx);
+            return false;
+            }
+        }
+    return true;
+    
+}/* end writeOutputBuffer */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::USBTransmitPacket
+//
+//		Inputs:		packet - the packet
+//					poolIndx - output buffer reserved for it by outputPackets
+//
+//		Outputs:	Return code - kIOReturnOutputSuccess (transmit started) or kIOReturnOutputDropped
+//
+//		Desc:		Set up and then transmit the packet (MDLM, ECM, CDC Subset). The packet and the
+//					buffer are consumed: the packet is freed right after copying, on errors, or by
+//					dataWriteComplete (zero-copy).
+//
+/****************************************************************************************************/
+
+UInt32 net_lucid_cake_driver_AJZaurusUSB::USBTransmitPacket(mbuf_t packet, UInt32 poolIndx)
+{
+    UInt32		rTotal;
+    IOMemoryDescriptor	*md = NULL;
+	
+    if (fMapOutput && (md = (this->*fMapOutput)(packet, poolIndx)))
+        { // the pool entry only carries the completion; releaseOutputBuffer frees packet and descriptor
+        fPipeOutBuff[poolIndx].chainMDP = md;
+        fPipeOutBuff[poolIndx].packet = packet;
+        rTotal = md->getLength();
+        }
+    else
+        { // copy path
+        rTotal = (this->*fFrameOutput)(fPipeOutBuff[poolIndx].pipeOutBuffer, packet);
+        freePacket(packet);
+        if (rTotal == 0)
+            {
+            IOLog("AJZaurusUSB::USBTransmitPacket - Bad packet size\n");	// Note for now and revisit later
+            if (fOutputErrsOK)
+                fpNetStats->outputErrors++;
+            releaseOutputBuffer(poolIndx);
+            return kIOReturnOutputDropped;
             }
+        md = fPipeOutBuff[poolIndx].pipeOutMDP;
         }
+	
+    if (!writeOutputBuffer(poolIndx, md, rTotal))
+        return kIOReturnOutputDropped;
     
     if (fOutputPktsOK)
         fpNetStats->outputPackets++;
     
-    return true;
+    return kIOReturnOutputSuccess;
     
 }/* end USBTransmitPacket */
 
 /****************************************************************************************************/
 //
-//		Method:		net_lucid_cake_driver_AJZaurusUSB::USBSetMulticastFilter
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::getFeatures
 //
-//		Inputs:		addrs - the list of addresses
-//				count - How many
+//		Inputs:		
 //
-//		Outputs:	
+//		Outputs:	Return code - the features
 //
-//		Desc:		Set up and send SetMulticastFilter Management Element Request(MER).
+//		Desc:		We do TCP segmentation (in software, see tsoSegment) if the SDK knows about it
+//
+/****************************************************************************************************/
+
+UInt32 net_lucid_cake_driver_AJZaurusUSB::getFeatures() const
+{
+#ifdef TSO_SUPPORTED
+    return super::getFeatures() | kIONetworkFeatureTSOIPv4 | kIONetworkFeatureTSOIPv6;
+#else
+    return super::getFeatures();
+#endif
+    
+}/* end getFeatures */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::tsoSegment
+//
+//		Inputs:		packet - a TCP segment of up to 64 KB (not freed)
+//					v6 - IPv6 (else IPv4)
+//					mss - max. payload per frame
+//
+//		Outputs:	Return code - the frames (linked by nextpkt), NULL on errors
+//
+//		Desc:		Cut a TSO segment into frames. Each frame gets a copy of the headers with the
+//					IP length (and ID and header checksum), TCP sequence number and flags
+//					adjusted. The TCP checksum is accumulated while the payload is copied, so
+//					the payload is read only once. VLAN tags and the IPv6 extension headers the
+//					stack puts in front of TCP (hop-by-hop, destination options, routing) are
+//					passed through; only malformed headers or more than kTsoMaxHeader bytes of
+//					them make us drop the segment.
+//
+/****************************************************************************************************/
+
+mbuf_t net_lucid_cake_driver_AJZaurusUSB::tsoSegment(mbuf_t packet, bool v6, UInt32 mss)
+{
+    UInt8		hdr[kTsoMaxHeader];
+    UInt32		total = mbuf_pkthdr_len(packet);
+    UInt32		hmax = MIN(total, kTsoMaxHeader);
+    UInt32		ipOff = ETHER_HDR_LEN;
+    UInt32		tcpOff, hlen, extLen, payload, off, seg, seq, pos, chunk, skip;
+    UInt16		etherType;
+    UInt16		ipId = 0;
+    UInt16		part;
+    UInt8		flags, next;
+    UInt64		pseudo, sum;
+    mbuf_t		head = NULL, tail = NULL;
+    mbuf_t		m, src;
+    UInt8		*dp, *dst;
+    
+    if (hmax < ETHER_HDR_LEN)
+        goto bad;
+    mbuf_copydata(packet, 0, hmax, hdr);
+    for (etherType = OSReadBigInt16(hdr, 12); etherType == kEtherTypeVLAN || etherType == kEtherTypeQinQ; ipOff += 4)
+        { // skip VLAN tags
+        if (ipOff + 4 > hmax)
+            goto bad;
+        etherType = OSReadBigInt16(hdr, ipOff + 2);
+        }
+    if (v6)
+        {
+        if (etherType != kEtherTypeIPv6 || ipOff + 40 > hmax)
+            goto bad;
+        dst = hdr + ipOff + 24;
+        for (next = hdr[ipOff + 6], tcpOff = ipOff + 40; next != kIPProtocolTCP; tcpOff += extLen)
+            { // extension headers
+            if ((next != kIPv6HopByHop && next != kIPv6Routing && next != kIPv6DestOptions) || tcpOff + 8 > hmax)
+                goto bad;
+            extLen = (hdr[tcpOff + 1] + 1) * 8;
+            if (tcpOff + extLen > hmax)
+                goto bad;
+            if (next == kIPv6Routing && hdr[tcpOff + 3] != 0)
+                { // segments left: the pseudo header has the final destination (last address of type 0 and 2)
+                if ((hdr[tcpOff + 2] != 0 && hdr[tcpOff + 2] != 2) || extLen < 24)
+                    goto bad;
+                dst = hdr + tcpOff + extLen - 16;
+                }
+            next = hdr[tcpOff];
+            }
+        pseudo = inet_sum(hdr + ipOff + 8, 16, inet_sum(dst, 16, kIPProtocolTCP));		// addresses and next header
+        }
+    else
+        {
+        if (etherType != kEtherTypeIPv4 || ipOff + 20 > hmax || (hdr[ipOff] >> 4) != 4 || hdr[ipOff + 9] != kIPProtocolTCP)
+            goto bad;
+        tcpOff = ipOff + (hdr[ipOff] & 0x0f) * 4;
+        ipId = OSReadBigInt16(hdr, ipOff + 4);
+        pseudo = inet_sum(hdr + ipOff + 12, 8, kIPProtocolTCP);		// addresses and protocol
+        }
+    if (tcpOff + 20 > hmax)
+        goto bad;
+    hlen = tcpOff + (hdr[tcpOff + 12] >> 4) * 4;
+    if (hlen < tcpOff + 20 || hlen > hmax)
+        goto bad;
+    payload = total - hlen;
+    seq = OSReadBigInt32(hdr, tcpOff + 4);
+    flags = hdr[tcpOff + 13];
+    
+    for (src = packet, skip = hlen; src && skip >= mbuf_len(src); src = mbuf_next(src))
+        skip -= mbuf_len(src);	// find the start of the payload
+    
+    off = 0;
+    do
+        {
+        seg = MIN(mss, payload - off);
+        m = allocatePacket(hlen + seg);
+        if (!m)
+            goto bad;
+        if (tail)
+            mbuf_setnextpkt(tail, m);
+        else
+            head = m;
+        tail = m;
+        if (mbuf_len(m) < hlen + seg)
+            goto bad;	// we need it in one piece
+        dp = (UInt8 *) mbuf_data(m);
+        bcopy(hdr, dp, hlen);
+        
+        // copy the payload and sum it up
+        
+        for (sum = 0, pos = 0; pos < seg; pos += chunk, skip += chunk)
+            {
+            for (; src && skip >= mbuf_len(src); src = mbuf_next(src))
+                skip = 0;
+            if (!src)
+                goto bad;	// shorter than the packet header says
+            chunk = MIN(seg - pos, mbuf_len(src) - skip);
+            if (pos & 1)
+                { // starts on an odd byte
+                part = inet_fold(inet_memcpy_sum(dp + hlen + pos, (UInt8 *) mbuf_data(src) + skip, chunk, 0));
+                sum += (UInt16) ((part << 8) | (part >> 8));
+                }
+            else
+                sum = inet_memcpy_sum(dp + hlen + pos, (UInt8 *) mbuf_data(src) + skip, chunk, sum);
+            }
+        
+        // IP header
+        
+        if (v6)
+            OSWriteBigInt16(dp, ipOff + 4, hlen - ipOff - 40 + seg);	// payload length (with the extension headers)
+        else
+            {
+            OSWriteBigInt16(dp, ipOff + 2, hlen - ipOff + seg);		// total length
+            OSWriteBigInt16(dp, ipOff + 4, ipId++);
+            OSWriteBigInt16(dp, ipOff + 10, 0);
+            OSWriteBigInt16(dp, ipOff + 10, ~inet_fold(inet_sum(dp + ipOff, tcpOff - ipOff, 0)));
+            }
+        
+        // TCP header: FIN and PSH only on the last frame, CWR only on the first
+        
+        OSWriteBigInt32(dp, tcpOff + 4, seq + off);
+        dp[tcpOff + 13] = flags & ~((off + seg < payload) ? (kTCPFlagFIN | kTCPFlagPSH) : 0) & ~((off > 0) ? kTCPFlagCWR : 0);
+        OSWriteBigInt16(dp, tcpOff + 16, 0);
+        sum = inet_sum(dp + tcpOff, hlen - tcpOff, sum + pseudo + (hlen - tcpOff + seg));
+        OSWriteBigInt16(dp, tcpOff + 16, ~inet_fold(sum));
+        off += seg;
+        } while (off < payload);
+    return head;
+    
+bad:
+    IOLog("AJZaurusUSB::tsoSegment - can't segment (len=%u mss=%u), dropped\n", total, mss);
+    if (fOutputErrsOK)
+        fpNetStats->outputErrors++;
+    while (head)
+        {
+        m = head;
+        head = mbuf_nextpkt(m);
+        mbuf_setnextpkt(m, NULL);
+        freePacket(m);
+        }
+    return NULL;
+    
+}/* end tsoSegment */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::tsoFlush
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Drop the frames of a TSO segment which haven't been sent yet
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::tsoFlush(void)
+{
+    mbuf_t	m;
+    
+    while (fTsoBacklog)
+        {
+        m = fTsoBacklog;
+        fTsoBacklog = mbuf_nextpkt(m);
+        mbuf_setnextpkt(m, NULL);
+        freePacket(m);
+        if (fOutputErrsOK)
+            fpNetStats->outputErrors++;
+        }
+    
+}/* end tsoFlush */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::txCoalesce
+//
+//		Inputs:		full - the transfer being filled can't take another frame
+//
+//		Outputs:	
+//
+//		Desc:		NCM, RNDIS, EEM: decide whether to send the transfer now or to wait for more
+//					frames, after a frame has been added. Called with fNtbLock held.
+//					We send at once when it is full, and when the output queue is empty and
+//					either no other write is in flight (waiting would only add latency) or
+//					frames arrive too slowly to be aggregated (tx_send_now). Otherwise fNtbTimer
+//					is armed for about two average gaps between frames (tx_hold_us).
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::txCoalesce(bool full)
+{
+    UInt64		now, gap;
+    
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - fTxLastArrival, &gap);
+    fTxLastArrival = now;
+    fTxGapAvg = tx_gap_update(fTxGapAvg, gap / 1000);
+    
+    if (tx_send_now(full, fTxPending == 0 && fTransmitQueue->getSize() == 0, fDataCount, fTxGapAvg, fNtbTxTimeout))
+        (this->*fNtbFlush)();
+    else if (fNtbCount == 1 && fNtbTimer)
+        {
+        fNtbTimerSerial = fNtbSerial;	// the timer is for this transfer only
+        fNtbTimer->setTimeoutUS(tx_hold_us(fTxGapAvg, fNtbTxTimeout));
+        }
+    
+}/* end txCoalesce */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::ntbTimerCancel
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		NCM, RNDIS, EEM: the transfer being filled is sent, so its aggregation timeout
+//					must not cut the next one short. Called with fNtbLock held. A timeout which
+//					has already fired and waits for the lock is ignored by flushTimeout.
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::ntbTimerCancel(void)
+{
+    fNtbSerial++;
+    if (fNtbTimer)
+        fNtbTimer->cancelTimeout();
+    
+}/* end ntbTimerCancel */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::ncmTransmitPacket
+//
+//		Inputs:		packet - the packet
+//
+//		Outputs:	Return code - kIOReturnOutputSuccess, kIOReturnOutputDropped (packet consumed)
+//					or kIOReturnOutputStall (no buffer, packet untouched)
+//
+//		Desc:		NCM: append the datagram to the NTB being filled. The NTB is sent when it is
+//					full or when fNtbTimer expires (NCMTxTimeoutUS after its first datagram).
+//					Called by outputPackets with fNtbLock held.
+//
+/****************************************************************************************************/
+
+UInt32 net_lucid_cake_driver_AJZaurusUSB::ncmTransmitPacket(mbuf_t packet)
+{
+    UInt32		len = mbuf_pkthdr_len(packet);
+    UInt32		hdrLen = fNCM32 ? kNTH32_Length : kNTH16_Length;
+    UInt32		ndpLen = fNCM32 ? kNDP32_Length : kNDP16_Length;
+    UInt32		entryLen = fNCM32 ? 8 : 4;
+    UInt32		maxCount = MIN(fNtbOutMaxDatagrams, kNCMMaxDatagrams);
+    UInt32		poolIndx;
+    UInt32		off;
+    
+    for (;;)
+        {
+        if (fNtbPoolIndx == kOutBufNone)
+            { // start a new NTB
+            if (!acquireOutputBuffer(&poolIndx, false))
+                return kIOReturnOutputStall;
+            fNtbPoolIndx = poolIndx;
+            fNtbLength = hdrLen;
+            fNtbCount = 0;
+            }
+        off = ncm_align(fNtbLength, fNdpOutDivisor, fNdpOutRemainder);
+        // datagram, aligned NDP with one more entry plus the terminator, and a possible short packet byte
+        if (fNtbCount < maxCount &&
+            ncm_ntb_length(off + len, fNCM32, fNdpOutAlignment, fNtbCount + 1) + 1 <= fNtbTxMaxSize)
+            break;	// fits
+        if (fNtbCount == 0)
+            { // doesn't even fit into an empty NTB
+            IOLog("AJZaurusUSB::ncmTransmitPacket - Bad packet size, packet dropped (len=%lu)\n", len);
+            freePacket(packet);
+            if (fOutputErrsOK)
+                fpNetStats->outputErrors++;
+            return kIOReturnOutputDropped;
+            }
+        ncmFlush();
+        }
+    
+    bzero(fPipeOutBuff[fNtbPoolIndx].pipeOutBuffer + fNtbLength, off - fNtbLength);
+    mbuf_copydata(packet, 0, len, fPipeOutBuff[fNtbPoolIndx].pipeOutBuffer + off);
+    freePacket(packet);
+    fNtbDgIndex[fNtbCount] = off;
+    fNtbDgLength[fNtbCount] = len;
+    fNtbCount++;
+    fNtbLength = off + len;
+    
+    if (fOutputPktsOK)
+        fpNetStats->outputPackets++;
+    
+    // full (or the next datagram is unlikely to fit)?
+    txCoalesce(fNtbCount >= maxCount || fNtbLength + ndpLen + entryLen * (fNtbCount + 2) + fMax_Block_Size >= fNtbTxMaxSize);
+    
+    return kIOReturnOutputSuccess;
+    
+}/* end ncmTransmitPacket */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::ncmFlush
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		NCM: finish the NTB being filled (append NDP and fill in NTH) and send it.
+//					Called with fNtbLock held.
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::ncmFlush(void)
+{
+    UInt32		poolIndx = fNtbPoolIndx;
+    UInt8		*buf;
+    UInt32		total;
+    
+    if (poolIndx == kOutBufNone)
+        return;	// nothing to send
+    fNtbPoolIndx = kOutBufNone;
+    ntbTimerCancel();
+    if (fNtbCount == 0)
+        {
+        releaseOutputBuffer(poolIndx);
+        return;
+        }
+    buf = fPipeOutBuff[poolIndx].pipeOutBuffer;
+    total = ncm_finish(buf, fNtbLength, fNCM32, fNdpOutAlignment, fNtbSequence++, fNtbDgIndex, fNtbDgLength, fNtbCount);
+    if (tx_short_packet(total, fOutPacketSize, fNtbOutMaxSize, 1))
+        buf[total++] = 0;	// avoid a zero length packet (NCM allows a short packet instead)
+#if 0
+    IOLog("AJZaurusUSB::ncmFlush - %lu datagrams, %lu bytes\n", fNtbCount, total);
+#endif
+    fTxBatchHist[tx_batch_bucket(fNtbCount)]++;
+    writeOutputBuffer(poolIndx, fPipeOutBuff[poolIndx].pipeOutMDP, total);
+    
+}/* end ncmFlush */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::rndisTransmitPacket
+//
+//		Inputs:		packet - the packet
+//
+//		Outputs:	Return code - kIOReturnOutputSuccess, kIOReturnOutputDropped (packet consumed)
+//					or kIOReturnOutputStall (no buffer, packet untouched)
+//
+//		Desc:		RNDIS: append a REMOTE_NDIS_PACKET_MSG to the transfer being filled. Like NCM
+//					the transfer is sent when full or when fNtbTimer expires. Devices that take
+//					only one message per transfer get it sent right away. fNtbLock is held.
+//
+/****************************************************************************************************/
+
+UInt32 net_lucid_cake_driver_AJZaurusUSB::rndisTransmitPacket(mbuf_t packet)
+{
+    UInt32		len = mbuf_pkthdr_len(packet);
+    UInt32		msgLen = rndis_packet_length(len, fRndisAlignment);	// including the padding up to the next message
+    UInt32		poolIndx;
+    UInt8		*msg;
+    
+    for (;;)
+        {
+        if (fNtbPoolIndx == kOutBufNone)
+            { // start a new transfer
+            if (!acquireOutputBuffer(&poolIndx, false))
+                return kIOReturnOutputStall;
+            fNtbPoolIndx = poolIndx;
+            fNtbLength = 0;
+            fNtbCount = 0;
+            }
+        if (fNtbCount < fNtbOutMaxDatagrams && fNtbLength + msgLen + 1 <= fNtbTxMaxSize)
+            break;	// fits (with a possible short packet byte)
+        if (fNtbCount == 0)
+            { // doesn't even fit into an empty transfer
+            IOLog("AJZaurusUSB::rndisTransmitPacket - Bad packet size, packet dropped (len=%lu)\n", len);
+            freePacket(packet);
+            if (fOutputErrsOK)
+                fpNetStats->outputErrors++;
+            return kIOReturnOutputDropped;
+            }
+        rndisFlush();
+        }
+    
+    msg = fPipeOutBuff[fNtbPoolIndx].pipeOutBuffer + fNtbLength;
+    rndis_packet(msg, len, msgLen);
+    mbuf_copydata(packet, 0, len, msg + kRNDIS_Packet_Length);
+    freePacket(packet);
+    fNtbCount++;
+    fNtbLength += msgLen;
+    
+    if (fOutputPktsOK)
+        fpNetStats->outputPackets++;
+    
+    // full (or the next packet is unlikely to fit)?
+    txCoalesce(fNtbCount >= fNtbOutMaxDatagrams || fNtbLength + kRNDIS_Packet_Length + fMax_Block_Size >= fNtbTxMaxSize);
+    
+    return kIOReturnOutputSuccess;
+    
+}/* end rndisTransmitPacket */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::rndisFlush
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		RNDIS: send the transfer being filled. Called with fNtbLock held.
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::rndisFlush(void)
+{
+    UInt32		poolIndx = fNtbPoolIndx;
+    UInt32		total = fNtbLength;
+    
+    if (poolIndx == kOutBufNone)
+        return;	// nothing to send
+    fNtbPoolIndx = kOutBufNone;
+    ntbTimerCancel();
+    if (fNtbCount == 0)
+        {
+        releaseOutputBuffer(poolIndx);
+        return;
+        }
+    if (tx_short_packet(total, fOutPacketSize, fNtbOutMaxSize, 1))
+        fPipeOutBuff[poolIndx].pipeOutBuffer[total++] = 0;	// RNDIS allows a one byte short packet instead of a zero length packet
+#if 0
+    IOLog("AJZaurusUSB::rndisFlush - %lu packets, %lu bytes\n", fNtbCount, total);
+#endif
+    fTxBatchHist[tx_batch_bucket(fNtbCount)]++;
+    writeOutputBuffer(poolIndx, fPipeOutBuff[poolIndx].pipeOutMDP, total);
+    
+}/* end rndisFlush */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::eemTransmitPacket
+//
+//		Inputs:		packet - the packet
+//
+//		Outputs:	Return code - kIOReturnOutputSuccess, kIOReturnOutputDropped (packet consumed)
+//					or kIOReturnOutputStall (no buffer, packet untouched)
+//
+//		Desc:		EEM: append a data packet (header, frame, sentinel instead of the CRC) to the
+//					transfer being filled. Like NCM the transfer is sent when full or when
+//					fNtbTimer expires. fNtbLock is held.
+//
+/****************************************************************************************************/
+
+UInt32 net_lucid_cake_driver_AJZaurusUSB::eemTransmitPacket(mbuf_t packet)
+{
+    UInt32		len = mbuf_pkthdr_len(packet);
+    UInt32		pktLen = 2 + len + 4;
+    UInt32		poolIndx;
+    UInt8		*pkt;
+    
+    for (;;)
+        {
+        if (fNtbPoolIndx == kOutBufNone)
+            { // start a new transfer
+            if (!acquireOutputBuffer(&poolIndx, false))
+                return kIOReturnOutputStall;
+            fNtbPoolIndx = poolIndx;
+            fNtbLength = 0;
+            fNtbCount = 0;
+            }
+        if (fNtbCount < fNtbOutMaxDatagrams && fNtbLength + pktLen + 2 <= fNtbTxMaxSize)
+            break;	// fits (with a possible zero length EEM packet)
+        if (fNtbCount == 0)
+            { // doesn't even fit into an empty transfer
+            IOLog("AJZaurusUSB::eemTransmitPacket - Bad packet size, packet dropped (len=%lu)\n", len);
+            freePacket(packet);
+            if (fOutputErrsOK)
+                fpNetStats->outputErrors++;
+            return kIOReturnOutputDropped;
+            }
+        eemFlush();
+        }
+    
+    pkt = fPipeOutBuff[fNtbPoolIndx].pipeOutBuffer + fNtbLength;
+    eem_packet(pkt, len);
+    mbuf_copydata(packet, 0, len, pkt + 2);
+    freePacket(packet);
+    fNtbCount++;
+    fNtbLength += pktLen;
+    
+    if (fOutputPktsOK)
+        fpNetStats->outputPackets++;
+    
+    // full (or the next packet is unlikely to fit)?
+    txCoalesce(fNtbCount >= fNtbOutMaxDatagrams || fNtbLength + 2 + fMax_Block_Size >= fNtbTxMaxSize);
+    
+    return kIOReturnOutputSuccess;
+    
+}/* end eemTransmitPacket */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::eemCommand
+//
+//		Inputs:		header - EEM command header
+//					data, len - payload (echo)
+//
+//		Outputs:	
+//
+//		Desc:		EEM: send a command packet right away (behind the data already queued).
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::eemCommand(UInt16 header, const UInt8 *data, UInt32 len)
+{
+    UInt32		poolIndx;
+    UInt8		*pkt;
+    
+    IOLockLock(fNtbLock);
+    if (fNtbPoolIndx != kOutBufNone && fNtbLength + 2 + len + 2 > fNtbTxMaxSize)
+        eemFlush();
+    if (fNtbPoolIndx == kOutBufNone)
+        {
+        if (fDataCount >= kOutBufHighWater || !getOutputBuffers(&poolIndx, 1, false))
+            { // don't stall the queue for this
+            IOLog("AJZaurusUSB::eemCommand - no buffer, command %04x dropped\n", header);
+            IOLockUnlock(fNtbLock);
+            return;
+            }
+        fNtbPoolIndx = poolIndx;
+        fNtbLength = 0;
+        fNtbCount = 0;
+        }
+    pkt = fPipeOutBuff[fNtbPoolIndx].pipeOutBuffer + fNtbLength;
+    OSWriteLittleInt16(pkt, 0, header);
+    bcopy(data, pkt + 2, len);
+    fNtbCount++;
+    fNtbLength += 2 + len;
+    eemFlush();
+    IOLockUnlock(fNtbLock);
+    
+}/* end eemCommand */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::eemFlush
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		EEM: send the transfer being filled. Called with fNtbLock held.
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::eemFlush(void)
+{
+    UInt32		poolIndx = fNtbPoolIndx;
+    UInt32		total = fNtbLength;
+    
+    if (poolIndx == kOutBufNone)
+        return;	// nothing to send
+    fNtbPoolIndx = kOutBufNone;
+    ntbTimerCancel();
+    if (fNtbCount == 0)
+        {
+        releaseOutputBuffer(poolIndx);
+        return;
+        }
+    if (tx_short_packet(total, fOutPacketSize, fNtbOutMaxSize, 2))
+        { // a zero length EEM packet instead of a zero length USB packet
+        OSWriteLittleInt16(fPipeOutBuff[poolIndx].pipeOutBuffer, total, 0);
+        total += 2;
+        }
+#if 0
+    IOLog("AJZaurusUSB::eemFlush - %lu packets, %lu bytes\n", fNtbCount, total);
+#endif
+    fTxBatchHist[tx_batch_bucket(fNtbCount)]++;
+    writeOutputBuffer(poolIndx, fPipeOutBuff[poolIndx].pipeOutMDP, total);
+    
+}/* end eemFlush */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::flushTimeout
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		NCM, RNDIS, EEM: aggregation timeout, send what we have.
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::flushTimeout(void)
+{
+    IOLockLock(fNtbLock);
+    if (fNtbTimerSerial == fNtbSerial)	// else it was for a transfer which has been sent already
+        (this->*fNtbFlush)();
+    IOLockUnlock(fNtbLock);
+    
+}/* end flushTimeout */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::USBSetMulticastFilter
+//
+//		Inputs:		addrs - the list of addresses
+//				count - How many
+//
+//		Outputs:	
+//
+//		Desc:		Set up and send SetMulticastFilter Management Element Request(MER).
 //
 /****************************************************************************************************/
 
@@ -1109,12 +2290,26 @@ bool net_lucid_cake_driver_AJZaurusUSB::USBSetMulticastFilter(IOEthernetAddress
     
     IOLog("AJZaurusUSB::USBSetMulticastFilter - filters=%d count=%lu\n", fMcFilters, count);
     
+    if (fEEM)
+        return true;	// EEM has no filter requests - the device passes everything
+    
     if (count > (UInt32)(fMcFilters & kFiltersSupportedMask))
         {
         IOLog("AJZaurusUSB::USBSetMulticastFilter - No multicast filters supported\n");
         return false;
         }
     
+    if (fRNDIS)
+        { // the list is an OID of the device
+        rc = rndisSet(kOID_802_3_Multicast_List, addrs, count * kIOEthernetAddressSize);
+        if (rc != kIOReturnSuccess)
+            {
+            IOLog("AJZaurusUSB::USBSetMulticastFilter - RNDIS set failed: %d %s\n", rc, this->stringFromReturn(rc));
+            return false;
+            }
+        return true;
+        }
+    
     MER = (IOUSBDevRequest*)IOMalloc(sizeof(IOUSBDevRequest));
     if (!MER)
         {
@@ -1191,6 +2386,34 @@ bool net_lucid_cake_driver_AJZaurusUSB::USBSetPacketFilter()
     IOLog("AJZaurusUSB::USBSetPacketFilter %d\n", fPacketFilter);
     IOSleep(20);
 	
+    if (fEEM)
+        return true;	// EEM has no filter requests - the device passes everything
+	
+    if (fRNDIS)
+        { // translate to the NDIS bits and set the OID
+        UInt32	filter = 0;
+        UInt8	data[4];
+        
+        if (fPacketFilter & kPACKET_TYPE_DIRECTED)
+            filter |= kRNDIS_Packet_Type_Directed;
+        if (fPacketFilter & kPACKET_TYPE_MULTICAST)
+            filter |= kRNDIS_Packet_Type_Multicast;
+        if (fPacketFilter & kPACKET_TYPE_ALL_MULTICAST)
+            filter |= kRNDIS_Packet_Type_All_Multicast;
+        if (fPacketFilter & kPACKET_TYPE_BROADCAST)
+            filter |= kRNDIS_Packet_Type_Broadcast;
+        if (fPacketFilter & kPACKET_TYPE_PROMISCUOUS)
+            filter |= kRNDIS_Packet_Type_Promiscuous;
+        OSWriteLittleInt32(data, 0, filter);
+        rc = rndisSet(kOID_Gen_Current_Packet_Filter, data, sizeof(data));
+        if (rc != kIOReturnSuccess)
+            {
+            IOLog("AJZaurusUSB::USBSetPacketFilter - RNDIS set failed: %d %s\n", rc, this->stringFromReturn(rc));
+            return false;
+            }
+        return true;
+        }
+	
     MER = (IOUSBDevRequest*)IOMalloc(sizeof(IOUSBDevRequest));
     if (!MER)
         {
@@ -1227,152 +2450,489 @@ bool net_lucid_cake_driver_AJZaurusUSB::USBSetPacketFilter()
             }
         }
     
-    return true;
-    
-}/* end USBSetPacketFilter */
+    return true;
+    
+}/* end USBSetPacketFilter */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::clearPipeStall
+//
+//		Inputs:		thePipe - the pipe
+//
+//		Outputs:	
+//
+//		Desc:		Clear a stall on the specified pipe. All outstanding I/O
+//				is returned as aborted.
+//
+/****************************************************************************************************/
+
+IOReturn net_lucid_cake_driver_AJZaurusUSB::clearPipeStall(IOUSBPipe *thePipe)
+{
+    UInt8	pipeStatus;
+    IOReturn 	rtn = kIOReturnSuccess;
+    
+    IOLog("AJZaurusUSB::clearPipeStall %p\n", thePipe);
+    
+    pipeStatus = thePipe->GetPipeStatus();
+    if (pipeStatus == kPipeStalled)
+        {
+        rtn = thePipe->ClearPipeStall(true);
+        if (rtn == kIOReturnSuccess)
+            IOLog("AJZaurusUSB::clearPipeStall - Successful\n");
+        else 
+            IOLog("AJZaurusUSB::clearPipeStall - Failed: %d %s\n", rtn, this->stringFromReturn(rtn));
+        }
+    else
+        IOLog("AJZaurusUSB::clearPipeStall - Pipe not stalled: status=%d\n", pipeStatus);
+    
+    return rtn;
+    
+}/* end clearPipeStall */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::resetDevice
+//
+//		Inputs:	
+//
+//		Outputs:	
+//
+//		Desc:		Check to see if we need to reset the device on wake from sleep.
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::resetDevice(void)
+{
+    USBStatus	status;
+	
+    IOLog("AJZaurusUSB::resetDevice\n");
+    
+	if(!fpDevice)
+		return;
+	
+	if(fpDevice->GetDeviceStatus(&status) != kIOReturnSuccess)	// try to get device status
+		{
+        IOLog("AJZaurusUSB::resetDevice - could not get device status; needs to reset and reenumerate\n");
+		fpDevice->ResetDevice();
+		if(!fpDevice)
+			IOLog("AJZaurusUSB::resetDevice - fpDevice became NULL by ResetDevice!\n");
+		else
+			fpDevice->ReEnumerateDevice(0);
+		}
+	
+}/* end resetDevice */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::frameInput
+//
+//		Inputs:		packets - the packets
+//					sizes - Number of bytes in each packet (modified)
+//					count - Number of packets
+//
+//		Outputs:	
+//
+//		Desc:		Check and trim a batch of received frames and pass the good ones to receivePacket.
+//					The CRC of up to CRC32_MAX_STREAMS frames is verified in one interleaved pass.
+//					Frames which will be copied anyway are verified while they are copied
+//					(verifyReceivePacket). Instantiated with and without Checksum, see selectFraming().
+//
+/****************************************************************************************************/
+
+template <bool Checksum>
+void net_lucid_cake_driver_AJZaurusUSB::frameInput(UInt8 **packets, UInt32 *sizes, UInt32 count)
+{
+    unsigned char	*sp[CRC32_MAX_STREAMS];
+    UInt32		len[CRC32_MAX_STREAMS];
+    UInt32		fcs[CRC32_MAX_STREAMS];
+    UInt32		idx[CRC32_MAX_STREAMS];
+    bool		fused[CRC32_MAX_STREAMS];
+    UInt32		i, j, n, m;
+    UInt32		size;
+    
+    for (i = 0; i < count; i += n)
+        {
+        n = count - i;
+        if (n > CRC32_MAX_STREAMS)
+            n = CRC32_MAX_STREAMS;
+        
+        // first pass: sanity checks and collect the frames to verify
+        
+        for (m = 0, j = i; j < i + n; j++)
+            {
+            size = sizes[j];
+            fused[j - i] = false;
+            if (size > fMax_Block_Size)
+                {
+                IOLog("AJZaurusUSB::frameInput - Packet size error, packet dropped (len=%lu, expected %d)\n", size, fMax_Block_Size);
+                if (fInputErrsOK)
+                    fpNetStats->inputErrors++;
+                sizes[j] = 0;
+                continue;
+                }
+            if (!Checksum)
+                continue;
+            if (size < 4)
+                {
+                IOLog("AJZaurusUSB::frameInput - Packet too short for CRC, packet dropped (len=%lu)\n", size);
+                if (fInputErrsOK)
+                    fpNetStats->inputErrors++;
+                sizes[j] = 0;
+                continue;
+                }
+            if (!rx_fcs_sample(fFCSVerifyInterval, &fFCSVerifyCountdown))
+                {
+                // don't verify this frame
+                // if there is an extra byte we keep it - the IP layer ignores trailing bytes
+                sizes[j] = size - 4;
+                continue;
+                }
+            fFCSChecked++;
+            if (!rx_zero_copy(zeroCopyPacket(packets[j]) != NULL, size - 4))
+                { // not zero-copy: verify while copying
+                fused[j - i] = true;
+                continue;
+                }
+            sp[m] = packets[j];
+            len[m] = rx_fcs_body(size, fOutPacketSize);	// check fcs across length minus the extra byte first
+            fcs[m] = CRC32_INITFCS;
+            idx[m++] = j;
+            }
+        
+        // check CRC
+        
+        if (m > 1)
+            fcs_compute32_multi(sp, len, fcs, m);
+        else if (m == 1)
+            fcs[0] = fcs_compute32(sp[0], len[0], fcs[0]);
+        for (j = 0; j < m; j++)
+            {
+            if ((size = rx_fcs_length(fcs[j], sp[j], len[j], sizes[idx[j]])) == 0)
+                {
+                IOLog("AJZaurusUSB::frameInput - CRC failed; packet (size=%lu) dropped: %08lx\n", sizes[idx[j]], fcs[j]);
+                fFCSFailed++;
+                if (fInputErrsOK)
+                    fpNetStats->inputErrors++;
+                sizes[idx[j]] = 0;
+                continue;
+                }
+            // trim fcs
+            sizes[idx[j]] = size - 4;
+            }
+        
+        // second pass: push the good frames up the TCP/IP stack
+        
+        for (j = i; j < i + n; j++)
+            {
+            if (fused[j - i])
+                verifyReceivePacket(packets[j], sizes[j]);
+            else if (sizes[j] > 0)
+                receivePacket(packets[j], sizes[j]);
+            }
+        }
+    
+}/* end frameInput */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::ncmFrameInput
+//
+//		Inputs:		packets - the received NTBs
+//					sizes - Number of bytes in each NTB
+//					count - Number of NTBs
+//
+//		Outputs:	
+//
+//		Desc:		NCM: walk the NTH and the chain of NDPs and pass the datagrams on
+//					in batches (no CRC).
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::ncmFrameInput(UInt8 **packets, UInt32 *sizes, UInt32 count)
+{
+    UInt8		*dg[kNCMMaxDatagrams];
+    UInt32		dgLen[kNCMMaxDatagrams];
+    UInt32		n = 0;
+    UInt32		c, off, len;
+    struct ncm_walk	w;
+    int			more;
+    UInt8		*buf;
+    UInt32		size;
+    
+    for (c = 0; c < count; c++)
+        {
+        buf = packets[c];
+        size = sizes[c];
+        if (!ncm_walk_start(&w, buf, size))
+            goto error;
+        while ((more = ncm_walk_next(&w, &off, &len)) > 0)
+            {
+            dg[n] = buf + off;
+            dgLen[n++] = len;
+            if (n == kNCMMaxDatagrams)
+                frameInput<false>(dg, dgLen, n), n = 0;
+            }
+        if (more < 0)
+            goto error;	// the datagrams before the bad spot are passed on
+        continue;
+    error:
+        IOLog("AJZaurusUSB::ncmFrameInput - Bad NTB, rest dropped (len=%lu)\n", size);
+        if (fInputErrsOK)
+            fpNetStats->inputErrors++;
+        }
+    if (n > 0)
+        frameInput<false>(dg, dgLen, n);
+    
+}/* end ncmFrameInput */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::rndisFrameInput
+//
+//		Inputs:		packets - the received transfers
+//					sizes - Number of bytes in each transfer
+//					count - Number of transfers
+//
+//		Outputs:	
+//
+//		Desc:		RNDIS: split the transfers into REMOTE_NDIS_PACKET_MSGs and pass the frames on
+//					in batches (no CRC).
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::rndisFrameInput(UInt8 **packets, UInt32 *sizes, UInt32 count)
+{
+    UInt8		*dg[kNCMMaxDatagrams];
+    UInt32		dgLen[kNCMMaxDatagrams];
+    UInt32		n = 0;
+    UInt32		c, off, frame, len;
+    int			more;
+    UInt8		*buf;
+    UInt32		size;
+    
+    for (c = 0; c < count; c++)
+        {
+        buf = packets[c];
+        size = sizes[c];
+        off = 0;
+        while ((more = rndis_next(buf, size, &off, &frame, &len)) > 0)
+            {
+            dg[n] = buf + frame;
+            dgLen[n++] = len;
+            if (n == kNCMMaxDatagrams)
+                frameInput<false>(dg, dgLen, n), n = 0;
+            }
+        if (more < 0)
+            goto error;
+        continue;
+    error:
+        IOLog("AJZaurusUSB::rndisFrameInput - Bad message, rest dropped (len=%lu offset=%lu)\n", size, off);
+        if (fInputErrsOK)
+            fpNetStats->inputErrors++;
+        }
+    if (n > 0)
+        frameInput<false>(dg, dgLen, n);
+    
+}/* end rndisFrameInput */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::eemFrameInput
+//
+//		Inputs:		packets - the received transfers
+//					sizes - Number of bytes in each transfer
+//					count - Number of transfers
+//
+//		Outputs:	
+//
+//		Desc:		EEM: split the transfers into EEM packets, answer echo commands and pass the
+//					frames on in batches. Only packets with bmCRC set need the CRC check, the
+//					others carry the sentinel.
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::eemFrameInput(UInt8 **packets, UInt32 *sizes, UInt32 count)
+{
+    UInt8		*dg[kNCMMaxDatagrams];
+    UInt32		dgLen[kNCMMaxDatagrams];
+    UInt32		n = 0;
+    bool		crc = false;	// kind of the frames in dg[]
+    UInt32		c, off, data, len;
+    int			kind;
+    UInt8		*buf;
+    UInt32		size;
+    
+    for (c = 0; c < count; c++)
+        {
+        buf = packets[c];
+        size = sizes[c];
+        off = 0;
+        while ((kind = eem_next(buf, size, &off, &data, &len)) != kEEMEnd)
+            {
+            if (kind == kEEMBad)
+                goto error;
+            if (kind == kEEMEcho)
+                eemCommand(eem_echo_response(len), buf + data, len);
+            if (kind == kEEMBadSentinel)
+                {
+                IOLog("AJZaurusUSB::eemFrameInput - Bad sentinel; packet (size=%lu) dropped\n", len);
+                if (fInputErrsOK)
+                    fpNetStats->inputErrors++;
+                }
+            if (kind != kEEMFrame && kind != kEEMFrameCRC)
+                continue;
+            if (n > 0 && (n == kNCMMaxDatagrams || crc != (kind == kEEMFrameCRC)))
+                { // keep the order of the frames
+                if (crc)
+                    frameInput<true>(dg, dgLen, n);
+                else
+                    frameInput<false>(dg, dgLen, n);
+                n = 0;
+                }
+            crc = (kind == kEEMFrameCRC);
+            dg[n] = buf + data;
+            dgLen[n++] = len;
+            }
+        continue;
+    error:
+        IOLog("AJZaurusUSB::eemFrameInput - Bad packet, rest dropped (len=%lu offset=%lu)\n", size, off);
+        if (fInputErrsOK)
+            fpNetStats->inputErrors++;
+        }
+    if (n > 0)
+        {
+        if (crc)
+            frameInput<true>(dg, dgLen, n);
+        else
+            frameInput<false>(dg, dgLen, n);
+        }
+    
+}/* end eemFrameInput */
 
 /****************************************************************************************************/
 //
-//		Method:		net_lucid_cake_driver_AJZaurusUSB::clearPipeStall
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::receivePackets
 //
-//		Inputs:		thePipe - the pipe
+//		Inputs:		packets - the packets
+//					sizes - Number of bytes in each packet (modified)
+//					count - Number of packets
 //
 //		Outputs:	
 //
-//		Desc:		Clear a stall on the specified pipe. All outstanding I/O
-//				is returned as aborted.
+//		Desc:		Hand a batch of received frames to the framing routine of the current mode.
 //
 /****************************************************************************************************/
 
-IOReturn net_lucid_cake_driver_AJZaurusUSB::clearPipeStall(IOUSBPipe *thePipe)
+void net_lucid_cake_driver_AJZaurusUSB::receivePackets(UInt8 **packets, UInt32 *sizes, UInt32 count)
 {
-    UInt8	pipeStatus;
-    IOReturn 	rtn = kIOReturnSuccess;
-    
-    IOLog("AJZaurusUSB::clearPipeStall %p\n", thePipe);
-    
-    pipeStatus = thePipe->GetPipeStatus();
-    if (pipeStatus == kPipeStalled)
-        {
-        rtn = thePipe->ClearPipeStall(true);
-        if (rtn == kIOReturnSuccess)
-            IOLog("AJZaurusUSB::clearPipeStall - Successful\n");
-        else 
-            IOLog("AJZaurusUSB::clearPipeStall - Failed: %d %s\n", rtn, this->stringFromReturn(rtn));
-        }
-    else
-        IOLog("AJZaurusUSB::clearPipeStall - Pipe not stalled: status=%d\n", pipeStatus);
-    
-    return rtn;
-    
-}/* end clearPipeStall */
+    (this->*fFrameInput)(packets, sizes, count);
+}/* end receivePackets */
 
 /****************************************************************************************************/
 //
-//		Method:		net_lucid_cake_driver_AJZaurusUSB::resetDevice
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::selectFraming
 //
-//		Inputs:	
+//		Inputs:		
 //
 //		Outputs:	
 //
-//		Desc:		Check to see if we need to reset the device on wake from sleep.
+//		Desc:		Pick the TX and RX framing routines for fPadded, fChecksum, fNCM, fRNDIS and fEEM.
+//					Must be called whenever one of them changes (i.e. in init and configureDevice).
 //
 /****************************************************************************************************/
 
-void net_lucid_cake_driver_AJZaurusUSB::resetDevice(void)
+void net_lucid_cake_driver_AJZaurusUSB::selectFraming(void)
 {
-    USBStatus	status;
-	
-    IOLog("AJZaurusUSB::resetDevice\n");
-    
-	if(!fpDevice)
-		return;
-	
-	if(fpDevice->GetDeviceStatus(&status) != kIOReturnSuccess)	// try to get device status
-		{
-        IOLog("AJZaurusUSB::resetDevice - could not get device status; needs to reset and reenumerate\n");
-		fpDevice->ResetDevice();
-		if(!fpDevice)
-			IOLog("AJZaurusUSB::resetDevice - fpDevice became NULL by ResetDevice!\n");
-		else
-			fpDevice->ReEnumerateDevice(0);
-		}
-	
-}/* end resetDevice */
+    if (fPadded)
+        {
+        if (fChecksum)
+            fFrameOutput = &net_lucid_cake_driver_AJZaurusUSB::frameOutput<true, true>;		// MDLM
+        else
+            fFrameOutput = &net_lucid_cake_driver_AJZaurusUSB::frameOutput<true, false>;
+        }
+    else
+        {
+        if (fChecksum)
+            fFrameOutput = &net_lucid_cake_driver_AJZaurusUSB::frameOutput<false, true>;
+        else
+            fFrameOutput = &net_lucid_cake_driver_AJZaurusUSB::frameOutput<false, false>;	// ECM, CDC Subset
+        }
+    if (fChecksum)
+        fFrameInput = &net_lucid_cake_driver_AJZaurusUSB::frameInput<true>;
+    else
+        fFrameInput = &net_lucid_cake_driver_AJZaurusUSB::frameInput<false>;
+    fNtbFlush = NULL;
+    fNtbAppend = NULL;
+    if (fNCM)
+        { // datagrams are aggregated into NTBs (see ncmTransmitPacket) resp. extracted from them
+        fFrameInput = &net_lucid_cake_driver_AJZaurusUSB::ncmFrameInput;
+        fNtbFlush = &net_lucid_cake_driver_AJZaurusUSB::ncmFlush;
+        fNtbAppend = &net_lucid_cake_driver_AJZaurusUSB::ncmTransmitPacket;
+        fMapOutput = NULL;
+        }
+    else if (fRNDIS)
+        { // dto. with REMOTE_NDIS_PACKET_MSGs
+        fFrameInput = &net_lucid_cake_driver_AJZaurusUSB::rndisFrameInput;
+        fNtbFlush = &net_lucid_cake_driver_AJZaurusUSB::rndisFlush;
+        fNtbAppend = &net_lucid_cake_driver_AJZaurusUSB::rndisTransmitPacket;
+        fMapOutput = NULL;
+        }
+    else if (fEEM)
+        { // dto. with EEM packets
+        fFrameInput = &net_lucid_cake_driver_AJZaurusUSB::eemFrameInput;
+        fNtbFlush = &net_lucid_cake_driver_AJZaurusUSB::eemFlush;
+        fNtbAppend = &net_lucid_cake_driver_AJZaurusUSB::eemTransmitPacket;
+        fMapOutput = NULL;
+        }
+    else if (fPadded == fChecksum)	// the modes we know (MDLM resp. ECM, CDC Subset) can transmit scatter-gather
+        fMapOutput = fPadded ? &net_lucid_cake_driver_AJZaurusUSB::mapOutput<true, true> : &net_lucid_cake_driver_AJZaurusUSB::mapOutput<false, false>;
+    else
+        fMapOutput = NULL;
+}/* end selectFraming */
 
 /****************************************************************************************************/
 //
 //		Method:		net_lucid_cake_driver_AJZaurusUSB::receivePacket
 //
-//		Inputs:		packet - the packet
+//		Inputs:		packet - the packet (already checked by receivePackets)
 //					size - Number of bytes in the packet
 //
 //		Outputs:	
 //
-//		Desc:		Build the mbufs and then send to the network stack.
+//		Desc:		Build the mbufs and then queue them for the network stack (see flushInput). If the frame was read
+//					right into one of fInPackets, that mbuf is trimmed (dropping the FCS) and sent
+//					without copying, unless the frame is short.
 //
 /****************************************************************************************************/
 
 void net_lucid_cake_driver_AJZaurusUSB::receivePacket(UInt8 *packet, UInt32 size)
 {
     mbuf_t		m;
+    mbuf_t		*zc = zeroCopyPacket(packet);
     UInt32		submit;
-    UInt32		fcs;
 #if 0
     IOLog("AJZaurusUSB::receivePacket size=%lu\n", size);
 #endif
-    if (size > fMax_Block_Size)
-        {
-        IOLog("AJZaurusUSB::receivePacket - Packet size error, packet dropped (len=%lu, expected %d)\n", size, fMax_Block_Size);
-        if (fInputErrsOK)
-            fpNetStats->inputErrors++;
-        return;
+    // push the packet up the TCP/IP stack
+    if (rx_zero_copy(zc != NULL, size))
+        { // zero-copy: the mbuf is ours to give away
+        m = *zc;
+        *zc = NULL;
+        mbuf_setlen(m, size);
+        mbuf_pkthdr_setlen(m, size);
         }
-    
-    // check CRC
-    
-    if (fChecksum)
+    else if ((m = allocatePacket(size)))
         {
-        if ((size % fOutPacketSize) == 1)
-            {
-            
-            // check fcs across length minus one bytes
-            if ((fcs = fcs_compute32(packet, size - 1, CRC32_INITFCS)) == CRC32_GOODFCS)
-                {
-                // success, trim extra byte and fall through
-                --size;
-                }
-            // failed, check additional byte
-            else if ((fcs = fcs_compute32(packet+size - 1, 1, fcs)) != CRC32_GOODFCS)
-                {
-                // failed
-                IOLog("AJZaurusUSB::receivePacket - CRC failed on extra byte; packet (size=%lu) dropped: %08lx\n", size, fcs);
-                if (fInputErrsOK)
-                    fpNetStats->inputErrors++;
-                return;
-                }
-            // success fall through, possibly with corrected length
-            }
-        // normal check across full frame
-        else if ((fcs = fcs_compute32(packet, size, CRC32_INITFCS)) != CRC32_GOODFCS)
-            {
-            IOLog("AJZaurusUSB::receivePacket - CRC failed; packet (size=%lu) dropped: %08lx\n", size, fcs);
-            if (fInputErrsOK)
-                fpNetStats->inputErrors++;
-            return;
-            }
-        
-        // trim fcs
-        size -= 4;
+  //      bcopy(packet, (unsigned char*) mbuf_data(m), size);
+		mbuf_copyback(m, 0, size, packet, MBUF_DONTWAIT);
+        fRxBytesCopied += size;
         }
-    
-    // push the packet up the TCP/IP stack
-    m = allocatePacket(size);
     if (m)
         {
-  //      bcopy(packet, (unsigned char*) mbuf_data(m), size);
-		mbuf_copyback(m, 0, size, packet, MBUF_DONTWAIT);
-        submit = fNetworkInterface->inputPacket(m, size);
+        fRxBytes += size;
+        submit = fNetworkInterface->inputPacket(m, size, IONetworkInterface::kInputOptionQueuePacket);
+        fInQueued++;
 #if 0
         IOLog("AJZaurusUSB::receivePacket - %lu Packets submitted to IP layer\n", submit);
 #endif
@@ -1388,6 +2948,113 @@ void net_lucid_cake_driver_AJZaurusUSB::receivePacket(UInt8 *packet, UInt32 size
     
 }/* end receivePacket */
 
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::zeroCopyPacket
+//
+//		Inputs:		packet - a received frame
+//
+//		Outputs:	Return code - the entry of fInPackets the frame was read into (NULL = copy it)
+//
+/****************************************************************************************************/
+
+mbuf_t *net_lucid_cake_driver_AJZaurusUSB::zeroCopyPacket(UInt8 *packet)
+{
+    UInt32		i;
+    
+    for (i = 0; i < fInPacketCount; i++)
+        {
+        if (fInPackets[i] && packet == (UInt8 *) mbuf_data(fInPackets[i]))
+            return &fInPackets[i];
+        }
+    return NULL;
+    
+}/* end zeroCopyPacket */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::verifyReceivePacket
+//
+//		Inputs:		packet - the packet (with FCS)
+//					size - Number of bytes in the packet
+//
+//		Outputs:	
+//
+//		Desc:		Copy the frame into an mbuf, verify the FCS on the way, and send it to the
+//					network stack. If the transfer has an extra byte (size % fOutPacketSize == 1),
+//					the FCS is checked both before and after it; the byte itself is never copied
+//					since it is either padding or the last byte of the FCS.
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::verifyReceivePacket(UInt8 *packet, UInt32 size)
+{
+    mbuf_t		m, n;
+    UInt32		body = rx_fcs_body(size, fOutPacketSize);	// check fcs across length minus the extra byte first
+    UInt32		off, len;
+    UInt32		fcs = CRC32_INITFCS;
+    UInt32		submit;
+    
+    m = allocatePacket(body);
+    if (!m)
+        {
+        IOLog("AJZaurusUSB::verifyReceivePacket - Buffer allocation failed, packet dropped\n");
+        if (fInputErrsOK)
+            fpNetStats->inputErrors++;
+        return;
+        }
+    for (n = m, off = 0; n && off < body; n = mbuf_next(n), off += len)
+        {
+        len = MIN(mbuf_len(n), body - off);
+        fcs = fcs_memcpy32((unsigned char*) mbuf_data(n), packet + off, len, fcs);
+        }
+    if ((len = rx_fcs_length(fcs, packet, body, size)) == 0)
+        {
+        IOLog("AJZaurusUSB::verifyReceivePacket - CRC failed; packet (size=%lu) dropped: %08lx\n", size, fcs);
+        fFCSFailed++;
+        if (fInputErrsOK)
+            fpNetStats->inputErrors++;
+        freePacket(m);
+        return;
+        }
+    // trim fcs
+    size = len;
+    mbuf_adj(m, (int) (size - 4) - (int) body);
+    submit = fNetworkInterface->inputPacket(m, size - 4, IONetworkInterface::kInputOptionQueuePacket);
+    fInQueued++;
+    fRxBytes += size - 4;
+    fRxBytesCopied += size - 4;
+#if 0
+    IOLog("AJZaurusUSB::verifyReceivePacket - %lu Packets submitted to IP layer\n", submit);
+#endif
+    if (fInputPktsOK)
+        fpNetStats->inputPackets++;
+    
+}/* end verifyReceivePacket */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::flushInput
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Hand the frames queued by receivePacket to the stack in one go. Called once
+//					the completed reads have been processed.
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::flushInput(void)
+{
+    if (fInQueued == 0)
+        return;
+    fRxBatchHist[tx_batch_bucket(fInQueued)]++;
+    fInQueued = 0;
+    fNetworkInterface->flushInputQueue();
+    
+}/* end flushInput */
+
 /****************************************************************************************************/
 //
 //		Method:		net_lucid_cake_driver_AJZaurusUSB::createWorkLoop
@@ -1443,7 +3110,6 @@ IOWorkLoop* net_lucid_cake_driver_AJZaurusUSB::getWorkLoop() const
 bool net_lucid_cake_driver_AJZaurusUSB::allocateResources()
 {
     IOUSBFindEndpointRequest	epReq;		// endPoint request struct on stack
-    UInt32			i;
     
 #if 1
     IOLog("AJZaurusUSB::allocateResources\n");
@@ -1513,32 +3179,42 @@ bool net_lucid_cake_driver_AJZaurusUSB::allocateResources()
     // Allocate Memory Descriptor Pointer with memory for the data-in bulk pipe:
     
 	fMax_Block_Size = 64*((fMax_Block_Size+(64-1))/64);	// 64 is the Max Block Size we should read from the endpoint descriptor
+	fInBufSize = fOutBufSize = fMax_Block_Size;
+	if (fNCM || fRNDIS || fEEM)
+		{ // transfers carry NTBs resp. RNDIS or EEM packets with many frames
+		fInBufSize = fNtbInMaxSize;
+		fOutBufSize = fNtbOutMaxSize;
+		}
+	else if (fPadded && fChecksum)
+		fInBufSize = MIN(fInBufSize, kInBufFrame);	// MDLM announces 0xea00 but sends one frame per transfer
 	
-    fPipeInMDP = IOBufferMemoryDescriptor::withCapacity(fMax_Block_Size, kIODirectionIn);
-    if (!fPipeInMDP)
-        return false;
-    
-    fPipeInMDP->setLength(fMax_Block_Size);
-    fPipeInBuffer = (UInt8*)fPipeInMDP->getBytesNoCopy();
-#if 1
-    IOLog("AJZaurusUSB::allocateResources - input buffer %p[%lu]\n", fPipeInBuffer, fPipeInMDP->getLength());
-#endif
-    // Allocate Memory Descriptor Pointers with memory for the data-out bulk pipe pool
+    // In the modes with one frame per transfer the reads go into mbufs which are passed up the
+    // stack as they are, if a read fits into a cluster. The buffers below are used when no
+    // mbuf can be had.
     
-    for (i=0; i<kOutBufPool; i++)
+    fInZeroCopy = !(fNCM || fRNDIS || fEEM) && fInBufSize <= MBIGCLBYTES;
+    fInSlots = 2 * fInReads;
+    for (UInt32 i=0; i<fInSlots; i++)
         {
-        fPipeOutBuff[i].pipeOutMDP = IOBufferMemoryDescriptor::withCapacity(fMax_Block_Size, kIODirectionOut);
-        if (!fPipeOutBuff[i].pipeOutMDP)
-            {
-            IOLog("AJZaurusUSB::allocateResources - Allocate output descriptor failed\n");
+        fPipeInBuff[i].pipeInMDP = IOBufferMemoryDescriptor::withCapacity(fInBufSize, kIODirectionIn);
+        if (!fPipeInBuff[i].pipeInMDP)
             return false;
-            }
         
-        fPipeOutBuff[i].pipeOutMDP->setLength(fMax_Block_Size);
-        fPipeOutBuff[i].pipeOutBuffer = (UInt8*)fPipeOutBuff[i].pipeOutMDP->getBytesNoCopy();
-#if 0
-        IOLog("AJZaurusUSB::allocateResources - mdp=%p output buffer=%p[%u]\n", fPipeOutBuff[i].pipeOutMDP, fPipeOutBuff[i].pipeOutBuffer, fPipeOutBuff[i].pipeOutBuffer->getLength());
+        fPipeInBuff[i].pipeInMDP->setLength(fInBufSize);
+        fPipeInBuff[i].pipeInBuffer = (UInt8*)fPipeInBuff[i].pipeInMDP->getBytesNoCopy();
+        }
+#if 1
+    IOLog("AJZaurusUSB::allocateResources - %lu input buffers [%lu] for %lu reads\n", fInSlots, fInBufSize, fInReads);
 #endif
+    // Allocate the first chunk of the data-out bulk pipe pool. The others follow when the
+    // traffic needs them. A single frame plus padding and CRC fits into kOutBufSmall, so
+    // the copy modes only need the full fOutBufSize for the few large buffers.
+    
+    fOutSlotSize = (fNCM || fRNDIS || fEEM) ? fOutBufSize : MIN(fOutBufSize, kOutBufSmall);
+    if (!growOutputBuffers(false))
+        {
+        IOLog("AJZaurusUSB::allocateResources - Allocate output descriptor failed\n");
+        return false;
         }
 #if 1
     IOLog("AJZaurusUSB::allocateResources - done\n");
@@ -1561,20 +3237,23 @@ bool net_lucid_cake_driver_AJZaurusUSB::allocateResources()
 
 void net_lucid_cake_driver_AJZaurusUSB::releaseResources()
 {
-    UInt32	i;
     IOLog("AJZaurusUSB::releaseResources\n");
-    for (i=0; i<kOutBufPool; i++)
+    freeOutputBuffers();
+    for (UInt32 i=0; i<kInBufSlots; i++)
         {
-        if (fPipeOutBuff[i].pipeOutMDP)	
+        if (fPipeInBuff[i].pipeInMDP)
             { 
-				fPipeOutBuff[i].pipeOutMDP->release();	
-				fPipeOutBuff[i].pipeOutMDP = NULL;
+			fPipeInBuff[i].pipeInMDP->release();	
+			fPipeInBuff[i].pipeInMDP = NULL; 
+            fPipeInBuff[i].pipeInBuffer = NULL;
+            }
+        if (fPipeInBuff[i].packet)
+            {
+            fPipeInBuff[i].packetMDP->release();
+            fPipeInBuff[i].packetMDP = NULL;
+            freePacket(fPipeInBuff[i].packet);
+            fPipeInBuff[i].packet = NULL;
             }
-        }
-    if (fPipeInMDP)
-        { 
-			fPipeInMDP->release();	
-			fPipeInMDP = NULL; 
         }
     if (fCommPipeMDP)	
         { 
@@ -1584,4 +3263,204 @@ void net_lucid_cake_driver_AJZaurusUSB::releaseResources()
     
 }/* end releaseResources */
 
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::growOutputBuffers
+//
+//		Inputs:		large - add the chunk with the kOutBufLarge buffers of fOutBufSize
+//					instead of a regular one with kOutSlabSlots buffers of fOutSlotSize
+//
+//		Outputs:	Return code - true (enough buffers), false (allocation failed or all chunks there)
+//
+//		Desc:		Allocate one slab chunk, slice it into output buffers and put them on the free list
+//
+/****************************************************************************************************/
+
+bool net_lucid_cake_driver_AJZaurusUSB::growOutputBuffers(bool large)
+{
+    IOBufferMemoryDescriptor	*chunk;
+    UInt8		*base;
+    UInt32		c, first, count, size, stride, i;
+    
+    IOLockLock(fOutSlabLock);
+    if (large)
+        {
+        c = kOutSlabLarge;
+        first = kOutBufPool;
+        count = kOutBufLarge;
+        size = fOutBufSize;
+        }
+    else
+        {
+        if (fDataCount + kOutSlabSlots/4 < (SInt32) (fOutSlabCount * kOutSlabSlots))
+            { // somebody else was faster
+            IOLockUnlock(fOutSlabLock);
+            return true;
+            }
+        c = fOutSlabCount;
+        first = c * kOutSlabSlots;
+        count = kOutSlabSlots;
+        size = fOutSlotSize;
+        }
+    if (fOutSlab[c] || (!large && c >= kOutSlabChunks))
+        {
+        IOLockUnlock(fOutSlabLock);
+        return (fOutSlab[c] != NULL);
+        }
+    stride = (size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+    chunk = IOBufferMemoryDescriptor::withCapacity(count * stride, kIODirectionOut);
+    if (!chunk)
+        {
+        IOLog("AJZaurusUSB::growOutputBuffers - Allocate %lu bytes failed\n", count * stride);
+        IOLockUnlock(fOutSlabLock);
+        return false;
+        }
+    chunk->setLength(count * stride);
+    base = (UInt8*)chunk->getBytesNoCopy();
+    for (i=0; i<count; i++)
+        {
+        fPipeOutBuff[first+i].pipeOutMDP = IOMemoryDescriptor::withSubRange(chunk, i * stride, size, kIODirectionOut);
+        if (!fPipeOutBuff[first+i].pipeOutMDP)
+            {
+            IOLog("AJZaurusUSB::growOutputBuffers - Allocate output descriptor failed\n");
+            while (i-- > 0)
+                {
+                fPipeOutBuff[first+i].pipeOutMDP->release();
+                fPipeOutBuff[first+i].pipeOutMDP = NULL;
+                fPipeOutBuff[first+i].pipeOutBuffer = NULL;
+                }
+            chunk->release();
+            IOLockUnlock(fOutSlabLock);
+            return false;
+            }
+        fPipeOutBuff[first+i].pipeOutBuffer = base + i * stride;
+        fOutFreeNext[first+i] = first+i+1;
+        }
+    fOutSlab[c] = chunk;
+    if (!large)
+        fOutSlabCount++;
+    fOutSlabBytes += count * stride;
+    putOutputBuffers(first, first+count-1);
+    IOLockUnlock(fOutSlabLock);
+#if 0
+    IOLog("AJZaurusUSB::growOutputBuffers - chunk %lu: %lu buffers of %lu bytes, %lu bytes total\n", c, count, size, fOutSlabBytes);
+#endif
+    return true;
+    
+}/* end growOutputBuffers */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::shrinkOutputBuffers
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Called by the watchdog. Once the slab has been larger than the traffic needs
+//					for kOutSlabIdleTicks, free the large chunk (if unused) or the last regular one.
+//					This needs a moment in which all buffers of the chunk are free: they are taken
+//					off the free list (index_stack_remove_range) so that nobody can pick one of them
+//					while the chunk goes away.
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::shrinkOutputBuffers(void)
+{
+    SInt32		peak = fOutSlabPeak;
+    bool		largeUsed = fOutSlabLargeUsed;
+    UInt32		c, first, count, i;
+    
+    reclaimOutputBuffers();	// in case fTxDoneSource is still pending
+    fOutSlabPeak = fDataCount;
+    fOutSlabLargeUsed = false;
+    if ((fOutSlab[kOutSlabLarge] && !largeUsed) ||
+        (fOutSlabCount > 1 && peak + kOutSlabSlots/2 < (SInt32) ((fOutSlabCount - 1) * kOutSlabSlots)))
+        fOutSlabIdle++;
+    else
+        fOutSlabIdle = 0;
+    if (fOutSlabIdle < kOutSlabIdleTicks)
+        return;
+    
+    IOLockLock(fOutSlabLock);
+    if (fOutSlab[kOutSlabLarge] && !largeUsed)
+        {
+        c = kOutSlabLarge;
+        first = kOutBufPool;
+        count = kOutBufLarge;
+        }
+    else
+        {
+        c = fOutSlabCount - 1;
+        first = c * kOutSlabSlots;
+        count = kOutSlabSlots;
+        }
+    if (index_stack_remove_range(&fOutFreeHead[c == kOutSlabLarge], fOutFreeNext, first, count))
+        { // all buffers of the chunk were free and nobody can get one now: free it
+        if (c != kOutSlabLarge)
+            fOutSlabCount--;
+        for (i=first; i<first+count; i++)
+            {
+            fPipeOutBuff[i].pipeOutMDP->release();
+            fPipeOutBuff[i].pipeOutMDP = NULL;
+            fPipeOutBuff[i].pipeOutBuffer = NULL;
+            }
+        fOutSlabBytes -= fOutSlab[c]->getLength();
+        fOutSlab[c]->release();
+        fOutSlab[c] = NULL;
+        fOutSlabIdle = 0;
+#if 0
+        IOLog("AJZaurusUSB::shrinkOutputBuffers - chunk %lu freed, %lu bytes left\n", c, fOutSlabBytes);
+#endif
+        }	// else some are in flight, try again on the next tick
+    IOLockUnlock(fOutSlabLock);
+    if (fOutputStalled)
+        fTransmitQueue->service(net_lucid_cake_driver_AJZaurusUSBOutputQueue::kServiceAsync);	// found the list empty while we had it
+    
+}/* end shrinkOutputBuffers */
+
+/****************************************************************************************************/
+//
+//		Method:		net_lucid_cake_driver_AJZaurusUSB::freeOutputBuffers
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Free all output buffers and slab chunks (the pipes are closed)
+//
+/****************************************************************************************************/
+
+void net_lucid_cake_driver_AJZaurusUSB::freeOutputBuffers(void)
+{
+    UInt32	i;
+    
+    for (i=0; i<kOutBufSlots; i++)
+        {
+        if (fPipeOutBuff[i].inuse)
+            releaseOutputBuffer(i);	// frees the mbuf of a zero-copy write
+        if (fPipeOutBuff[i].pipeOutMDP)
+            {
+            fPipeOutBuff[i].pipeOutMDP->release();
+            fPipeOutBuff[i].pipeOutMDP = NULL;
+            fPipeOutBuff[i].pipeOutBuffer = NULL;
+            }
+        }
+    for (i=0; i<kOutSlabChunks+1; i++)
+        {
+        if (fOutSlab[i])
+            {
+            fOutSlab[i]->release();
+            fOutSlab[i] = NULL;
+            }
+        }
+    fOutSlabCount = 0;
+    fOutSlabBytes = 0;
+    fOutSlabPeak = 0;
+    fOutSlabLargeUsed = false;
+    fOutSlabIdle = 0;
+    initOutputBuffers();
+    
+}/* end freeOutputBuffers */
+
 /* EOF */
\ No newline at end of file
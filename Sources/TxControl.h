@@ -0,0 +1,170 @@
+/*
+ File:		TxControl.h
+
+ Description:	Transmit policy: when an aggregated transfer is sent, how the transfer sizes are
+ counted, and how many writes may be in flight. Kept apart from Driver.h so that 'make hosttest' can run the very code the driver
+ runs against simulated traffic.
+
+ Copyright:		Copyright 2004-2010 H. Nikolaus Schaller
+
+ Disclaimer:		This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2, or (at your option)
+ any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+ */
+
+#ifndef INCLUDE_TXCONTROL_H
+#define INCLUDE_TXCONTROL_H
+
+#ifdef HOST_TEST
+#include "HostTest.h"				/* make hosttest */
+#else
+#include <IOKit/IOLib.h>
+#endif
+
+#define kTxHoldMinUS			50					// shortest adaptive aggregation timeout
+#define kTxGapMaxUS				10000				// longer gaps between frames count as this
+#define kTxBatchBuckets			6
+#define kTxDepthMin				2					// the depth controller never allows less writes in flight
+#define kTxDepthInit			16
+#define kTxDelayTargetUS		2000				// write latency above the base latency the controller accepts
+#define kTxLatencyWindow		10					// watchdog ticks the base (minimum) latency is remembered
+
+// In-flight depth controller: AIMD on the submit to completion time of the writes
+
+struct tx_depth
+    {
+    UInt32	limit;			// writes allowed in flight
+    UInt32	max;			// never more than that
+    UInt32	acked;			// completions in this round (limit completions)
+    bool	hit;			// the transmit path ran into limit in this round
+    UInt32	target;			// us, queueing delay accepted (TxDelayTargetUS)
+    UInt32	latAvg;			// us, moving average
+    UInt32	latMin[2];		// us, minimum in the current and the previous window
+    UInt32	ticks;			// watchdog ticks in the current window
+    };
+
+/* tx_gap_update - moving average of the gap between transmitted frames
+ * avg - the average so far (us), gap - since the last frame (us)
+ */
+static inline UInt32 tx_gap_update(UInt32 avg, UInt64 gap)
+{
+    if (gap > kTxGapMaxUS)
+        gap = kTxGapMaxUS;
+    return (7 * avg + (UInt32) gap) / 8;
+}
+
+/* tx_send_now - send the transfer being filled right after a frame has been added?
+ * full - it can't take another frame, idle - nothing else waits to be transmitted,
+ * inFlight - writes in flight including this one, gapAvg - tx_gap_update, timeout - fNtbTxTimeout
+ * Once the queue has drained nothing is gained by waiting if no other write is in flight
+ * (waiting would only add latency) or if frames arrive too slowly to be aggregated.
+ */
+static inline bool tx_send_now(bool full, bool idle, UInt32 inFlight, UInt32 gapAvg, UInt32 timeout)
+{
+    return full || (idle && (inFlight <= 1 || gapAvg >= timeout));
+}
+
+/* tx_hold_us - how long the first frame of a transfer may wait for more
+ * About two average gaps between frames, at least kTxHoldMinUS and at most timeout.
+ */
+static inline UInt32 tx_hold_us(UInt32 gapAvg, UInt32 timeout)
+{
+    return MIN(timeout, MAX(kTxHoldMinUS, 2 * gapAvg));
+}
+
+/* tx_batch_bucket - histogram bucket for a transfer of count frames (> 0):
+ * 1, 2, 3-4, 5-8, 9-16, 17 and more
+ */
+static inline UInt32 tx_batch_bucket(UInt32 count)
+{
+    UInt32 bucket = 0;
+    
+    for (count--; count != 0 && bucket < kTxBatchBuckets - 1; count >>= 1)
+        bucket++;
+    return bucket;
+}
+
+/* tx_restart - restart the stalled transmit queue with inFlight writes left of limit?
+ * At half the limit and never only when the last write has completed: the writes still in
+ * flight have to keep the link busy until the new ones are submitted. At a quarter (0 for
+ * a limit below 4) the link ran dry before every restart unless the limit was far above
+ * what the link needs.
+ */
+static inline bool tx_restart(UInt32 inFlight, UInt32 limit)
+{
+    return inFlight <= MAX(limit / 2, 1);
+}
+
+/* tx_depth_init - start with kTxDepthInit writes in flight, at most max
+ * target - the queueing delay (us) the depth is tuned for
+ */
+static inline void tx_depth_init(struct tx_depth *d, UInt32 target, UInt32 max)
+{
+    d->limit = kTxDepthInit;
+    d->max = max;
+    d->acked = 0;
+    d->hit = false;
+    d->target = target;
+    d->latAvg = 0;
+    d->latMin[0] = d->latMin[1] = 0xffffffff;
+    d->ticks = 0;
+}
+
+/* tx_depth_base - the base latency, i.e. of a write which didn't wait behind others */
+
+static inline UInt32 tx_depth_base(const struct tx_depth *d)
+{
+    return MIN(d->latMin[0], d->latMin[1]);
+}
+
+/* tx_depth_update - feed the latency (us) of a completed write
+ * Once per round (limit completions) the limit is cut by a quarter if the average latency
+ * exceeds the base by more than target, since more writes in flight would only queue on
+ * the host. Otherwise it grows by one if the transmit path ran into it.
+ * Returns true if the limit was adjusted.
+ */
+static inline bool tx_depth_update(struct tx_depth *d, UInt32 latency)
+{
+    UInt32 limit = d->limit;
+    
+    d->latAvg = d->latAvg ? (7 * d->latAvg + latency) / 8 : latency;
+    if (latency < d->latMin[0])
+        d->latMin[0] = latency;
+    if (++d->acked < limit)
+        return false;
+    if (d->latAvg > tx_depth_base(d) + d->target)
+        limit -= limit / 4;		// multiplicative decrease
+    else if (d->hit)
+        limit++;				// additive increase
+    d->limit = MAX(kTxDepthMin, MIN(limit, d->max));
+    d->acked = 0;
+    d->hit = false;
+    return true;
+}
+
+/* tx_depth_tick - once per watchdog tick: the base latency is the minimum of the last
+ * kTxLatencyWindow ticks, so that it follows a link which got slower
+ */
+static inline void tx_depth_tick(struct tx_depth *d)
+{
+    if (++d->ticks >= kTxLatencyWindow)
+        {
+        d->latMin[1] = d->latMin[0];
+        d->latMin[0] = 0xffffffff;
+        d->ticks = 0;
+        }
+}
+
+#endif INCLUDE_TXCONTROL_H
+/* EOF */